@@ -7,6 +7,6 @@
 a="/$0"; a=${a%/*}; a=${a:-.}; a=${a#/}/; EDIR=$(cd $a; pwd)
 test "$1" = "" || { test -d $1; cd $1; }
 
-cp $EDIR/esplora.c plugins
+cp $EDIR/esplora*.[ch] plugins
 patch -p1 < $EDIR/Makefile.patch
 #sed -i 's/LDLIBS = /LDLIBS = -lcurl -lssl -lcrypto /g' Makefile
@@ -1,13 +1,23 @@
 #include <bitcoin/base58.h>
 #include <bitcoin/block.h>
+#include <bitcoin/chainparams.h>
 #include <bitcoin/feerate.h>
+#include <bitcoin/pullpush.h>
 #include <bitcoin/script.h>
 #include <bitcoin/shadouble.h>
+#include <bitcoin/tx.h>
+#include <bitcoin/varint.h>
 #include <ccan/array_size/array_size.h>
 #include <ccan/cast/cast.h>
+#include <ccan/crypto/siphash24/siphash24.h>
+#include <ccan/endian/endian.h>
+#include <ccan/htable/htable_type.h>
 #include <ccan/io/io.h>
+#include <ccan/io/io_plan.h>
 #include <ccan/json_out/json_out.h>
+#include <ccan/list/list.h>
 #include <ccan/pipecmd/pipecmd.h>
+#include <ccan/read_write_all/read_write_all.h>
 #include <ccan/str/hex/hex.h>
 #include <ccan/take/take.h>
 #include <ccan/tal/grab_file/grab_file.h>
@@ -15,12 +25,21 @@
 #include <ccan/tal/str/str.h>
 #include <common/json_helpers.h>
 #include <common/memleak.h>
+#include <common/pseudorand.h>
 #include <common/utils.h>
 #include <curl/curl.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <netdb.h>
+#include <plugins/esplora_hex.h>
 #include <plugins/libplugin.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <wire/wire.h>
 
 /* Esplora base URL */
 const char *BASE_URL = "https://blockstream.info";
@@ -47,7 +66,7 @@ struct proxy_conf {
 
 struct esplora {
 
-	/* The endpoint to query for Bitcoin data. */
+	/* The endpoints to query for Bitcoin data, comma-separated. */
 	char *endpoint;
 
 	/* CA stuff for TLS. */
@@ -60,14 +79,77 @@ struct esplora {
 	/* Make curl request over proxy socks5 */
 	bool proxy_disabled;
 
+	/* Over how many isolated Tor circuits do we spread requests ? */
+	u32 tor_circuits;
+
 	/* How many times do we retry curl requests ? */
 	u32 n_retries;
+
+	/* How long can a request take, retries included, and each transfer
+	 * or connection of it (seconds) ? */
+	u32 deadline;
+	u32 timeout;
+	u32 connect_timeout;
+
+	/* How many requests per second can we send each endpoint (0 for no
+	 * limit), and how many at once after a quiet period ? */
+	u32 rate;
+	u32 burst;
+
+	/* How many connections (and curl handles) do we keep around ? */
+	u32 max_connections;
+
+	/* Do we multiplex requests over HTTP/2 connections, and how many
+	 * at once on each ? */
+	bool http2;
+	u32 max_streams;
+
+	/* Where we keep our files, relative to the lightningd directory. */
+	char *datadir;
+
+	/* How big can the block store grow, in MiB (0 to disable) ? */
+	u32 blockstore_mb;
+
+	/* How many blocks do we fetch ahead on sequential sync (0 to
+	 * disable), and how many MiB of them can we hold in memory ? */
+	u32 prefetch_depth;
+	u32 prefetch_mb;
+
+	/* How long do we serve fee estimates and the chain tip from our
+	 * cache (seconds) ? */
+	u32 fees_ttl;
+	u32 tip_ttl;
+
+	/* How often do we poll the chain tip (seconds, 0 to disable) ? */
+	u32 tip_poll;
+
+	/* How often do we rebroadcast what we sent until it confirms
+	 * (seconds, 0 to disable) ? */
+	u32 rebroadcast;
+
+	/* Where we dump our statistics every STATS_DUMP_SEC, if set. */
+	char *stats_file;
+
+	/* Where we write a trace of our commands and requests, if set. */
+	char *trace_file;
+
+	/* The Electrum server (host:port) we ask instead of esplora for all
+	 * but raw blocks, if set. */
+	char *electrum;
+
+	/* The REST interface of our own bitcoind we ask first, if set. */
+	char *core_rest;
+
+	/* How often do we snapshot our caches for the next start (seconds,
+	 * 0 to disable) ? */
+	u32 snapshot;
 };
 
 static struct esplora *esplora;
 static struct proxy_conf *proxy_conf;
 
 struct curl_memory_data {
+	/* tal_count() of it is what we have room for. */
 	u8 *memory;
 	size_t size;
 };
@@ -98,13 +180,177 @@ static bool get_u32_from_string(const tal_t *ctx, u32 *parsed_number,
 	return true;
 }
 
+static bool json_to_blkid(const char *buffer, const jsmntok_t *tok,
+			  struct bitcoin_blkid *blkid)
+{
+	return bitcoin_blkid_from_hex(buffer + tok->start,
+				      tok->end - tok->start, blkid);
+}
+
+/* Chrome's trace event format, which Perfetto and chrome://tracing
+ * load: we append complete ("X") events to a JSON array, which they
+ * don't mind being left unterminated. Each command gets a track of its
+ * own, whatever isn't done for one goes on track 0. */
+struct tracer {
+	struct plugin *plugin;
+	int fd;
+	struct timemono start;
+
+	/* Did a write fail ? We then stop, and said so once. */
+	bool broken;
+
+	/* The commands being traced, and their track. */
+	const struct command **cmds;
+	u64 *tracks;
+	u64 last_track;
+};
+
+static struct tracer *tracer;
+
+/* When a span starts, if we are tracing at all. */
+static struct timemono trace_now(void)
+{
+	static const struct timemono never;
+
+	return tracer ? time_mono() : never;
+}
+
+static void trace_write(const char *event)
+{
+	if (tracer->broken)
+		return;
+	if (!write_all(tracer->fd, event, strlen(event))) {
+		plugin_log(tracer->plugin, LOG_UNUSUAL, "Could not trace: %s",
+			   strerror(errno));
+		tracer->broken = true;
+	}
+}
+
+/* `args` is a JSON object (e.g. "{\"bytes\":42}"), or NULL. */
+static void trace_event(u64 track, const char *name, const char *cat,
+			struct timemono start, u64 dur_usec, const char *args)
+{
+	u64 ts = time_to_usec(timemono_between(start, tracer->start));
+
+	trace_write(tal_fmt(tmpctx,
+			    "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+			    "\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ","
+			    "\"pid\":1,\"tid\":%" PRIu64 "%s%s},\n",
+			    name, cat, ts, dur_usec, track,
+			    args ? ",\"args\":" : "", args ? args : ""));
+}
+
+/* A span from `start` to now. */
+static void trace_span(u64 track, const char *name, const char *cat,
+		       struct timemono start, const char *args)
+{
+	trace_event(track, name, cat, start,
+		    time_to_usec(timemono_since(start)), args);
+}
+
+static void trace_track_name(u64 track, const char *name)
+{
+	trace_write(tal_fmt(tmpctx,
+			    "{\"name\":\"thread_name\",\"ph\":\"M\","
+			    "\"pid\":1,\"tid\":%" PRIu64 ","
+			    "\"args\":{\"name\":\"%s\"}},\n",
+			    track, name));
+}
+
+/* The track of the command `ctx` belongs to, if any. */
+static u64 trace_track(const tal_t *ctx)
+{
+	for (; ctx; ctx = tal_parent(ctx)) {
+		for (size_t i = 0; i < tal_count(tracer->cmds); i++) {
+			if (tracer->cmds[i] == ctx)
+				return tracer->tracks[i];
+		}
+	}
+	return 0;
+}
+
+static u64 trace_command_start(const struct command *cmd)
+{
+	u64 track = ++tracer->last_track;
+
+	tal_arr_expand(&tracer->cmds, cmd);
+	tal_arr_expand(&tracer->tracks, track);
+	trace_track_name(track, tal_fmt(tmpctx, "%s #%" PRIu64,
+					cmd->methodname, track));
+	return track;
+}
+
+static void trace_command_end(u64 track)
+{
+	for (size_t i = 0; i < tal_count(tracer->tracks); i++) {
+		if (tracer->tracks[i] == track) {
+			tal_arr_remove(&tracer->cmds, i);
+			tal_arr_remove(&tracer->tracks, i);
+			return;
+		}
+	}
+}
+
+static void destroy_tracer(struct tracer *t)
+{
+	close(t->fd);
+}
+
+static struct tracer *new_tracer(struct plugin *p, const char *path)
+{
+	struct tracer *t = tal(p, struct tracer);
+
+	t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (t->fd < 0 || !write_all(t->fd, "[\n", 2)) {
+		if (t->fd >= 0)
+			close(t->fd);
+		return tal_free(t);
+	}
+	tal_add_destructor(t, destroy_tracer);
+	t->plugin = p;
+	t->start = time_mono();
+	t->broken = false;
+	t->cmds = tal_arr(t, const struct command *, 0);
+	t->tracks = tal_arr(t, u64, 0);
+	t->last_track = 0;
+	return t;
+}
+
+/* json_add_hex, through our hex kernels */
+static void json_add_hexbin(struct json_stream *js, const char *fieldname,
+			    const u8 *data, size_t len)
+{
+	char *dest = json_member_direct(js, fieldname, 2 * len + 2);
+	struct timemono start = trace_now();
+
+	dest[0] = '"';
+	esplora_hex_encode(data, len, dest + 1);
+	dest[1 + 2 * len] = '"';
+	if (tracer)
+		trace_span(trace_track(js), "hex", "json", start,
+			   tal_fmt(tmpctx, "{\"bytes\":%zu}", len));
+}
+
+/* Make room for `len` more bytes (and a NUL), doubling the buffer at
+ * least so that large bodies aren't copied over and over again. */
+static bool memory_reserve(struct curl_memory_data *mem, size_t len)
+{
+	size_t needed = mem->size + len + 1, room = tal_count(mem->memory);
+
+	if (needed <= room)
+		return true;
+	if (needed < room * 2)
+		needed = room * 2;
+	return tal_resize(&mem->memory, needed);
+}
+
 static size_t write_memory_callback(void *contents, size_t size, size_t nmemb,
 				    void *userp)
 {
 	size_t realsize = size * nmemb;
 	struct curl_memory_data *mem = (struct curl_memory_data *)userp;
 
-	if (!tal_resize(&mem->memory, mem->size + realsize + 1)) {
+	if (!memory_reserve(mem, realsize)) {
 		/* out of memory! */
 		fprintf(stderr, "not enough memory (realloc returned NULL)\n");
 		return 0;
@@ -117,482 +363,6058 @@ static size_t write_memory_callback(void *contents, size_t size, size_t nmemb,
 	return realsize;
 }
 
-/** Preform a curl request, retrying up to `n_retries` times. */
-static bool perform_request(CURL *curl)
+/* Latencies are counted in HIST_SUB buckets per power of two of
+ * microseconds (so within 1/HIST_SUB of the real value), up to 2^37us
+ * (38 hours). */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB * (37 - HIST_SUB_BITS + 1))
+
+struct histogram {
+	u64 counts[HIST_BUCKETS];
+	u64 total, max;
+};
+
+/* What we know of a command, a kind of request or an endpoint. */
+struct stats {
+	const char *name;
+
+	u64 requests, retries, bytes;
+	u64 cache_hits, cache_misses;
+
+	/* By HTTP status class (2xx is `status[2]`), no answer in 0. */
+	u64 status[6];
+
+	struct histogram latency;
+};
+
+/* How often do we dump them to `esplora->stats_file` (seconds) ? */
+#define STATS_DUMP_SEC 60
+
+struct stats_set {
+	struct stats **commands, **paths, **endpoints;
+};
+
+static struct stats_set *stats;
+
+static size_t hist_index(u64 usec)
+{
+	size_t shift;
+
+	if (usec < HIST_SUB)
+		return usec;
+	shift = 63 - __builtin_clzll(usec) - HIST_SUB_BITS;
+	if ((shift + 1) * HIST_SUB >= HIST_BUCKETS)
+		return HIST_BUCKETS - 1;
+	return (shift + 1) * HIST_SUB + (usec >> shift) - HIST_SUB;
+}
+
+/* The lowest value counted in bucket `i`. */
+static u64 hist_value(size_t i)
 {
-	CURLcode res;
-	u32 retries = 0;
+	if (i < HIST_SUB)
+		return i;
+	return (u64)(i % HIST_SUB + HIST_SUB) << (i / HIST_SUB - 1);
+}
 
-	for (;;) {
-		res = curl_easy_perform(curl);
-		if (res == CURLE_OK)
-			return true;
+static void hist_record(struct histogram *h, struct timerel t)
+{
+	u64 usec = time_to_usec(t);
 
-		if (++retries > esplora->n_retries)
-			return false;
-		sleep(1);
+	h->counts[hist_index(usec)]++;
+	h->total++;
+	if (usec > h->max)
+		h->max = usec;
+}
+
+/* The value below which `per_mille` of them are, middle of its bucket. */
+static u64 hist_percentile(const struct histogram *h, u64 per_mille)
+{
+	u64 rank = (h->total * per_mille + 999) / 1000, seen = 0;
+
+	for (size_t i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if (seen >= rank && seen > 0) {
+			u64 mid = (hist_value(i) + hist_value(i + 1)) / 2;
+			return mid < h->max ? mid : h->max;
+		}
 	}
+	return h->max;
 }
 
-static u8 *request(const tal_t *ctx, const char *url, const bool post,
-		   const char *data)
+static struct stats *stats_find(struct stats ***set, const char *name)
 {
-	long response_code;
-	struct curl_memory_data chunk;
-	chunk.memory = tal_arr(ctx, u8, 64);
-	chunk.size = 0;
+	struct stats *st;
+
+	for (size_t i = 0; i < tal_count(*set); i++) {
+		if (streq((*set)[i]->name, name))
+			return (*set)[i];
+	}
+	st = tal(stats, struct stats);
+	memset(st, 0, sizeof(*st));
+	st->name = tal_strdup(st, name);
+	tal_arr_expand(set, st);
+	return st;
+}
+
+/* What we count requests to `path` as, e.g. "/block/:hash/raw", or
+ * "/rest/getutxos/checkmempool/:outpoint.bin" for bitcoind's REST
+ * interface (whatever the number of outpoints). */
+static struct stats *stats_for_path(const char *path)
+{
+	char **parts = tal_strsplit(tmpctx, path, "/", STR_EMPTY_OK);
+	char *name = tal_strdup(tmpctx, "");
+	const char *ext = "", *prev = NULL;
+	size_t n = 0;
+
+	while (parts[n])
+		n++;
+	if (n > 0 && strchr(parts[n - 1], '.')) {
+		ext = strchr(parts[n - 1], '.');
+		parts[n - 1] = tal_strndup(parts, parts[n - 1],
+					   ext - parts[n - 1]);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		const char *part = parts[i];
+		size_t len = strlen(part);
+		size_t hex = strspn(part, "0123456789abcdefABCDEF");
+
+		if (len == 64 && hex == len)
+			part = ":hash";
+		else if (len > 0 && strspn(part, "0123456789") == len)
+			part = ":height";
+		else if (hex == 64 && part[64] == '-') {
+			part = ":outpoint";
+			if (prev && streq(prev, part))
+				continue;
+		}
+		tal_append_fmt(&name, "%s%s", i ? "/" : "", part);
+		prev = part;
+	}
+	tal_append_fmt(&name, "%s", ext);
+	return stats_find(&stats->paths, name);
+}
+
+static void stats_status(struct stats *st, long status)
+{
+	if (status < 100 || status >= 600)
+		status = 0;
+	st->status[status / 100]++;
+}
+
+/* Did we have what `path` would have answered at hand ? */
+static void stats_cache(const char *path, bool hit)
+{
+	struct stats *st = stats_for_path(path);
+
+	if (hit)
+		st->cache_hits++;
+	else
+		st->cache_misses++;
+}
+
+/* Time `cmd` until it's answered. */
+struct command_timing {
+	struct stats *stats;
+	struct timemono started;
+	u64 track;
+};
+
+static void destroy_command_timing(struct command_timing *ct)
+{
+	hist_record(&ct->stats->latency, timemono_since(ct->started));
+	if (tracer) {
+		trace_span(ct->track, ct->stats->name, "command", ct->started,
+			   NULL);
+		trace_command_end(ct->track);
+	}
+}
+
+static void stats_command(struct command *cmd)
+{
+	struct command_timing *ct = tal(cmd, struct command_timing);
 
+	ct->stats = stats_find(&stats->commands, cmd->methodname);
+	ct->stats->requests++;
+	ct->started = time_mono();
+	ct->track = tracer ? trace_command_start(cmd) : 0;
+	tal_add_destructor(ct, destroy_command_timing);
+}
+
+static void json_add_stats(struct json_stream *js, const struct stats *st)
+{
+	static const char *status_names[] = {"none", "1xx", "2xx",
+					     "3xx",  "4xx", "5xx"};
+
+	json_object_start(js, NULL);
+	json_add_string(js, "name", st->name);
+	json_add_u64(js, "requests", st->requests);
+	json_add_u64(js, "retries", st->retries);
+	json_add_u64(js, "bytes", st->bytes);
+	json_add_u64(js, "cache_hits", st->cache_hits);
+	json_add_u64(js, "cache_misses", st->cache_misses);
+	json_object_start(js, "status");
+	for (size_t i = 0; i < ARRAY_SIZE(status_names); i++) {
+		if (st->status[i])
+			json_add_u64(js, status_names[i], st->status[i]);
+	}
+	json_object_end(js);
+	json_object_start(js, "latency_us");
+	json_add_u64(js, "count", st->latency.total);
+	json_add_u64(js, "p50", hist_percentile(&st->latency, 500));
+	json_add_u64(js, "p99", hist_percentile(&st->latency, 990));
+	json_add_u64(js, "p999", hist_percentile(&st->latency, 999));
+	json_add_u64(js, "max", st->latency.max);
+	json_object_end(js);
+	json_object_end(js);
+}
+
+static void json_add_stats_set(struct json_stream *js)
+{
+	struct {
+		const char *name;
+		struct stats **set;
+	} sets[] = {
+	    {"commands", stats->commands},
+	    {"paths", stats->paths},
+	    {"endpoints", stats->endpoints},
+	};
+
+	for (size_t i = 0; i < ARRAY_SIZE(sets); i++) {
+		json_array_start(js, sets[i].name);
+		for (size_t j = 0; j < tal_count(sets[i].set); j++)
+			json_add_stats(js, sets[i].set[j]);
+		json_array_end(js);
+	}
+}
+
+static struct stats_set *new_stats_set(const tal_t *ctx)
+{
+	struct stats_set *set = tal(ctx, struct stats_set);
+
+	set->commands = tal_arr(set, struct stats *, 0);
+	set->paths = tal_arr(set, struct stats *, 0);
+	set->endpoints = tal_arr(set, struct stats *, 0);
+	return set;
+}
+
+/* How many response buffers we keep around for the next requests, and
+ * how large they can be to be kept. */
+#define HTTP_ARENAS 4
+#define HTTP_ARENA_MAX (4 * 1024 * 1024)
+
+/* We trust Content-Length to size the response buffer up to this. */
+#define HTTP_PRESIZE_MAX (32 * 1024 * 1024)
+
+/* A block download slower than this (bytes/sec) for `esplora->timeout`
+ * seconds is stalled. */
+#define HTTP_LOW_SPEED_BYTES 1024
+
+/* We hedge a request to a second endpoint if the first one didn't answer
+ * within its usual latency plus this many deviations (like TCP's
+ * retransmission timeout), but not sooner than HEDGE_MIN_MSEC. Until we
+ * timed it HEDGE_SAMPLES times, we wait HEDGE_DEFAULT_MSEC. */
+#define HEDGE_DEVIATIONS 4
+#define HEDGE_MIN_MSEC 50
+#define HEDGE_SAMPLES 8
+#define HEDGE_DEFAULT_MSEC 1000
+
+/* We wait RETRY_BASE_MSEC before retrying, twice as long each time up to
+ * RETRY_MAX_MSEC, minus a random part of it (up to half). */
+#define RETRY_BASE_MSEC 250
+#define RETRY_MAX_MSEC 8000
+
+/* After that many failures in a row, we leave an endpoint alone for
+ * BREAKER_SEC seconds, then let a single request through: if it fails
+ * too, we wait twice as long, up to BREAKER_MAX_SEC. */
+#define BREAKER_FAILURES 5
+#define BREAKER_SEC 5
+#define BREAKER_MAX_SEC 300
+
+/* How long we back off when an endpoint answers 429 Too Many Requests
+ * without telling us (or longer than that), in seconds. */
+#define THROTTLE_SEC 1
+#define THROTTLE_MAX_SEC 60
+
+/* What a request is for, most urgent first: that's the order in which
+ * they get started, and each class can only run so many at once. */
+enum http_prio {
+	/* Transactions we send, e.g. penalty ones. */
+	HTTP_BROADCAST,
+	/* Fee estimates and the chain tip. */
+	HTTP_CHAIN,
+	/* Outputs lightningd checks, e.g. those of gossiped channels. */
+	HTTP_UTXO,
+	/* Blocks (and their hashes) lightningd asked for. */
+	HTTP_BLOCK,
+	/* Blocks it will probably ask for next. */
+	HTTP_PREFETCH,
+	/* Rebroadcasts, and other things that can wait. */
+	HTTP_BACKGROUND,
+	HTTP_NUM_PRIOS
+};
+
+/* How many requests of each class can run at once (0 for no limit). */
+static const size_t http_prio_max[HTTP_NUM_PRIOS] = {0, 4, 8, 4, 4, 2};
+
+/* One of the esplora instances we can ask. */
+struct endpoint {
+	const char *url;
+
+	/* Time to first byte: moving average and mean deviation (msec). */
+	double latency, deviation;
+	u64 samples;
+
+	/* Moving average of failed requests, 0 to 1. */
+	double errors;
+
+	/* Failures in a row, and until when we don't ask it if there are
+	 * BREAKER_FAILURES or more of them. */
+	u32 failures;
+	struct timemono closed_until;
+
+	/* Is a request seeing if it's back ? */
+	bool probing;
+
+	/* Requests we can send it right away, refilled at `esplora->rate`
+	 * per second up to `esplora->burst`, and until when it asked us to
+	 * slow down. */
+	double tokens;
+	struct timemono refilled;
+	struct timemono throttled_until;
+
+	/* What we sent it, and how it did. */
+	struct stats *stats;
+
+	/* Our own bitcoind: we don't rate-limit it, don't retry it (we ask
+	 * esplora instead) and don't go through the proxy for it. */
+	bool direct;
+};
+
+/* Only transfers that big tell how fast a Tor circuit is. */
+#define CIRCUIT_MIN_BYTES (64 * 1024)
+/* How many of them before we judge it, and how much slower than the
+ * fastest one it can be before we ask Tor for another. */
+#define CIRCUIT_SAMPLES 4
+#define CIRCUIT_SLOWDOWN 4
+
+/* A SOCKS identity: with IsolateSOCKSAuth (on by default), Tor puts the
+ * streams of each username on a circuit of its own. */
+struct circuit {
+	char *user;
+
+	/* How many transfers are on it right now. */
+	size_t active;
+
+	/* Moving average of its download rate (bytes per second), and out
+	 * of how many transfers. */
+	double rate;
+	u32 samples;
+};
+
+/* All our requests go through a curl multi handle, which is driven by a
+ * timer inside the plugin io loop: a slow transfer never blocks the
+ * other commands lightningd is waiting for. */
+struct http_engine {
+	struct plugin *plugin;
+
+	CURLM *multi;
+
+	/* DNS cache, TLS sessions and connections shared by all handles. */
+	CURLSH *share;
+
+	/* Do we ask for HTTP/2, multiplexing requests to an endpoint over
+	 * one connection (per Tor circuit) ? */
+	bool http2;
+
+	/* Configured handles waiting to be reused, at most
+	 * `esplora->max_connections` of them. */
+	CURL **idle;
+
+	/* Non-NULL while curl wants us to call it back after some time. */
+	struct plugin_timer *curl_timer;
+
+	/* The socket we are telling curl about, if any. */
+	struct http_socket *acting;
+
+	/* Response buffers of past requests, at most HTTP_ARENAS of them. */
+	u8 **arenas;
+
+	/* Where we send requests, in the order they were configured. */
+	struct endpoint *endpoints;
+
+	/* The REST interface of our bitcoind, if any: not one of the
+	 * `endpoints`, it only gets the requests meant for it. */
+	struct endpoint *core;
+
+	/* The SOCKS proxy to go through, if any, and the circuits we spread
+	 * requests over (none if we don't isolate them). */
+	const char *proxy;
+	struct circuit *circuits;
+
+	/* Attempts that lost the race to a hedged one: curl doesn't let us
+	 * remove them from within its callbacks. */
+	struct http_attempt **losers;
+
+	/* Requests waiting for their turn, by class, and how many of each
+	 * class are running. */
+	struct list_head queued[HTTP_NUM_PRIOS];
+	size_t num_running[HTTP_NUM_PRIOS];
+
+	/* Non-NULL while we are scheduled to start queued requests, right
+	 * away if `dispatch_soon`. */
+	struct plugin_timer *dispatch_timer;
+	bool dispatch_soon;
+};
+
+static struct http_engine *http;
+
+/* A transfer from one endpoint: a hedged request has two of them. */
+struct http_attempt {
+	struct http_request *req;
+	struct endpoint *endpoint;
 	CURL *curl;
-	curl = curl_easy_init();
-	if (!curl) {
-		return NULL;
+
+	/* Is `curl` currently attached to the multi handle ? */
+	bool in_multi;
+
+	struct timemono started;
+
+	/* Did the body (or at least the headers) start coming ? */
+	bool answered;
+
+	/* Whatever it sends is dropped: the other attempt won, or this one
+	 * is a server error while the other might do better. */
+	bool lost, discard;
+
+	/* Is it seeing if a failing endpoint is back ? */
+	bool probe;
+
+	/* The Tor circuit it goes through, if we isolate them. */
+	struct circuit *circuit;
+
+	/* Where in the body it starts: past what an interrupted transfer
+	 * already got us. */
+	size_t offset;
+};
+
+struct http_request {
+	/* Where to GET or POST to, on any endpoint. */
+	const char *path;
+
+	/* The data to POST, NULL for a GET. */
+	const char *postdata;
+
+	/* What it's for, and whether it's waiting for its turn (in
+	 * `http->queued`) or running. */
+	enum http_prio prio;
+	struct list_node list;
+	bool queued, running;
+
+	/* If set, the only endpoint we send it to, failing or not. */
+	struct endpoint *only;
+
+	/* What we count it as, when it was made and what track we trace
+	 * it on. */
+	struct stats *stats;
+	struct timemono created;
+	u64 track;
+
+	/* The transfer in flight, and its hedge if any. */
+	struct http_attempt *attempt, *hedge;
+	struct plugin_timer *hedge_timer;
+
+	struct curl_memory_data chunk;
+
+	/* How many times did we already retry, and until when can we ? */
+	u32 retries;
+	struct plugin_timer *retry_timer;
+	struct timemono deadline;
+
+	/* If set, takes the body as it arrives instead of us buffering it,
+	 * unless it returns false for the first chunk of an attempt. */
+	bool (*stream)(const u8 *data, size_t len, size_t offset, s64 total,
+		       void *arg);
+	bool buffering;
+	size_t streamed;
+
+	/* Is the body the same on every endpoint, every time (e.g. a raw
+	 * block) ? An interrupted transfer is then resumed with a Range
+	 * request, `resumed` counts how many times, and `total` is its
+	 * length (-1 if unknown). */
+	bool resumable;
+	u32 resumed;
+	s64 total;
+
+	/* Called once the request is over, with NULL on failure. Or, if
+	 * `status_cb` is set instead, with whatever the endpoint answered
+	 * and its HTTP status (NULL and 0 if it didn't). */
+	void (*cb)(const u8 *res, void *arg);
+	void (*status_cb)(const u8 *res, long status, void *arg);
+	void *arg;
+};
+
+/* A request made on behalf of a command. */
+struct command_request {
+	struct command *cmd;
+	struct command_result *(*cb)(struct command *cmd, const u8 *res,
+				     void *arg);
+	void *arg;
+};
+
+static void endpoint_timed(struct endpoint *ep, u64 msec)
+{
+	double err = (double)msec - ep->latency;
+
+	if (ep->samples++ == 0) {
+		ep->latency = msec;
+		ep->deviation = msec / 2.0;
+		return;
 	}
+	ep->latency += err / 8;
+	ep->deviation += ((err < 0 ? -err : err) - ep->deviation) / 4;
+}
 
-	curl_easy_setopt(curl, CURLOPT_URL, url);
-	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "gzip");
-	if (!esplora->proxy_disabled && proxy_conf->proxy_enabled) {
-		int length = snprintf(NULL, 0, "%d", proxy_conf->port);
-		// This contains +2 because I added the separator : before to
-		// add port number!
-		char *str = malloc(length + 2);
-		snprintf(str, length + 2, ":%d", proxy_conf->port);
-		char *address = tal_strcat(ctx, proxy_conf->address, str);
-		char *curl_query = tal_strcat(ctx, "socks5h://", address);
-		curl_easy_setopt(curl, CURLOPT_PROXY, curl_query);
+static void endpoint_result(struct endpoint *ep, bool ok)
+{
+	u32 sec;
+
+	ep->errors += ((ok ? 0.0 : 1.0) - ep->errors) / 8;
+	ep->probing = false;
+	if (ok) {
+		if (ep->failures >= BREAKER_FAILURES)
+			plugin_log(http->plugin, LOG_INFORM, "%s is back",
+				   ep->url);
+		ep->failures = 0;
+		return;
 	}
-	if (esplora->verbose)
-		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
-	if (esplora->cainfo_path != NULL)
-		curl_easy_setopt(curl, CURLOPT_CAINFO, esplora->cainfo_path);
-	if (esplora->capath != NULL)
-		curl_easy_setopt(curl, CURLOPT_CAPATH, esplora->capath);
-	if (post) {
-		curl_easy_setopt(curl, CURLOPT_POST, 1L);
-		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
+
+	if (++ep->failures < BREAKER_FAILURES)
+		return;
+	sec = BREAKER_SEC;
+	for (u32 i = BREAKER_FAILURES; i < ep->failures; i++) {
+		if (sec >= BREAKER_MAX_SEC / 2)
+			break;
+		sec *= 2;
 	}
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
-	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_memory_callback);
+	ep->closed_until = timemono_add(time_mono(), time_from_sec(sec));
+	plugin_log(http->plugin, LOG_UNUSUAL,
+		   "%s failed %u times in a row, not asking it for %us",
+		   ep->url, ep->failures, sec);
+}
 
-	/* This populates the curl struct on success. */
-	if (!perform_request(curl))
-		return tal_free(chunk.memory);
-	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response_code);
-	if (response_code != 200)
-		return tal_free(chunk.memory);
+/* Can we send it a request ? Not if it keeps failing, except for one
+ * from time to time to see if it's back. */
+static bool endpoint_usable(const struct endpoint *ep)
+{
+	if (ep->failures < BREAKER_FAILURES)
+		return true;
+	return !ep->probing && timemono_after(time_mono(), ep->closed_until);
+}
+
+static void endpoint_throttled(struct endpoint *ep, u64 sec)
+{
+	if (sec == 0)
+		sec = THROTTLE_SEC;
+	if (sec > THROTTLE_MAX_SEC)
+		sec = THROTTLE_MAX_SEC;
+	ep->tokens = 0;
+	ep->throttled_until = timemono_add(time_mono(), time_from_sec(sec));
+	plugin_log(http->plugin, LOG_UNUSUAL,
+		   "%s is rate-limiting us, slowing down for %" PRIu64 "s",
+		   ep->url, sec);
+}
+
+/* How long until we can send it a request (msec), 0 if right now. */
+static u64 endpoint_wait_msec(struct endpoint *ep)
+{
+	struct timemono now = time_mono();
+	struct timerel left;
 
-	curl_easy_cleanup(curl);
-	tal_resize(&chunk.memory, chunk.size);
+	if (timemono_after(ep->throttled_until, now)) {
+		left = timemono_between(ep->throttled_until, now);
+		return time_to_msec(left) + 1;
+	}
+	if (esplora->rate == 0 || ep->direct)
+		return 0;
 
-	return chunk.memory;
+	ep->tokens += time_to_usec(timemono_between(now, ep->refilled)) *
+		      (double)esplora->rate / 1000000;
+	if (ep->tokens > esplora->burst)
+		ep->tokens = esplora->burst;
+	ep->refilled = now;
+	if (ep->tokens >= 1)
+		return 0;
+	return (1 - ep->tokens) * 1000 / esplora->rate + 1;
 }
 
-static char *request_get(const tal_t *ctx, const char *url)
+/* Lower is better: endpoints we never timed come first, so that we get
+ * to know them. */
+static double endpoint_score(const struct endpoint *ep)
 {
-	return (char *)request(ctx, url, false, NULL);
+	return (ep->latency + 1) * (1 + 10 * ep->errors);
 }
 
-static char *request_post(const tal_t *ctx, const char *url, const char *data)
+static u64 endpoint_hedge_msec(const struct endpoint *ep)
 {
-	return (char *)request(ctx, url, true, data);
+	double msec;
+
+	if (ep->samples < HEDGE_SAMPLES)
+		return HEDGE_DEFAULT_MSEC;
+	msec = ep->latency + HEDGE_DEVIATIONS * ep->deviation;
+	return msec < HEDGE_MIN_MSEC ? HEDGE_MIN_MSEC : (u64)msec;
 }
 
-static char *get_network_from_genesis_block(const char *blockhash)
+/* The endpoint we'd rather ask, other than `not` (NULL if none), among
+ * those we can send a request to right now if `ready`. */
+static struct endpoint *endpoint_best(const struct endpoint *not, bool ready)
 {
-	if (strncmp(blockhash,
-		    "000000000019d6689c085ae165831e934ff763ae46a2a6c1"
-		    "72b3f1b60a8ce26f",
-		    64) == 0)
-		return "main";
-	else if (strncmp(blockhash,
-			 "000000000933ea01ad0ee984209779baaec3ced90fa3f4087"
-			 "19526f8d77f4943",
-			 64) == 0)
-		return "test";
-	else if (strncmp(blockhash,
-			 "1466275836220db2944ca059a3a10ef6fd2ea684b0688d2c3"
-			 "79296888a206003",
-			 64) == 0)
-		return "liquidv1";
-	else if (strncmp(blockhash,
-			 "0f9188f13cb7b2c71f2a335e3a4fc328bf5beb436012afca5"
-			 "90b1a11466e2206",
-			 64) == 0)
-		return "regtest";
+	struct endpoint *best = NULL;
+
+	for (size_t i = 0; i < tal_count(http->endpoints); i++) {
+		struct endpoint *ep = &http->endpoints[i];
+		if (ep == not || !endpoint_usable(ep))
+			continue;
+		if (ready && endpoint_wait_msec(ep) != 0)
+			continue;
+		if (!best || endpoint_score(ep) < endpoint_score(best))
+			best = ep;
+	}
+	return best;
+}
+
+static u8 *http_arena_get(const tal_t *ctx)
+{
+	size_t n = tal_count(http->arenas);
+	u8 *arena;
+
+	if (n == 0)
+		return tal_arr(ctx, u8, 64);
+	arena = http->arenas[n - 1];
+	tal_resize(&http->arenas, n - 1);
+	return tal_steal(ctx, arena);
+}
+
+static void http_arena_put(u8 *arena)
+{
+	if (tal_count(http->arenas) >= HTTP_ARENAS ||
+	    tal_bytelen(arena) > HTTP_ARENA_MAX) {
+		tal_free(arena);
+		return;
+	}
+	tal_arr_expand(&http->arenas, tal_steal(http, arena));
+}
+
+static size_t http_buffer(struct http_attempt *att, void *contents,
+			  size_t size, size_t nmemb)
+{
+	struct http_request *req = att->req;
+	curl_off_t total;
+
+	/* Make room for the whole body at once when we know its size. */
+	if (req->chunk.size == 0 &&
+	    curl_easy_getinfo(att->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+			      &total) == CURLE_OK &&
+	    total > 0 && total <= HTTP_PRESIZE_MAX)
+		memory_reserve(&req->chunk, total);
+
+	return write_memory_callback(contents, size, nmemb, &req->chunk);
+}
+
+static u64 http_attempt_msec(const struct http_attempt *att)
+{
+	return time_to_msec(timemono_since(att->started));
+}
+
+/* The other attempt of the same request, if it was hedged. */
+static struct http_attempt *http_attempt_other(struct http_attempt *att)
+{
+	return att == att->req->attempt ? att->req->hedge : att->req->attempt;
+}
+
+/* `att` is of no use anymore, we free it once out of curl's hands. */
+static void http_attempt_lose(struct http_attempt *att)
+{
+	struct http_request *req = att->req;
+
+	/* It's at least that slow. */
+	if (!att->answered)
+		endpoint_timed(att->endpoint, http_attempt_msec(att));
+	att->lost = true;
+	tal_arr_expand(&http->losers, att);
+	if (req->attempt == att)
+		req->attempt = NULL;
+	if (req->hedge == att)
+		req->hedge = NULL;
+}
+
+/* Server errors, and 429 Too Many Requests. */
+static bool http_code_retryable(long response_code)
+{
+	return response_code >= 500 || response_code == 429;
+}
+
+/* `att` is answering: time it, and if it's the first of a hedged request
+ * to do so, it wins. */
+static void http_attempt_answered(struct http_attempt *att)
+{
+	struct http_request *req = att->req;
+	struct http_attempt *other = http_attempt_other(att);
+	long response_code;
+
+	att->answered = true;
+	endpoint_timed(att->endpoint, http_attempt_msec(att));
+	/* Too late to hedge, it's already coming. */
+	req->hedge_timer = tal_free(req->hedge_timer);
+	if (!other)
+		return;
+
+	/* Let the other one try to do better than a server error. */
+	curl_easy_getinfo(att->curl, CURLINFO_RESPONSE_CODE, &response_code);
+	if (http_code_retryable(response_code)) {
+		att->discard = true;
+		return;
+	}
+
+	http_attempt_lose(other);
+	req->attempt = att;
+	req->hedge = NULL;
+}
+
+static size_t http_write_callback(void *contents, size_t size, size_t nmemb,
+				  void *userp)
+{
+	struct http_attempt *att = (struct http_attempt *)userp;
+	struct http_request *req = att->req;
+	size_t realsize = size * nmemb;
+	curl_off_t total;
+	long response_code;
+
+	req->stats->bytes += realsize;
+	att->endpoint->stats->bytes += realsize;
+	if (!att->answered && !att->lost)
+		http_attempt_answered(att);
+	if (att->lost || att->discard)
+		return realsize;
+
+	/* Only 206 Partial Content continues what we have. */
+	if (att->offset != 0) {
+		curl_easy_getinfo(att->curl, CURLINFO_RESPONSE_CODE,
+				  &response_code);
+		if (response_code != 206)
+			return realsize;
+	}
+
+	if (!req->stream || req->buffering)
+		return http_buffer(att, contents, size, nmemb);
+
+	/* What's left of it, if we resumed it. */
+	if (att->offset != 0) {
+		total = req->total;
+	} else {
+		curl_easy_getinfo(att->curl,
+				  CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &total);
+		req->total = total;
+	}
+	if (req->streamed == 0) {
+		/* Don't hand out error pages. */
+		curl_easy_getinfo(att->curl, CURLINFO_RESPONSE_CODE,
+				  &response_code);
+		if (response_code != 200 ||
+		    !req->stream(contents, realsize, 0, total, req->arg)) {
+			req->buffering = true;
+			return http_buffer(att, contents, size, nmemb);
+		}
+	} else if (!req->stream(contents, realsize, req->streamed, total,
+				req->arg))
+		return 0;
+
+	req->streamed += realsize;
+	return realsize;
+}
+
+/* Get a handle with all the options common to our requests set: they
+ * are reused so that we keep hitting the same connection cache. */
+static CURL *http_handle_get(void)
+{
+	size_t n = tal_count(http->idle);
+	CURL *curl;
+
+	if (n > 0) {
+		curl = http->idle[n - 1];
+		tal_resize(&http->idle, n - 1);
+		return curl;
+	}
+
+	curl = curl_easy_init();
+	if (!curl)
+		return NULL;
+
+	curl_easy_setopt(curl, CURLOPT_SHARE, http->share);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT,
+			 (long)esplora->connect_timeout);
+	/* Servers that don't speak HTTP/2 get HTTP/1.1 anyway, and waiting
+	 * for a connection to tell if it multiplexes beats opening more. */
+	if (http->http2) {
+		curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+				 (long)CURL_HTTP_VERSION_2TLS);
+		curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+	} else
+		curl_easy_setopt(curl, CURLOPT_HTTP_VERSION,
+				 (long)CURL_HTTP_VERSION_1_1);
+	if (esplora->verbose)
+		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+	if (esplora->cainfo_path != NULL)
+		curl_easy_setopt(curl, CURLOPT_CAINFO, esplora->cainfo_path);
+	if (esplora->capath != NULL)
+		curl_easy_setopt(curl, CURLOPT_CAPATH, esplora->capath);
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, http_write_callback);
+
+	return curl;
+}
+
+static void http_handle_put(CURL *curl)
+{
+	if (tal_count(http->idle) >= esplora->max_connections) {
+		curl_easy_cleanup(curl);
+		return;
+	}
+	tal_arr_expand(&http->idle, curl);
+}
+
+/* Give `c` a new identity, so that Tor builds it a new circuit. */
+static void circuit_renew(struct circuit *c)
+{
+	tal_free(c->user);
+	c->user = tal_fmt(http, "esplora-%zu-%" PRIu64, c - http->circuits,
+			  pseudorand_u64());
+	c->rate = 0;
+	c->samples = 0;
+}
+
+/* The circuit with the fewest transfers, the fastest one of those. */
+static struct circuit *circuit_pick(void)
+{
+	struct circuit *best = NULL;
+
+	for (size_t i = 0; i < tal_count(http->circuits); i++) {
+		struct circuit *c = &http->circuits[i];
+
+		if (!best || c->active < best->active ||
+		    (c->active == best->active && c->rate > best->rate))
+			best = c;
+	}
+	return best;
+}
+
+/* How fast did `att` download, and is its circuit worth keeping ? */
+static void circuit_timed(const struct http_attempt *att)
+{
+	struct circuit *c = att->circuit, *fastest = NULL;
+	curl_off_t bytes = 0, first = 0, total = 0;
+	double rate;
+
+	curl_easy_getinfo(att->curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+	curl_easy_getinfo(att->curl, CURLINFO_STARTTRANSFER_TIME_T, &first);
+	curl_easy_getinfo(att->curl, CURLINFO_TOTAL_TIME_T, &total);
+	if (bytes < CIRCUIT_MIN_BYTES || total <= first)
+		return;
+
+	rate = (double)bytes * 1000000 / (total - first);
+	if (c->samples++ == 0)
+		c->rate = rate;
+	else
+		c->rate += (rate - c->rate) / 4;
+	if (c->samples < CIRCUIT_SAMPLES)
+		return;
+
+	for (size_t i = 0; i < tal_count(http->circuits); i++) {
+		struct circuit *other = &http->circuits[i];
+
+		if (other->samples >= CIRCUIT_SAMPLES &&
+		    (!fastest || other->rate > fastest->rate))
+			fastest = other;
+	}
+	if (c->rate * CIRCUIT_SLOWDOWN < fastest->rate) {
+		plugin_log(http->plugin, LOG_DBG,
+			   "Circuit %s is slow (%.0f kB/s, %.0f for the best), "
+			   "renewing it",
+			   c->user, c->rate / 1000, fastest->rate / 1000);
+		circuit_renew(c);
+	}
+}
+
+static void destroy_http_attempt(struct http_attempt *att)
+{
+	if (att->circuit)
+		att->circuit->active--;
+	if (att->probe)
+		att->endpoint->probing = false;
+	for (size_t i = 0; i < tal_count(http->losers); i++) {
+		if (http->losers[i] == att) {
+			tal_arr_remove(&http->losers, i);
+			break;
+		}
+	}
+	if (att->in_multi) {
+		curl_multi_remove_handle(http->multi, att->curl);
+	}
+	http_handle_put(att->curl);
+	if (att->req->attempt == att)
+		att->req->attempt = NULL;
+	if (att->req->hedge == att)
+		att->req->hedge = NULL;
+}
+
+/* How much of the body of `req` we already have. */
+static size_t http_request_received(const struct http_request *req)
+{
+	if (req->stream && !req->buffering)
+		return req->streamed;
+	return req->chunk.size;
+}
+
+/* Blocks can weigh megabytes and come through Tor: they take as long as
+ * they take, as long as they keep coming. */
+static bool http_request_bulk(const struct http_request *req)
+{
+	return req->prio == HTTP_BLOCK || req->prio == HTTP_PREFETCH;
+}
+
+/* How long `req` can still take (msec), UINT64_MAX if forever. */
+static u64 http_request_remaining(const struct http_request *req)
+{
+	struct timemono now = time_mono();
+
+	if (esplora->deadline == 0 || http_request_bulk(req))
+		return UINT64_MAX;
+	if (!timemono_after(req->deadline, now))
+		return 0;
+	return time_to_msec(timemono_between(req->deadline, now));
+}
+
+/* Start a transfer for `req` from `ep`. */
+static struct http_attempt *http_attempt_start(struct http_request *req,
+					       struct endpoint *ep)
+{
+	struct http_attempt *att = tal(req, struct http_attempt);
+	const char *url = tal_fmt(tmpctx, "%s%s", ep->url, req->path);
+	u64 timeout = (u64)esplora->timeout * 1000;
+	u64 remaining = http_request_remaining(req);
+
+	att->req = req;
+	att->endpoint = ep;
+	att->in_multi = false;
+	att->answered = false;
+	att->lost = false;
+	att->discard = false;
+	att->probe = !req->only && ep->failures >= BREAKER_FAILURES;
+	att->circuit = NULL;
+	att->offset = req->resumable ? http_request_received(req) : 0;
+	att->curl = http_handle_get();
+	if (!att->curl)
+		return tal_free(att);
+	tal_add_destructor(att, destroy_http_attempt);
+	if (att->probe)
+		ep->probing = true;
+	ep->stats->requests++;
+	/* Handles are reused: tell each one whether to use the proxy. */
+	if (http->proxy)
+		curl_easy_setopt(att->curl, CURLOPT_PROXY,
+				 ep->direct ? "" : http->proxy);
+	att->circuit = ep->direct ? NULL : circuit_pick();
+	if (att->circuit) {
+		att->circuit->active++;
+		curl_easy_setopt(att->curl, CURLOPT_PROXYUSERNAME,
+				 att->circuit->user);
+		curl_easy_setopt(att->curl, CURLOPT_PROXYPASSWORD, "esplora");
+	}
+	if (esplora->rate != 0 && !ep->direct)
+		ep->tokens--;
+
+	/* Don't outlive the request (a zero timeout is no timeout). Handles
+	 * are reused: set both every time. */
+	if (http_request_bulk(req)) {
+		curl_easy_setopt(att->curl, CURLOPT_TIMEOUT_MS, 0L);
+		curl_easy_setopt(att->curl, CURLOPT_LOW_SPEED_LIMIT,
+				 (long)HTTP_LOW_SPEED_BYTES);
+		curl_easy_setopt(att->curl, CURLOPT_LOW_SPEED_TIME,
+				 (long)esplora->timeout);
+	} else {
+		if (remaining != UINT64_MAX &&
+		    (timeout == 0 || remaining < timeout))
+			timeout = remaining ? remaining : 1;
+		curl_easy_setopt(att->curl, CURLOPT_TIMEOUT_MS, (long)timeout);
+		curl_easy_setopt(att->curl, CURLOPT_LOW_SPEED_TIME, 0L);
+	}
+
+	/* curl copies the URL, not the data to POST. */
+	curl_easy_setopt(att->curl, CURLOPT_URL, url);
+	if (req->postdata) {
+		curl_easy_setopt(att->curl, CURLOPT_POST, 1L);
+		curl_easy_setopt(att->curl, CURLOPT_POSTFIELDS, req->postdata);
+	} else
+		curl_easy_setopt(att->curl, CURLOPT_HTTPGET, 1L);
+	curl_easy_setopt(att->curl, CURLOPT_RESUME_FROM_LARGE,
+			 (curl_off_t)att->offset);
+	/* We need the real length of what we stream, and ranges of what we
+	 * resume. */
+	curl_easy_setopt(att->curl, CURLOPT_ACCEPT_ENCODING,
+			 req->stream || req->resumable ? NULL : "gzip");
+	curl_easy_setopt(att->curl, CURLOPT_WRITEDATA, (void *)att);
+	curl_easy_setopt(att->curl, CURLOPT_PRIVATE, att);
+
+	att->started = time_mono();
+	curl_multi_add_handle(http->multi, att->curl);
+	att->in_multi = true;
+	return att;
+}
+
+/* The first endpoint is slow to answer: ask a second one too. */
+static void http_request_hedge(struct http_request *req)
+{
+	struct endpoint *ep;
+
+	/* The timer is freed by libplugin once we return. */
+	req->hedge_timer = NULL;
+	ep = endpoint_best(req->attempt->endpoint, true);
+	if (ep) {
+		plugin_log(http->plugin, LOG_DBG,
+			   "%s is slow to answer %s, asking %s",
+			   req->attempt->endpoint->url, req->path, ep->url);
+		req->hedge = http_attempt_start(req, ep);
+	}
+	timer_complete(http->plugin);
+}
+
+static void http_dispatch(struct http_engine *http);
+
+/* Start queued requests in `msec`, or sooner if we already planned to. */
+static void http_schedule_dispatch(u64 msec)
+{
+	if (http->dispatch_timer && (msec != 0 || http->dispatch_soon))
+		return;
+	tal_free(http->dispatch_timer);
+	http->dispatch_timer = plugin_timer(
+	    http->plugin, time_from_msec(msec), http_dispatch, http);
+	http->dispatch_soon = msec == 0;
+}
+
+/* Wait for our turn. */
+static void http_request_enqueue(struct http_request *req)
+{
+	list_add_tail(&http->queued[req->prio], &req->list);
+	req->queued = true;
+	http_schedule_dispatch(0);
+}
+
+/* All the attempts of `req` are over. */
+static void http_request_stopped(struct http_request *req)
+{
+	if (!req->running)
+		return;
+	req->running = false;
+	http->num_running[req->prio]--;
+	http_schedule_dispatch(0);
+}
+
+/* Someone more urgent is waiting for `req` too. */
+static void http_request_raise(struct http_request *req, enum http_prio prio)
+{
+	if (prio >= req->prio)
+		return;
+	if (req->queued) {
+		list_del(&req->list);
+		list_add_tail(&http->queued[prio], &req->list);
+	} else if (req->running) {
+		http->num_running[req->prio]--;
+		http->num_running[prio]++;
+	}
+	req->prio = prio;
+}
+
+/* Our turn has come: start on `ep`. */
+static bool http_request_run(struct http_request *req, struct endpoint *ep)
+{
+	req->attempt = http_attempt_start(req, ep);
+	if (!req->attempt)
+		return false;
+	req->running = true;
+	http->num_running[req->prio]++;
+
+	/* Sending the same data twice could do harm. */
+	if (tal_count(http->endpoints) > 1 && !req->postdata && !req->only)
+		req->hedge_timer = plugin_timer(
+		    http->plugin,
+		    time_from_msec(endpoint_hedge_msec(req->attempt->endpoint)),
+		    http_request_hedge, req);
+	return true;
+}
+
+static void destroy_http_request(struct http_request *req)
+{
+	if (req->queued)
+		list_del(&req->list);
+	http_request_stopped(req);
+	tal_free(req->retry_timer);
+	tal_free(req->hedge_timer);
+	/* Unless the callback kept the body, reuse its buffer. */
+	if (tal_parent(req->chunk.memory) == req)
+		http_arena_put(req->chunk.memory);
+}
+
+static void http_request_fail(struct http_request *req)
+{
+	hist_record(&req->stats->latency, timemono_since(req->created));
+	/* The callback may well free our parent (e.g. the command), so
+	 * don't hang on it. */
+	tal_steal(tmpctx, req);
+	if (req->status_cb)
+		req->status_cb(NULL, 0, req->arg);
 	else
+		req->cb(NULL, req->arg);
+}
+
+/* How long until an endpoint can take a request (msec), UINT64_MAX if
+ * none can. */
+static u64 http_wait_msec(void)
+{
+	u64 wait = UINT64_MAX;
+
+	for (size_t i = 0; i < tal_count(http->endpoints); i++) {
+		struct endpoint *ep = &http->endpoints[i];
+		u64 msec;
+
+		if (!endpoint_usable(ep))
+			continue;
+		msec = endpoint_wait_msec(ep);
+		if (msec < wait)
+			wait = msec;
+	}
+	return wait;
+}
+
+/* The first queued request of class `prio` we can start right now, and
+ * on which endpoint: `*wait` is lowered to when the others could. */
+static struct http_request *http_next(size_t prio, struct endpoint **ep,
+				      u64 *wait)
+{
+	struct http_request *req;
+	u64 msec;
+
+	list_for_each(&http->queued[prio], req, list)
+	{
+		if (req->only) {
+			msec = endpoint_wait_msec(req->only);
+			*ep = req->only;
+		} else {
+			*ep = endpoint_best(NULL, true);
+			msec = *ep ? 0 : http_wait_msec();
+		}
+		if (msec == 0)
+			return req;
+		if (msec < *wait)
+			*wait = msec;
+	}
+	return NULL;
+}
+
+/* A queued request no endpoint will take, if any. */
+static struct http_request *http_stranded(void)
+{
+	struct http_request *req;
+
+	if (http_wait_msec() != UINT64_MAX)
 		return NULL;
+	for (size_t prio = 0; prio < HTTP_NUM_PRIOS; prio++) {
+		list_for_each(&http->queued[prio], req, list)
+		{
+			if (!req->only)
+				return req;
+		}
+	}
+	return NULL;
+}
+
+/* Start what we can of the queued requests, most urgent first: they take
+ * the tokens before the others do. */
+static void http_dispatch_queued(void)
+{
+	struct http_request *req;
+	struct endpoint *ep;
+	u64 wait = UINT64_MAX;
+
+	for (size_t prio = 0; prio < HTTP_NUM_PRIOS; prio++) {
+		while (!http_prio_max[prio] ||
+		       http->num_running[prio] < http_prio_max[prio]) {
+			req = http_next(prio, &ep, &wait);
+			if (!req)
+				break;
+			list_del(&req->list);
+			req->queued = false;
+			if (!http_request_run(req, ep))
+				http_request_fail(req);
+		}
+	}
+	if (wait != UINT64_MAX)
+		http_schedule_dispatch(wait);
+
+	/* They're all failing, don't wait for them. */
+	while ((req = http_stranded())) {
+		list_del(&req->list);
+		req->queued = false;
+		http_request_fail(req);
+	}
+}
+
+static void http_dispatch(struct http_engine *http)
+{
+	/* The timer is freed by libplugin once we return. */
+	http->dispatch_timer = NULL;
+	http_dispatch_queued();
+	timer_complete(http->plugin);
+}
+
+static void http_request_retry(struct http_request *req)
+{
+	/* The timer is freed by libplugin once we return. */
+	req->retry_timer = NULL;
+	http_request_enqueue(req);
+	timer_complete(http->plugin);
+}
+
+/* How long we wait before the `retries`th retry (msec). */
+static u64 http_retry_msec(u32 retries)
+{
+	u64 msec = RETRY_BASE_MSEC;
+
+	while (--retries > 0 && msec < RETRY_MAX_MSEC)
+		msec *= 2;
+	if (msec > RETRY_MAX_MSEC)
+		msec = RETRY_MAX_MSEC;
+
+	/* Don't have everyone who failed together retry together. */
+	return msec - pseudorand(msec / 2 + 1);
+}
+
+/* The attempt, and what curl tells of where its time went. */
+static void trace_attempt(const struct http_attempt *att)
+{
+	const struct http_request *req = att->req;
+	curl_off_t dns = 0, connect = 0, tls = 0, sent = 0, first = 0,
+		   total = 0;
+	long response_code = 0;
+
+	curl_easy_getinfo(att->curl, CURLINFO_RESPONSE_CODE, &response_code);
+	curl_easy_getinfo(att->curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+	curl_easy_getinfo(att->curl, CURLINFO_CONNECT_TIME_T, &connect);
+	curl_easy_getinfo(att->curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+	curl_easy_getinfo(att->curl, CURLINFO_PRETRANSFER_TIME_T, &sent);
+	curl_easy_getinfo(att->curl, CURLINFO_STARTTRANSFER_TIME_T, &first);
+	curl_easy_getinfo(att->curl, CURLINFO_TOTAL_TIME_T, &total);
+
+	trace_span(req->track, req->stats->name, "http", att->started,
+		   tal_fmt(tmpctx,
+			   "{\"url\":\"%s%s\",\"status\":%ld,"
+			   "\"offset\":%zu,\"lost\":%s}",
+			   att->endpoint->url, req->path, response_code,
+			   att->offset, att->lost ? "true" : "false"));
+	/* Those are 0 on a reused connection. */
+	if (dns > 0)
+		trace_event(req->track, "dns", "http", att->started, dns,
+			    NULL);
+	if (connect > dns)
+		trace_event(req->track, "connect", "http",
+			    timemono_add(att->started, time_from_usec(dns)),
+			    connect - dns, NULL);
+	if (tls > connect)
+		trace_event(req->track, "tls", "http",
+			    timemono_add(att->started, time_from_usec(connect)),
+			    tls - connect, NULL);
+	if (first > sent)
+		trace_event(req->track, "ttfb", "http",
+			    timemono_add(att->started, time_from_usec(sent)),
+			    first - sent, NULL);
+	if (total > first && first > 0)
+		trace_event(req->track, "transfer", "http",
+			    timemono_add(att->started, time_from_usec(first)),
+			    total - first, NULL);
+}
+
+/* Did `att` leave us a part of the body a retry can pick up from ? */
+static bool http_attempt_partial(const struct http_attempt *att,
+				 CURLcode res)
+{
+	long response_code = 0;
+
+	/* Not if we refused what it sent. */
+	if (!att->req->resumable || res == CURLE_WRITE_ERROR)
+		return false;
+	curl_easy_getinfo(att->curl, CURLINFO_RESPONSE_CODE, &response_code);
+
+	/* It didn't touch what we had (we only take a 206), but let's start
+	 * over if it can't serve ranges. */
+	if (att->offset != 0)
+		return res != CURLE_RANGE_ERROR && response_code != 416;
+	return response_code == 200 && http_request_received(att->req) != 0;
+}
+
+static void http_attempt_done(struct http_attempt *att, CURLcode res)
+{
+	struct http_request *req = att->req;
+	struct http_attempt *other;
+	long response_code = 0;
+	curl_off_t retry_after = 0;
+	bool failed, partial;
+	u8 *body;
+
+	if (tracer)
+		trace_attempt(att);
+	if (att->lost)
+		return;
+
+	if (res == CURLE_OK)
+		curl_easy_getinfo(att->curl, CURLINFO_RESPONSE_CODE,
+				  &response_code);
+	stats_status(req->stats, response_code);
+	stats_status(att->endpoint->stats, response_code);
+	hist_record(&att->endpoint->stats->latency,
+		    timemono_since(att->started));
+	/* A resumed transfer is done with a 206, or a 200 with nothing left
+	 * to send: anything else didn't give us the rest of the body. */
+	if (att->offset != 0 && response_code == 206)
+		response_code = 200;
+	failed = res != CURLE_OK || http_code_retryable(response_code) ||
+		 (att->offset != 0 && response_code != 200);
+	/* Being told to slow down doesn't make it a bad endpoint. */
+	if (response_code == 429) {
+#if LIBCURL_VERSION_NUM >= 0x074200
+		curl_easy_getinfo(att->curl, CURLINFO_RETRY_AFTER,
+				  &retry_after);
+#endif
+		endpoint_throttled(att->endpoint,
+				   retry_after > 0 ? retry_after : 0);
+	} else
+		endpoint_result(att->endpoint, !failed);
+	if (!att->answered) {
+		u64 msec = http_attempt_msec(att);
+		/* Don't let an endpoint we can't reach look fast. */
+		if (failed && msec < HEDGE_DEFAULT_MSEC)
+			msec = HEDGE_DEFAULT_MSEC;
+		endpoint_timed(att->endpoint, msec);
+	}
+	if (att->circuit && !failed)
+		circuit_timed(att);
+
+	/* The other one may still make it. */
+	other = http_attempt_other(att);
+	partial = failed && http_attempt_partial(att, res);
+	tal_free(att);
+	if (failed && other) {
+		req->attempt = other;
+		req->hedge = NULL;
+		return;
+	}
+	if (other)
+		http_attempt_lose(other);
+	req->hedge_timer = tal_free(req->hedge_timer);
+	http_request_stopped(req);
+
+	/* Retry up to `n_retries` times (on the endpoint we then like best),
+	 * without blocking the others, as long as we have time for it. */
+	if (failed && !(req->only && req->only->direct) &&
+	    ++req->retries <= esplora->n_retries) {
+		u64 delay = http_retry_msec(req->retries);
+
+		if (delay < http_request_remaining(req)) {
+			req->stats->retries++;
+			if (partial) {
+				req->resumed++;
+				plugin_log(http->plugin, LOG_DBG,
+					   "Resuming %s from byte %zu",
+					   req->path,
+					   http_request_received(req));
+			} else {
+				req->chunk.size = 0;
+				req->buffering = false;
+				req->streamed = 0;
+			}
+			req->retry_timer =
+			    plugin_timer(http->plugin, time_from_msec(delay),
+					 http_request_retry, req);
+			return;
+		}
+	}
+
+	if (response_code == 0 || (response_code != 200 && !req->status_cb)) {
+		http_request_fail(req);
+		return;
+	}
+	/* The callback may well free our parent (e.g. the command), so
+	 * don't hang on it. */
+	tal_steal(tmpctx, req);
+	/* Callbacks get the body at its length (tal_count()), but the buffer
+	 * goes back to the arenas with all of its room: they get a copy,
+	 * unless it's too large to be kept anyway (shrinking that one is
+	 * done in place). */
+	if (tal_bytelen(req->chunk.memory) > HTTP_ARENA_MAX) {
+		tal_resize(&req->chunk.memory, req->chunk.size);
+		body = req->chunk.memory;
+	} else
+		body = tal_dup_arr(req, u8, req->chunk.memory,
+				   req->chunk.size, 0);
+	hist_record(&req->stats->latency, timemono_since(req->created));
+	if (req->status_cb)
+		req->status_cb(body, response_code, req->arg);
+	else
+		req->cb(body, req->arg);
+}
+
+/* Let curl act upon `ev` on `fd` (or its timers), and handle whatever
+ * transfers that finished. */
+static void http_action(curl_socket_t fd, int ev)
+{
+	struct http_attempt *att;
+	CURLMsg *msg;
+	int running, msgs_left;
+
+	curl_multi_socket_action(http->multi, fd, ev, &running);
+	while ((msg = curl_multi_info_read(http->multi, &msgs_left))) {
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &att);
+		http_attempt_done(att, msg->data.result);
+	}
+
+	/* They remove themselves from `losers`. */
+	while (tal_count(http->losers) > 0)
+		tal_free(http->losers[0]);
+}
+
+static void http_timeout(struct http_engine *http)
+{
+	/* The timer is freed by libplugin once we return. */
+	http->curl_timer = NULL;
+	http_action(CURL_SOCKET_TIMEOUT, 0);
+	timer_complete(http->plugin);
+}
+
+static int http_timer_cb(CURLM *multi UNUSED, long timeout_ms,
+			 void *arg UNUSED)
+{
+	http->curl_timer = tal_free(http->curl_timer);
+	if (timeout_ms >= 0)
+		http->curl_timer =
+		    plugin_timer(http->plugin, time_from_msec(timeout_ms),
+				 http_timeout, http);
+	return 0;
+}
+
+/* A socket curl wants us to watch for it: curl reads, writes and closes
+ * it, our connection only tells it when to. */
+struct http_socket {
+	curl_socket_t fd;
+	struct io_conn *conn;
+
+	/* CURL_POLL_IN, CURL_POLL_OUT or CURL_POLL_INOUT. */
+	int what;
+
+	/* curl was done with it while we were telling it about it. */
+	bool removed;
+};
+
+static void destroy_http_socket(struct http_socket *hs)
+{
+	curl_multi_assign(http->multi, hs->fd, NULL);
+}
+
+/* Stop watching it, leaving the socket to curl. */
+static struct io_plan *http_socket_close(struct io_conn *conn,
+					 struct http_socket *hs)
+{
+	curl_socket_t fd = hs->fd;
+	struct io_plan *plan = io_close_taken_fd(conn);
+
+	/* That made it blocking again, curl doesn't expect it. */
+	io_fd_block(fd, false);
+	return plan;
+}
+
+static int http_socket_ready(int fd UNUSED, struct io_plan_arg *arg UNUSED)
+{
+	return 1;
+}
+
+static struct io_plan *http_socket_in(struct io_conn *conn,
+				      struct http_socket *hs);
+static struct io_plan *http_socket_out(struct io_conn *conn,
+				       struct http_socket *hs);
+
+static struct io_plan *http_socket_act(struct io_conn *conn,
+				       struct http_socket *hs, int ev)
+{
+	/* It may be removed, and even added back, while we're at it. */
+	http->acting = hs;
+	http_action(hs->fd, ev);
+	http->acting = NULL;
+	if (hs->removed)
+		return http_socket_close(conn, hs);
+	if (ev == CURL_CSELECT_IN)
+		return http_socket_in(conn, hs);
+	return http_socket_out(conn, hs);
+}
+
+static struct io_plan *http_socket_readable(struct io_conn *conn, void *hs)
+{
+	return http_socket_act(conn, hs, CURL_CSELECT_IN);
+}
+
+static struct io_plan *http_socket_writable(struct io_conn *conn, void *hs)
+{
+	return http_socket_act(conn, hs, CURL_CSELECT_OUT);
+}
+
+/* Watch the socket if curl wants us to, otherwise wait until it does. */
+static struct io_plan *http_socket_in(struct io_conn *conn,
+				      struct http_socket *hs)
+{
+	if (!(hs->what & CURL_POLL_IN))
+		return io_wait(conn, hs, http_socket_in, hs);
+	return io_set_plan(conn, IO_IN, http_socket_ready,
+			   http_socket_readable, hs);
+}
+
+static struct io_plan *http_socket_out(struct io_conn *conn,
+				       struct http_socket *hs)
+{
+	if (!(hs->what & CURL_POLL_OUT))
+		return io_out_wait(conn, hs, http_socket_out, hs);
+	return io_set_plan(conn, IO_OUT, http_socket_ready,
+			   http_socket_writable, hs);
+}
+
+static struct io_plan *http_socket_init(struct io_conn *conn,
+					struct http_socket *hs)
+{
+	return io_duplex(conn, http_socket_in(conn, hs),
+			 http_socket_out(conn, hs));
+}
+
+static int http_socket_cb(CURL *curl UNUSED, curl_socket_t fd, int what,
+			  void *arg UNUSED, void *socketp)
+{
+	struct http_socket *hs = socketp;
+
+	if (what == CURL_POLL_REMOVE) {
+		if (hs == http->acting)
+			hs->removed = true;
+		else if (hs)
+			http_socket_close(hs->conn, hs);
+		return 0;
+	}
+
+	if (!hs && http->acting && http->acting->fd == fd) {
+		hs = http->acting;
+		hs->removed = false;
+		curl_multi_assign(http->multi, fd, hs);
+	}
+	if (!hs) {
+		hs = tal(http, struct http_socket);
+		hs->fd = fd;
+		hs->what = what;
+		hs->removed = false;
+		hs->conn = io_new_conn(http, fd, http_socket_init, hs);
+		tal_steal(hs->conn, hs);
+		tal_add_destructor(hs, destroy_http_socket);
+		curl_multi_assign(http->multi, fd, hs);
+		return 0;
+	}
+
+	hs->what = what;
+	/* Whichever way it was waiting, it looks again. */
+	io_wake(hs);
+	return 0;
+}
+
+static struct http_request *
+http_request_(const tal_t *ctx, enum http_prio prio, struct endpoint *only,
+	      const char *path, const char *postdata, bool resumable,
+	      bool (*stream)(const u8 *data, size_t len, size_t offset,
+			     s64 total, void *arg),
+	      void (*cb)(const u8 *res, void *arg),
+	      void (*status_cb)(const u8 *res, long status, void *arg),
+	      void *arg)
+{
+	struct http_request *req;
+
+	/* Don't queue up what no endpoint will take. */
+	if (!only && !endpoint_best(NULL, false))
+		return NULL;
+
+	req = tal(ctx, struct http_request);
+	req->path = tal_strdup(req, path);
+	req->postdata = postdata ? tal_strdup(req, postdata) : NULL;
+	req->prio = prio;
+	req->queued = req->running = false;
+	req->only = only;
+	req->stats = stats_for_path(path);
+	req->stats->requests++;
+	req->created = time_mono();
+	req->track = tracer ? trace_track(ctx) : 0;
+	req->attempt = req->hedge = NULL;
+	req->hedge_timer = NULL;
+	req->chunk.memory = http_arena_get(req);
+	req->chunk.size = 0;
+	req->retries = 0;
+	req->retry_timer = NULL;
+	req->deadline =
+	    timemono_add(time_mono(), time_from_sec(esplora->deadline));
+	req->stream = stream;
+	req->buffering = false;
+	req->streamed = 0;
+	req->resumable = resumable && !postdata;
+	req->resumed = 0;
+	req->total = -1;
+	req->cb = cb;
+	req->status_cb = status_cb;
+	req->arg = arg;
+	tal_add_destructor(req, destroy_http_request);
+
+	http_request_enqueue(req);
+	return req;
+}
+
+/* Queue an HTTP request to `path` (e.g. "/blocks/tip/height"), started
+ * on the endpoint we like best when its `prio` class gets its turn: `cb`
+ * is called with the body (tal_count() is its length) or NULL on
+ * failure. Freeing `ctx` cancels it. */
+#define http_request(ctx, prio, path, postdata, cb, arg)                       \
+	http_request_((ctx), (prio), NULL, (path), (postdata), false, NULL,    \
+		      typesafe_cb_preargs(void, void *, (cb), (arg),           \
+					  const u8 *),                         \
+		      NULL, (arg))
+
+/* Same, for a body that never changes (e.g. a raw block): an interrupted
+ * transfer is resumed where it stopped, on any endpoint, which
+ * http_request_resumed() tells so that `cb` can check the result. */
+#define http_request_resumable(ctx, prio, path, cb, arg)                       \
+	http_request_((ctx), (prio), NULL, (path), NULL, true, NULL,           \
+		      typesafe_cb_preargs(void, void *, (cb), (arg),           \
+					  const u8 *),                         \
+		      NULL, (arg))
+
+/* Same, but `stream` is given the body (which it places at `offset` out
+ * of `total`, or -1 if unknown) as it arrives: `cb` then gets an empty
+ * body, unless `stream` refused the first chunk. Streamed bodies are
+ * resumable. */
+#define http_request_stream(ctx, prio, path, stream, cb, arg)                  \
+	http_request_((ctx), (prio), NULL, (path), NULL, true,                 \
+		      typesafe_cb_preargs(bool, void *, (stream), (arg),       \
+					  const u8 *, size_t, size_t, s64),    \
+		      typesafe_cb_preargs(void, void *, (cb), (arg),           \
+					  const u8 *),                         \
+		      NULL, (arg))
+
+/* Send it to `ep` only, even if it's failing, and have `cb` tell an
+ * error page from a success by the HTTP `status`. */
+#define http_request_to(ctx, prio, ep, path, postdata, cb, arg)                \
+	http_request_((ctx), (prio), (ep), (path), (postdata), false, NULL,    \
+		      NULL,                                                    \
+		      typesafe_cb_preargs(void, void *, (cb), (arg),           \
+					  const u8 *, long),                   \
+		      (arg))
+
+/* Same as http_request_stream(), from `ep` only. */
+#define http_request_stream_to(ctx, prio, ep, path, stream, cb, arg)          \
+	http_request_((ctx), (prio), (ep), (path), NULL, true,                 \
+		      typesafe_cb_preargs(bool, void *, (stream), (arg),       \
+					  const u8 *, size_t, size_t, s64),    \
+		      typesafe_cb_preargs(void, void *, (cb), (arg),           \
+					  const u8 *),                         \
+		      NULL, (arg))
+
+/* Was the body of `req` put together from several transfers ? */
+static bool http_request_resumed(const struct http_request *req)
+{
+	return req->resumed != 0;
+}
+
+static void command_request_done(const u8 *res, struct command_request *creq)
+{
+	creq->cb(creq->cmd, res, creq->arg);
+}
+
+/* A response we keep for a little while: whoever asks for it while it is
+ * being fetched waits for the same answer. */
+struct cached_response {
+	struct list_node list;
+	const char *path;
+
+	/* The last answer we got (NULL if none), and when. */
+	const u8 *body;
+	struct timemono fetched;
+
+	/* Non-NULL while we are fetching it (again). */
+	struct http_request *req;
+	struct list_head waiters;
+};
+
+struct cache_waiter {
+	struct list_node list;
+	void (*cb)(const u8 *res, void *arg);
+	void *arg;
+};
+
+/* Never goes stale (e.g. the genesis block). */
+#define CACHE_FOREVER UINT32_MAX
+
+struct response_cache {
+	struct list_head responses;
+};
+
+static struct response_cache *cache;
+
+static struct cached_response *cache_find(const char *path)
+{
+	struct cached_response *c;
+
+	list_for_each(&cache->responses, c, list)
+	{
+		if (streq(c->path, path))
+			return c;
+	}
+	return NULL;
+}
+
+/* The body we have for `path` if it is at most `ttl` seconds old. */
+static const u8 *cache_lookup(const char *path, u32 ttl)
+{
+	struct cached_response *c = cache_find(path);
+
+	if (!c || !c->body)
+		return NULL;
+	if (ttl != CACHE_FOREVER &&
+	    time_greater(timemono_since(c->fetched), time_from_sec(ttl)))
+		return NULL;
+	return c->body;
+}
+
+/* Don't serve `path` from the cache anymore. */
+static void cache_forget(const char *path)
+{
+	struct cached_response *c = cache_find(path);
+
+	if (!c || !c->body)
+		return;
+	/* Someone might be looking at it, let it live until we return. */
+	tal_steal(tmpctx, cast_const(u8 *, c->body));
+	c->body = NULL;
+}
+
+/* Start keeping `path`, which we don't have an answer to yet. */
+static struct cached_response *cache_add(const char *path)
+{
+	struct cached_response *c = tal(cache, struct cached_response);
+
+	c->path = tal_strdup(c, path);
+	c->body = NULL;
+	c->req = NULL;
+	list_head_init(&c->waiters);
+	list_add_tail(&cache->responses, &c->list);
+	return c;
+}
+
+static void destroy_cache_waiter(struct cache_waiter *w)
+{
+	list_del(&w->list);
+}
+
+static void cache_response_done(const u8 *res, struct cached_response *c)
+{
+	struct list_head waiters;
+	struct cache_waiter *w;
+
+	c->req = NULL;
+	if (res) {
+		tal_free(c->body);
+		c->body = tal_steal(c, cast_const(u8 *, res));
+		c->fetched = time_mono();
+	}
+
+	/* Callbacks may well ask for it again, or forget it. */
+	list_head_init(&waiters);
+	list_append_list(&waiters, &c->waiters);
+	while ((w = list_pop(&waiters, struct cache_waiter, list))) {
+		tal_del_destructor(w, destroy_cache_waiter);
+		tal_steal(tmpctx, w);
+		w->cb(res, w->arg);
+	}
+}
+
+/* Wait for `path` to be fetched, along with everyone else who asked for it
+ * meanwhile. Returns false (without calling `cb`) if we can't. */
+static bool cache_fetch_(const tal_t *ctx, enum http_prio prio,
+			 const char *path,
+			 void (*cb)(const u8 *res, void *arg), void *arg)
+{
+	struct cached_response *c = cache_find(path);
+	struct cache_waiter *w;
+
+	if (!c)
+		c = cache_add(path);
+	if (!c->req) {
+		c->req =
+		    http_request(c, prio, path, NULL, cache_response_done, c);
+		if (!c->req)
+			return false;
+	} else
+		http_request_raise(c->req, prio);
+
+	w = tal(ctx, struct cache_waiter);
+	w->cb = cb;
+	w->arg = arg;
+	list_add_tail(&c->waiters, &w->list);
+	tal_add_destructor(w, destroy_cache_waiter);
+	return true;
+}
+
+#define cache_fetch(ctx, prio, path, cb, arg)                                  \
+	cache_fetch_((ctx), (prio), (path),                                    \
+		     typesafe_cb_preargs(void, void *, (cb), (arg),            \
+					 const u8 *),                          \
+		     (arg))
+
+static struct command_result *
+request_cached_(struct command *cmd, enum http_prio prio, const char *path,
+		u32 ttl,
+		struct command_result *(*cb)(struct command *cmd,
+					     const u8 *res, void *arg),
+		void *arg)
+{
+	const u8 *body = cache_lookup(path, ttl);
+	struct command_request *creq;
+
+	stats_cache(path, body != NULL);
+	if (body)
+		return cb(cmd, body, arg);
+
+	creq = tal(cmd, struct command_request);
+	creq->cmd = cmd;
+	creq->cb = cb;
+	creq->arg = arg;
+	if (!cache_fetch(creq, prio, path, command_request_done, creq))
+		return cb(cmd, NULL, arg);
+
+	return command_still_pending(cmd);
+}
+
+/* Continue `cmd` with `cb` once `path` answered, or right away if we got
+ * it at most `ttl` seconds ago: `res` is the body (tal_count() is its
+ * length) or NULL on failure. Concurrent callers share the request. */
+#define request_cached(cmd, prio, path, ttl, cb, arg)                          \
+	request_cached_((cmd), (prio), (path), (ttl),                          \
+			typesafe_cb_preargs(struct command_result *, void *,   \
+					    (cb), (arg), struct command *,     \
+					    const u8 *),                       \
+			(arg))
+
+static struct response_cache *new_response_cache(const tal_t *ctx)
+{
+	struct response_cache *cache = tal(ctx, struct response_cache);
+
+	list_head_init(&cache->responses);
+	return cache;
+}
+
+static struct http_engine *new_http_engine(const tal_t *ctx,
+					   struct plugin *plugin)
+{
+	struct http_engine *http = tal(ctx, struct http_engine);
+	int features;
+
+	http->plugin = plugin;
+	http->multi = curl_multi_init();
+	curl_multi_setopt(http->multi, CURLMOPT_MAXCONNECTS,
+			  (long)esplora->max_connections);
+	curl_multi_setopt(http->multi, CURLMOPT_SOCKETFUNCTION,
+			  http_socket_cb);
+	curl_multi_setopt(http->multi, CURLMOPT_TIMERFUNCTION, http_timer_cb);
+	http->share = curl_share_init();
+	curl_share_setopt(http->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(http->share, CURLSHOPT_SHARE,
+			  CURL_LOCK_DATA_SSL_SESSION);
+	curl_share_setopt(http->share, CURLSHOPT_SHARE,
+			  CURL_LOCK_DATA_CONNECT);
+	http->http2 = esplora->http2;
+	features = curl_version_info(CURLVERSION_NOW)->features;
+	if (http->http2 && !(features & CURL_VERSION_HTTP2)) {
+		plugin_log(plugin, LOG_UNUSUAL,
+			   "libcurl was built without HTTP/2, using HTTP/1.1");
+		http->http2 = false;
+	}
+	if (http->http2) {
+		curl_multi_setopt(http->multi, CURLMOPT_PIPELINING,
+				  CURLPIPE_MULTIPLEX);
+#if LIBCURL_VERSION_NUM >= 0x074300
+		curl_multi_setopt(http->multi, CURLMOPT_MAX_CONCURRENT_STREAMS,
+				  (long)esplora->max_streams);
+#endif
+	}
+	http->idle = tal_arr(http, CURL *, 0);
+	http->curl_timer = NULL;
+	http->acting = NULL;
+	http->arenas = tal_arr(http, u8 *, 0);
+	http->endpoints = tal_arr(http, struct endpoint, 0);
+	http->core = NULL;
+	http->proxy = NULL;
+	http->circuits = tal_arr(http, struct circuit, 0);
+	http->losers = tal_arr(http, struct http_attempt *, 0);
+	for (size_t i = 0; i < HTTP_NUM_PRIOS; i++) {
+		list_head_init(&http->queued[i]);
+		http->num_running[i] = 0;
+	}
+	http->dispatch_timer = NULL;
+	http->dispatch_soon = false;
+
+	return http;
+}
+
+/* Go through the SOCKS proxy at `address`:`port`, over `circuits`
+ * isolated circuits if more than one. */
+static void http_use_proxy(struct http_engine *http, const char *address,
+			   unsigned int port, u32 circuits)
+{
+	http->proxy = tal_fmt(http, "socks5h://%s:%u", address, port);
+	if (circuits < 2)
+		return;
+	tal_resize(&http->circuits, circuits);
+	memset(http->circuits, 0, circuits * sizeof(struct circuit));
+	for (size_t i = 0; i < circuits; i++)
+		circuit_renew(&http->circuits[i]);
+}
+
+/* Add the endpoints of a comma-separated list, e.g. the one we were
+ * configured with. */
+static void http_add_endpoints(struct http_engine *http, const char *list)
+{
+	char **urls = tal_strsplit(tmpctx, list, ",", STR_NO_EMPTY);
+
+	for (size_t i = 0; urls[i]; i++) {
+		struct endpoint ep;
+		size_t len = strlen(urls[i]);
+
+		while (len > 0 && urls[i][len - 1] == '/')
+			len--;
+		memset(&ep, 0, sizeof(ep));
+		ep.url = tal_strndup(http, urls[i], len);
+		ep.stats = stats_find(&stats->endpoints, ep.url);
+		tal_arr_expand(&http->endpoints, ep);
+	}
+}
+
+/* Ask the REST interface of our bitcoind at `url` (e.g.
+ * "http://127.0.0.1:8332") first, for what it serves. */
+static void http_use_core(struct http_engine *http, const char *url)
+{
+	size_t len = strlen(url);
+
+	while (len > 0 && url[len - 1] == '/')
+		len--;
+	http->core = tal(http, struct endpoint);
+	memset(http->core, 0, sizeof(*http->core));
+	http->core->url = tal_strndup(http, url, len);
+	http->core->stats = stats_find(&stats->endpoints, http->core->url);
+	http->core->direct = true;
+}
+
+/* Is our bitcoind worth asking right now ? */
+static bool core_usable(void)
+{
+	return http->core && endpoint_usable(http->core);
+}
+
+/* We wait ELECTRUM_RECONNECT_SEC before connecting to the Electrum server
+ * again, twice as long each time it fails up to ELECTRUM_RECONNECT_MAX_SEC
+ * (seconds). */
+#define ELECTRUM_RECONNECT_SEC 1
+#define ELECTRUM_RECONNECT_MAX_SEC 60
+
+/* The protocol version we speak: blockchain.headers.subscribe answers
+ * with raw headers, blockchain.block.headers takes no checkpoint. */
+#define ELECTRUM_PROTOCOL "1.4"
+
+/* A JSON-RPC call to the Electrum server, answered by its id. */
+struct electrum_call {
+	struct list_node list;
+	u64 id;
+
+	/* What we send, and did we (on this connection) ? */
+	const char *json;
+	bool sent;
+
+	/* What we count it as, when it was made and what track we trace
+	 * it on. */
+	struct stats *stats;
+	struct timemono created;
+	u64 track;
+
+	/* Fails it once `esplora->deadline` is over, if set. */
+	struct plugin_timer *timer;
+
+	/* Called with the `result` or the `error` member of the answer,
+	 * both NULL if there was none. */
+	void (*cb)(const char *buf, const jsmntok_t *result,
+		   const jsmntok_t *error, void *arg);
+	void *arg;
+};
+
+/* A connection to an Electrum server we keep open, over which calls are
+ * pipelined (and batched when several are waiting): it pushes us the new
+ * tips instead of us polling them. */
+struct electrum {
+	struct plugin *plugin;
+	const char *host, *port;
+	struct stats *stats;
+
+	/* What `host` resolved to when we started, and which of them we
+	 * connect to (next). */
+	struct addrinfo *addrs, *addr;
+
+	/* NULL while we are not connected, nor trying to. */
+	struct io_conn *conn;
+
+	/* What is only good for this connection, e.g. the handshake. */
+	tal_t *session;
+
+	/* Does it tell us about new tips ? */
+	bool subscribed;
+
+	/* Calls waiting to be sent or answered, which ride out a
+	 * reconnection. */
+	struct list_head calls;
+	u64 next_id;
+
+	/* What we are writing, and what we read (`in_len` bytes of it, the
+	 * last read being `read_len` bytes). */
+	char *out;
+	char *in;
+	size_t in_len, read_len;
+
+	/* How long we wait before reconnecting (seconds). */
+	u32 backoff;
+	struct plugin_timer *reconnect_timer;
+
+	/* The genesis block hash, once we asked for it. */
+	char *genesis;
+};
+
+static struct electrum *electrum;
+
+static void tip_got_header(const char *buf, const jsmntok_t *tok);
+
+static void destroy_electrum_call(struct electrum_call *call)
+{
+	list_del(&call->list);
+	tal_free(call->timer);
+}
+
+static void electrum_call_done(struct electrum_call *call, const char *buf,
+			       const jsmntok_t *result,
+			       const jsmntok_t *error)
+{
+	long status = result ? 200 : error ? 400 : 0;
+
+	tal_del_destructor(call, destroy_electrum_call);
+	list_del(&call->list);
+	call->timer = tal_free(call->timer);
+	stats_status(call->stats, status);
+	stats_status(electrum->stats, status);
+	hist_record(&call->stats->latency, timemono_since(call->created));
+	if (tracer)
+		trace_span(call->track, call->stats->name, "electrum",
+			   call->created,
+			   tal_fmt(tmpctx,
+				   "{\"id\":%" PRIu64 ",\"status\":%ld}",
+				   call->id, status));
+	/* The callback may well free our parent (e.g. the command), so
+	 * don't hang on it. */
+	tal_steal(tmpctx, call);
+	call->cb(buf, result, error, call->arg);
+}
+
+static void electrum_call_expired(struct electrum_call *call)
+{
+	/* The timer is freed by libplugin once we return. */
+	call->timer = NULL;
+	plugin_log(electrum->plugin, LOG_UNUSUAL,
+		   "%s:%s didn't answer %s in %us", electrum->host,
+		   electrum->port, call->stats->name, esplora->deadline);
+	electrum_call_done(call, NULL, NULL, NULL);
+	timer_complete(electrum->plugin);
+}
+
+/* Call `method` with `params` (a JSON array) on the Electrum server: `cb`
+ * gets its answer, whenever we are connected. Freeing `ctx` cancels
+ * it. */
+static struct electrum_call *
+electrum_call_(const tal_t *ctx, const char *method, const char *params,
+	       void (*cb)(const char *buf, const jsmntok_t *result,
+			  const jsmntok_t *error, void *arg),
+	       void *arg)
+{
+	struct electrum_call *call = tal(ctx, struct electrum_call);
+
+	call->id = electrum->next_id++;
+	call->json = tal_fmt(call,
+			     "{\"jsonrpc\":\"2.0\",\"id\":%" PRIu64 ","
+			     "\"method\":\"%s\",\"params\":%s}",
+			     call->id, method, params);
+	call->sent = false;
+	call->stats = stats_find(&stats->paths, method);
+	call->stats->requests++;
+	electrum->stats->requests++;
+	call->created = time_mono();
+	call->track = tracer ? trace_track(ctx) : 0;
+	call->timer = NULL;
+	if (esplora->deadline != 0)
+		call->timer = plugin_timer(electrum->plugin,
+					   time_from_sec(esplora->deadline),
+					   electrum_call_expired, call);
+	call->cb = cb;
+	call->arg = arg;
+	list_add_tail(&electrum->calls, &call->list);
+	tal_add_destructor(call, destroy_electrum_call);
+
+	/* Our writer is waiting for something to send. */
+	io_wake(electrum);
+	return call;
+}
+
+#define electrum_call(ctx, method, params, cb, arg)                            \
+	electrum_call_((ctx), (method), (params),                              \
+		       typesafe_cb_preargs(void, void *, (cb), (arg),          \
+					   const char *, const jsmntok_t *,    \
+					   const jsmntok_t *),                 \
+		       (arg))
+
+/* An answer, or a notification. */
+static bool electrum_message(struct electrum *e, const char *buf,
+			     const jsmntok_t *tok)
+{
+	const jsmntok_t *idtok = json_get_member(buf, tok, "id");
+	const jsmntok_t *methodtok, *params;
+	struct electrum_call *call;
+	u64 id;
+
+	if (!idtok || json_tok_is_null(buf, idtok)) {
+		methodtok = json_get_member(buf, tok, "method");
+		params = json_get_member(buf, tok, "params");
+		if (methodtok &&
+		    json_tok_streq(buf, methodtok,
+				   "blockchain.headers.subscribe") &&
+		    params && params->type == JSMN_ARRAY && params->size == 1)
+			tip_got_header(buf, json_get_arr(params, 0));
+		return true;
+	}
+	if (!json_to_u64(buf, idtok, &id))
+		return false;
+
+	/* Not finding it is fine: it was cancelled, or it expired. */
+	list_for_each(&e->calls, call, list)
+	{
+		if (call->id == id && call->sent) {
+			electrum_call_done(call, buf,
+					   json_get_member(buf, tok, "result"),
+					   json_get_member(buf, tok, "error"));
+			break;
+		}
+	}
+	return true;
+}
+
+/* A line we received: a message, or a batch of them. */
+static bool electrum_line(struct electrum *e, const char *line, size_t len)
+{
+	const jsmntok_t *toks = json_parse_simple(tmpctx, line, len), *t;
+	size_t i;
+
+	if (!toks)
+		return false;
+	if (toks->type != JSMN_ARRAY)
+		return electrum_message(e, line, toks);
+	json_for_each_arr(i, t, toks)
+	{
+		if (!electrum_message(e, line, t))
+			return false;
+	}
+	return true;
+}
+
+static struct io_plan *electrum_read(struct io_conn *conn,
+				     struct electrum *e)
+{
+	char *line = e->in, *nl;
+
+	e->in_len += e->read_len;
+	e->stats->bytes += e->read_len;
+	while ((nl = memchr(line, '\n', e->in + e->in_len - line))) {
+		if (nl > line && !electrum_line(e, line, nl - line)) {
+			plugin_log(e->plugin, LOG_UNUSUAL,
+				   "Invalid message from %s:%s: %.*s", e->host,
+				   e->port, (int)(nl - line), line);
+			return io_close(conn);
+		}
+		line = nl + 1;
+	}
+	e->in_len -= line - e->in;
+	memmove(e->in, line, e->in_len);
+
+	if (e->in_len == tal_count(e->in))
+		tal_resize(&e->in, e->in_len * 2);
+	return io_read_partial(conn, e->in + e->in_len,
+			       tal_count(e->in) - e->in_len, &e->read_len,
+			       electrum_read, e);
+}
+
+/* Send all the calls waiting, in a single batch if there are several. */
+static struct io_plan *electrum_write(struct io_conn *conn,
+				      struct electrum *e)
+{
+	struct electrum_call *call;
+	char *batch = tal_strdup(tmpctx, "");
+	size_t n = 0;
+
+	list_for_each(&e->calls, call, list)
+	{
+		if (call->sent)
+			continue;
+		tal_append_fmt(&batch, "%s%s", n++ ? "," : "", call->json);
+		call->sent = true;
+	}
+	if (n == 0)
+		return io_out_wait(conn, e, electrum_write, e);
+
+	tal_free(e->out);
+	if (n > 1)
+		e->out = tal_fmt(e, "[%s]\n", batch);
+	else
+		e->out = tal_fmt(e, "%s\n", batch);
+	return io_write(conn, e->out, strlen(e->out), electrum_write, e);
+}
+
+static void electrum_got_version(const char *buf, const jsmntok_t *result,
+				 const jsmntok_t *error, struct electrum *e)
+{
+	if (!result)
+		plugin_log(e->plugin, LOG_UNUSUAL,
+			   "%s:%s doesn't speak Electrum protocol %s: %.*s",
+			   e->host, e->port, ELECTRUM_PROTOCOL,
+			   error ? json_tok_full_len(error) : 0,
+			   error ? json_tok_full(buf, error) : "");
+}
+
+static void electrum_subscribed(const char *buf, const jsmntok_t *result,
+				const jsmntok_t *error UNUSED,
+				struct electrum *e)
+{
+	if (!result)
+		return;
+	e->subscribed = true;
+	tip_got_header(buf, result);
+}
+
+static struct io_plan *electrum_connected(struct io_conn *conn,
+					  struct electrum *e)
+{
+	struct electrum_call *version;
+
+	plugin_log(e->plugin, LOG_INFORM, "Connected to Electrum server %s:%s",
+		   e->host, e->port);
+	e->backoff = ELECTRUM_RECONNECT_SEC;
+	e->in_len = e->read_len = 0;
+
+	/* The handshake goes first, on its own. */
+	e->session = tal(e, char);
+	version = electrum_call(e->session, "server.version",
+				"[\"esplora_clnd_plugin\",\"" ELECTRUM_PROTOCOL
+				"\"]",
+				electrum_got_version, e);
+	version->sent = true;
+	electrum_call(e->session, "blockchain.headers.subscribe", "[]",
+		      electrum_subscribed, e);
+
+	tal_free(e->out);
+	e->out = tal_fmt(e, "%s\n", version->json);
+	return io_duplex(conn,
+			 io_read_partial(conn, e->in, tal_count(e->in),
+					 &e->read_len, electrum_read, e),
+			 io_write(conn, e->out, strlen(e->out), electrum_write,
+				  e));
+}
+
+static void electrum_connect(struct electrum *e);
+
+static void electrum_reconnect(struct electrum *e)
+{
+	/* The timer is freed by libplugin once we return. */
+	e->reconnect_timer = NULL;
+	electrum_connect(e);
+	timer_complete(e->plugin);
+}
+
+static void electrum_schedule_reconnect(struct electrum *e)
+{
+	if (e->reconnect_timer)
+		return;
+	plugin_log(e->plugin, LOG_UNUSUAL,
+		   "Not connected to Electrum server %s:%s, trying again in "
+		   "%us",
+		   e->host, e->port, e->backoff);
+	e->reconnect_timer = plugin_timer(
+	    e->plugin, time_from_sec(e->backoff), electrum_reconnect, e);
+	if (e->backoff < ELECTRUM_RECONNECT_MAX_SEC / 2)
+		e->backoff *= 2;
+	else
+		e->backoff = ELECTRUM_RECONNECT_MAX_SEC;
+}
+
+static void electrum_finished(struct io_conn *conn, struct electrum *e)
+{
+	struct electrum_call *call;
+	bool connected = e->session != NULL;
+
+	e->conn = NULL;
+	e->subscribed = false;
+	/* Whatever it didn't answer goes again on the next one. */
+	e->session = tal_free(e->session);
+	list_for_each(&e->calls, call, list)
+		call->sent = false;
+
+	/* We come back to the address that worked, otherwise we try the
+	 * next one right away, and only wait once we tried them all. */
+	if (connected) {
+		electrum_schedule_reconnect(e);
+		return;
+	}
+	e->addr = e->addr->ai_next;
+	electrum_connect(e);
+}
+
+static struct io_plan *electrum_init_conn(struct io_conn *conn,
+					  struct electrum *e)
+{
+	io_set_finish(conn, electrum_finished, e);
+	return io_connect(conn, e->addr, electrum_connected, e);
+}
+
+static void electrum_connect(struct electrum *e)
+{
+	int fd;
+
+	for (; e->addr; e->addr = e->addr->ai_next) {
+		fd = socket(e->addr->ai_family, e->addr->ai_socktype,
+			    e->addr->ai_protocol);
+		if (fd >= 0) {
+			e->conn = io_new_conn(e, fd, electrum_init_conn, e);
+			return;
+		}
+	}
+	e->addr = e->addrs;
+	electrum_schedule_reconnect(e);
+}
+
+static void destroy_electrum(struct electrum *e)
+{
+	freeaddrinfo(e->addrs);
+}
+
+/* Connect to the Electrum server at `hostport` (e.g. "127.0.0.1:50001"),
+ * plain TCP. Returns NULL if that's not a host and a port, or we can't
+ * resolve it: we only do it once, here, rather than block on every
+ * reconnection. */
+static struct electrum *new_electrum(const tal_t *ctx, struct plugin *plugin,
+				     const char *hostport)
+{
+	struct electrum *e;
+	const char *colon = strrchr(hostport, ':');
+	struct addrinfo hints;
+
+	if (!colon || colon == hostport || !colon[1])
+		return NULL;
+
+	e = tal(ctx, struct electrum);
+	e->plugin = plugin;
+	e->host = tal_strndup(e, hostport, colon - hostport);
+	e->port = tal_strdup(e, colon + 1);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(e->host, e->port, &hints, &e->addrs) != 0)
+		return tal_free(e);
+	e->addr = e->addrs;
+	tal_add_destructor(e, destroy_electrum);
+	e->stats = stats_find(&stats->endpoints,
+			      tal_fmt(tmpctx, "tcp://%s", hostport));
+	e->conn = NULL;
+	e->session = NULL;
+	e->subscribed = false;
+	list_head_init(&e->calls);
+	e->next_id = 0;
+	e->out = NULL;
+	e->in = tal_arr(e, char, 64 * 1024);
+	e->in_len = e->read_len = 0;
+	e->backoff = ELECTRUM_RECONNECT_SEC;
+	e->reconnect_timer = NULL;
+	e->genesis = NULL;
+
+	electrum = e;
+	electrum_connect(e);
+	return e;
+}
+
+/* Magic at the start of the block store index, bump on format change. */
+#define BLOCKSTORE_MAGIC "ESPLBLK1"
+
+/* What we append to the index for each block we store. A zero `len`
+ * means that whatever we had at `height` is gone. */
+struct blockstore_record {
+	u32 height;
+	u32 len;
+	u64 offset;
+	struct bitcoin_blkid blkid;
+};
+
+/* Raw blocks we already downloaded, so that rescans and restarts don't
+ * hit the endpoint again: blocks are appended to a data file we mmap,
+ * and an append-only index maps heights to them. */
+struct blockstore {
+	const char *dir;
+	int data_fd, idx_fd;
+
+	/* The data file, mapped read-only. */
+	const u8 *map;
+	size_t map_len;
+
+	/* Size of the data file, and its limit before we compact it. */
+	u64 data_len, max_len;
+
+	/* How many blocks are being written: we can't compact meanwhile. */
+	size_t num_reserved;
+
+	/* What we know of, sorted by height. */
+	struct blockstore_record *records;
+};
+
+static struct blockstore *blockstore;
+
+/* Index of the first record with a height >= `height`. */
+static size_t blockstore_find(const struct blockstore *bs, u32 height)
+{
+	size_t lo = 0, hi = tal_count(bs->records);
+
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		if (bs->records[mid].height < height)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void blockstore_apply(struct blockstore *bs,
+			     const struct blockstore_record *rec)
+{
+	size_t n = tal_count(bs->records), i = blockstore_find(bs, rec->height);
+	bool found = i < n && bs->records[i].height == rec->height;
+
+	if (rec->len == 0) {
+		if (found)
+			tal_arr_remove(&bs->records, i);
+		return;
+	}
+	if (!found) {
+		tal_resize(&bs->records, n + 1);
+		memmove(bs->records + i + 1, bs->records + i,
+			(n - i) * sizeof(*bs->records));
+	}
+	bs->records[i] = *rec;
+}
+
+static bool blockstore_remap(struct blockstore *bs)
+{
+	void *map;
+
+	if (bs->map)
+		munmap(cast_const(u8 *, bs->map), bs->map_len);
+	bs->map = NULL;
+	bs->map_len = 0;
+	if (bs->data_len == 0)
+		return true;
+
+	map = mmap(NULL, bs->data_len, PROT_READ, MAP_SHARED, bs->data_fd, 0);
+	if (map == MAP_FAILED)
+		return false;
+	bs->map = map;
+	bs->map_len = bs->data_len;
+	return true;
+}
+
+/* Drop everything, e.g. because the files are not ours or we failed to
+ * write them. */
+static bool blockstore_reset(struct blockstore *bs)
+{
+	tal_resize(&bs->records, 0);
+	bs->data_len = 0;
+	blockstore_remap(bs);
+	return ftruncate(bs->data_fd, 0) == 0 &&
+	       ftruncate(bs->idx_fd, 0) == 0 &&
+	       write_all(bs->idx_fd, BLOCKSTORE_MAGIC,
+			 strlen(BLOCKSTORE_MAGIC));
+}
+
+static void destroy_blockstore(struct blockstore *bs)
+{
+	if (bs->map)
+		munmap(cast_const(u8 *, bs->map), bs->map_len);
+	close(bs->data_fd);
+	close(bs->idx_fd);
+}
+
+static struct blockstore *blockstore_open(const tal_t *ctx, const char *dir,
+					  u64 max_len, const char **err)
+{
+	struct blockstore *bs = tal(ctx, struct blockstore);
+	const char *idx_path = path_join(tmpctx, dir, "blocks.idx");
+	size_t magic_len = strlen(BLOCKSTORE_MAGIC), idx_len;
+	const struct blockstore_record *recs;
+	char *idx;
+
+	/* On a fresh node, its parent (our datadir) doesn't exist either. */
+	if ((mkdir(path_dirname(tmpctx, dir), 0700) != 0 && errno != EEXIST) ||
+	    (mkdir(dir, 0700) != 0 && errno != EEXIST)) {
+		*err = tal_fmt(ctx, "creating %s: %s", dir, strerror(errno));
+		return tal_free(bs);
+	}
+
+	bs->dir = tal_strdup(bs, dir);
+	bs->map = NULL;
+	bs->map_len = 0;
+	bs->max_len = max_len;
+	bs->num_reserved = 0;
+	bs->records = tal_arr(bs, struct blockstore_record, 0);
+	bs->data_fd = open(path_join(tmpctx, dir, "blocks.dat"),
+			   O_RDWR | O_CREAT, 0600);
+	if (bs->data_fd < 0) {
+		*err = tal_fmt(ctx, "opening blocks.dat: %s", strerror(errno));
+		return tal_free(bs);
+	}
+	bs->idx_fd = open(idx_path, O_RDWR | O_CREAT | O_APPEND, 0600);
+	if (bs->idx_fd < 0) {
+		*err = tal_fmt(ctx, "opening blocks.idx: %s", strerror(errno));
+		close(bs->data_fd);
+		return tal_free(bs);
+	}
+	tal_add_destructor(bs, destroy_blockstore);
+	bs->data_len = lseek(bs->data_fd, 0, SEEK_END);
+
+	/* grab_file() adds a nul terminator. */
+	idx = grab_file(tmpctx, idx_path);
+	idx_len = idx ? tal_count(idx) - 1 : 0;
+	if (idx_len < magic_len ||
+	    memcmp(idx, BLOCKSTORE_MAGIC, magic_len) != 0) {
+		if (!blockstore_reset(bs)) {
+			*err = tal_fmt(ctx, "resetting %s: %s", dir,
+				       strerror(errno));
+			return tal_free(bs);
+		}
+		return bs;
+	}
+
+	/* Replay the index, skipping what points past the data we have:
+	 * we may have crashed in the middle of an append. */
+	recs = (const struct blockstore_record *)(idx + magic_len);
+	for (size_t i = 0; i < (idx_len - magic_len) / sizeof(*recs); i++) {
+		if (recs[i].offset + recs[i].len > bs->data_len)
+			continue;
+		blockstore_apply(bs, &recs[i]);
+	}
+	/* A truncated record would misalign everything we append next. */
+	if (ftruncate(bs->idx_fd,
+		      idx_len - (idx_len - magic_len) % sizeof(*recs)) != 0) {
+		*err = tal_fmt(ctx, "truncating blocks.idx: %s",
+			       strerror(errno));
+		return tal_free(bs);
+	}
+
+	if (!blockstore_remap(bs)) {
+		*err = tal_fmt(ctx, "mapping blocks.dat: %s", strerror(errno));
+		return tal_free(bs);
+	}
+	return bs;
+}
+
+static bool blockstore_invalidate(struct blockstore *bs, u32 height)
+{
+	struct blockstore_record rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.height = height;
+	blockstore_apply(bs, &rec);
+	return write_all(bs->idx_fd, &rec, sizeof(rec));
+}
+
+/* Forget about all the blocks from `height`, they got reorged out. */
+static bool blockstore_invalidate_from(struct blockstore *bs, u32 height)
+{
+	size_t n;
+
+	while ((n = tal_count(bs->records)) > 0 &&
+	       bs->records[n - 1].height >= height) {
+		if (!blockstore_invalidate(bs, bs->records[n - 1].height))
+			return false;
+	}
+	return true;
+}
+
+/* Make the renames in our directory stick. */
+static bool blockstore_sync_dir(const struct blockstore *bs)
+{
+	int fd = open(bs->dir, O_RDONLY);
+	bool ok = fd >= 0 && fsync(fd) == 0;
+
+	if (fd >= 0)
+		close(fd);
+	return ok;
+}
+
+/* Rewrite the store with only the highest blocks, up to half our size
+ * limit so that we don't compact again right away. */
+static bool blockstore_compact(struct blockstore *bs)
+{
+	const char *data_path = path_join(tmpctx, bs->dir, "blocks.dat");
+	const char *idx_path = path_join(tmpctx, bs->dir, "blocks.idx");
+	const char *data_tmp = tal_fmt(tmpctx, "%s.new", data_path);
+	const char *idx_tmp = tal_fmt(tmpctx, "%s.new", idx_path);
+	size_t n = tal_count(bs->records), first = n;
+	u64 kept = 0;
+	int data_fd, idx_fd;
+	bool ok;
+
+	while (first > 0 &&
+	       kept + bs->records[first - 1].len <= bs->max_len / 2)
+		kept += bs->records[--first].len;
+
+	if (bs->num_reserved != 0)
+		return false;
+	if (bs->map_len < bs->data_len && !blockstore_remap(bs))
+		return blockstore_reset(bs);
+
+	data_fd = open(data_tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	idx_fd = open(idx_tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+	ok = data_fd >= 0 && idx_fd >= 0 &&
+	     write_all(idx_fd, BLOCKSTORE_MAGIC, strlen(BLOCKSTORE_MAGIC));
+
+	kept = 0;
+	for (size_t i = first; ok && i < n; i++) {
+		struct blockstore_record *rec = &bs->records[i];
+		ok = write_all(data_fd, bs->map + rec->offset, rec->len);
+		rec->offset = kept;
+		kept += rec->len;
+		ok &= write_all(idx_fd, rec, sizeof(*rec));
+	}
+	/* Whenever we crash, the index must not point into data it wasn't
+	 * written for: the new files are on disk before they replace the
+	 * old ones, the old index is emptied before the data changes, and
+	 * the new index only comes once the new data is there to stay. */
+	ok = ok && fsync(data_fd) == 0 && fsync(idx_fd) == 0 &&
+	     ftruncate(bs->idx_fd, strlen(BLOCKSTORE_MAGIC)) == 0 &&
+	     fsync(bs->idx_fd) == 0;
+	if (!ok || rename(data_tmp, data_path) != 0 ||
+	    !blockstore_sync_dir(bs) || rename(idx_tmp, idx_path) != 0 ||
+	    !blockstore_sync_dir(bs)) {
+		if (data_fd >= 0)
+			close(data_fd);
+		if (idx_fd >= 0)
+			close(idx_fd);
+		return blockstore_reset(bs);
+	}
+
+	close(bs->data_fd);
+	close(bs->idx_fd);
+	bs->data_fd = data_fd;
+	bs->idx_fd = idx_fd;
+	memmove(bs->records, bs->records + first,
+		(n - first) * sizeof(*bs->records));
+	tal_resize(&bs->records, n - first);
+	bs->data_len = kept;
+	return blockstore_remap(bs);
+}
+
+/* Make room for a block of `len` bytes we'll write at `*offset`, as it
+ * arrives, before we blockstore_commit() it. */
+static bool blockstore_reserve(struct blockstore *bs, size_t len,
+			       u64 *offset)
+{
+	if (len == 0 || len > bs->max_len / 2)
+		return false;
+	if (bs->data_len + len > bs->max_len && !blockstore_compact(bs))
+		return false;
+
+	*offset = bs->data_len;
+	bs->data_len += len;
+	bs->num_reserved++;
+	return true;
+}
+
+static bool blockstore_write(struct blockstore *bs, u64 offset,
+			     const u8 *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = pwrite(bs->data_fd, data, len, offset);
+		if (n <= 0)
+			return false;
+		data += n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
+
+/* We are done writing what we reserved: if `blkid` is NULL we failed and
+ * the space is only reclaimed by the next compaction. */
+static bool blockstore_commit(struct blockstore *bs, u32 height,
+			      const struct bitcoin_blkid *blkid, u64 offset,
+			      size_t len)
+{
+	struct blockstore_record rec;
+
+	bs->num_reserved--;
+	if (!blkid)
+		return true;
+
+	rec.height = height;
+	rec.len = len;
+	rec.offset = offset;
+	rec.blkid = *blkid;
+	if (!write_all(bs->idx_fd, &rec, sizeof(rec)))
+		return false;
+	blockstore_apply(bs, &rec);
+	return true;
+}
+
+static bool blockstore_put(struct blockstore *bs, u32 height,
+			   const struct bitcoin_blkid *blkid, const u8 *block,
+			   size_t len)
+{
+	u64 offset;
+
+	/* Too big for us, or we're busy writing. */
+	if (!blockstore_reserve(bs, len, &offset))
+		return true;
+	if (!blockstore_write(bs, offset, block, len)) {
+		blockstore_commit(bs, height, NULL, offset, len);
+		return false;
+	}
+	return blockstore_commit(bs, height, blkid, offset, len);
+}
+
+/* Get the block at `height` if we have it, and if it's still the one
+ * hashing to `blkid`: otherwise it got reorged out and we forget it. */
+static const u8 *blockstore_get(struct blockstore *bs, u32 height,
+				const struct bitcoin_blkid *blkid, size_t *len)
+{
+	size_t i = blockstore_find(bs, height);
+	struct blockstore_record *rec;
+	struct sha256_double shad;
+	const u8 *block;
+
+	if (i == tal_count(bs->records) || bs->records[i].height != height)
+		return NULL;
+
+	rec = &bs->records[i];
+	if (!bitcoin_blkid_eq(&rec->blkid, blkid)) {
+		blockstore_invalidate(bs, height);
+		return NULL;
+	}
+	if (rec->offset + rec->len > bs->map_len && !blockstore_remap(bs))
+		return NULL;
+
+	/* Don't blindly trust the disk: the header must hash to `blkid`
+	 * (which is why there's no block store on Elements). */
+	block = bs->map + rec->offset;
+	if (rec->len < 80)
+		return NULL;
+	sha256_double(&shad, block, 80);
+	if (memcmp(&shad, &blkid->shad, sizeof(shad)) != 0) {
+		blockstore_invalidate(bs, height);
+		return NULL;
+	}
+
+	*len = rec->len;
+	return block;
+}
+
+/* How many heights does our header chain cover ? */
+#define HEADERS_WINDOW 2016
+
+/* Esplora's /blocks/:start_height returns 10 headers at once. */
+#define HEADERS_BATCH 10
+
+/* How long do we trust esplora not to know past a height (seconds) ? */
+#define HEADERS_CEILING_TTL 60
+
+/* A hash this close to the best header we know may get reorged out, we
+ * only trust it for HEADERS_SHALLOW_TTL seconds. */
+#define HEADERS_SHALLOW 6
+#define HEADERS_SHALLOW_TTL 10
+
+struct header_entry {
+	bool known;
+	struct bitcoin_blkid blkid;
+	struct timemono fetched;
+};
+
+/* Someone waiting for the hash at `height`. */
+struct header_waiter {
+	struct list_node list;
+	u32 height;
+	void (*cb)(const struct bitcoin_blkid *blkid, void *arg);
+	void *arg;
+};
+
+/* A /blocks/:start_height request in flight, covering `start` and the
+ * HEADERS_BATCH - 1 heights below. */
+struct headers_batch {
+	struct list_node list;
+	u32 start;
+	struct list_head waiters;
+};
+
+/* The height -> hash table we resolve heights with, one batch of headers
+ * at a time instead of one /block-height request per block. */
+struct headers {
+	/* `entries[i]` is the header at height `base + i`. */
+	u32 base;
+	struct header_entry *entries;
+
+	/* The highest header we know of. */
+	u32 best_height;
+
+	/* The lowest height esplora told us it doesn't know of, and when. */
+	u32 ceiling;
+	struct timemono ceiling_set;
+
+	struct list_head batches;
+};
+
+static struct headers *headers;
+
+static struct header_entry *headers_entry(u32 height)
+{
+	if (height < headers->base ||
+	    height - headers->base >= tal_count(headers->entries))
+		return NULL;
+	return &headers->entries[height - headers->base];
+}
+
+static const struct bitcoin_blkid *headers_lookup(u32 height)
+{
+	struct header_entry *e = headers_entry(height);
+
+	if (!e || !e->known)
+		return NULL;
+	if (height + HEADERS_SHALLOW > headers->best_height &&
+	    time_greater(timemono_since(e->fetched),
+			 time_from_sec(HEADERS_SHALLOW_TTL)))
+		return NULL;
+	return &e->blkid;
+}
+
+/* Forget about all the hashes from `height`, they got reorged out. */
+static void headers_forget_from(u32 height)
+{
+	for (size_t i = 0; i < tal_count(headers->entries); i++) {
+		if (headers->base + i >= height)
+			headers->entries[i].known = false;
+	}
+	if (headers->best_height >= height)
+		headers->best_height = height ? height - 1 : 0;
+}
+
+static void headers_set(u32 height, const struct bitcoin_blkid *blkid)
+{
+	struct header_entry *e;
+
+	/* Move the window so that it covers `height`. */
+	if (!headers_entry(height)) {
+		struct header_entry *old = headers->entries;
+		u32 old_base = headers->base;
+
+		headers->base =
+		    height > HEADERS_WINDOW / 2 ? height - HEADERS_WINDOW / 2
+						: 0;
+		headers->entries =
+		    tal_arrz(headers, struct header_entry, HEADERS_WINDOW);
+		for (size_t i = 0; i < tal_count(old); i++) {
+			e = headers_entry(old_base + i);
+			if (e)
+				*e = old[i];
+		}
+		tal_free(old);
+	}
+
+	e = headers_entry(height);
+	if (e->known && !bitcoin_blkid_eq(&e->blkid, blkid))
+		headers_forget_from(height);
+	e->known = true;
+	e->blkid = *blkid;
+	e->fetched = time_mono();
+	if (height > headers->best_height)
+		headers->best_height = height;
+	if (height >= headers->ceiling)
+		headers->ceiling = height + 1;
+}
+
+/* Check that the header esplora gave us does hash to its id. */
+static bool header_check(const char *buf, const jsmntok_t *tok,
+			 const struct bitcoin_blkid *blkid)
+{
+	struct bitcoin_block block;
+	struct bitcoin_blkid merkle, computed;
+	const jsmntok_t *prevtok;
+	u32 version, timestamp, target, nonce;
+
+	/* Elements headers carry more than that. */
+	if (chainparams->is_elements)
+		return true;
+
+	memset(&block, 0, sizeof(block));
+	if (json_scan(tmpctx, buf, tok,
+		      "{version:%,timestamp:%,bits:%,nonce:%,merkle_root:%}",
+		      JSON_SCAN(json_to_u32, &version),
+		      JSON_SCAN(json_to_u32, &timestamp),
+		      JSON_SCAN(json_to_u32, &target),
+		      JSON_SCAN(json_to_u32, &nonce),
+		      JSON_SCAN(json_to_blkid, &merkle)))
+		return false;
+	/* The header is hashed as it goes on the wire. */
+	block.hdr.version = cpu_to_le32(version);
+	block.hdr.timestamp = cpu_to_le32(timestamp);
+	block.hdr.target = cpu_to_le32(target);
+	block.hdr.nonce = cpu_to_le32(nonce);
+	block.hdr.merkle_hash = merkle.shad;
+
+	/* The genesis block has a null previousblockhash. */
+	prevtok = json_get_member(buf, tok, "previousblockhash");
+	if (prevtok && prevtok->type == JSMN_STRING &&
+	    !json_to_blkid(buf, prevtok, &block.hdr.prev_hash))
+		return false;
+
+	bitcoin_block_blkid(&block, &computed);
+	return bitcoin_blkid_eq(&computed, blkid);
+}
+
+/* The id of a raw header (as Electrum gives them), and the one it builds
+ * upon. */
+static bool header_from_raw(const u8 *raw, size_t len,
+			    struct bitcoin_blkid *blkid,
+			    struct bitcoin_blkid *prev)
+{
+	if (len != 80)
+		return false;
+	sha256_double(&blkid->shad, raw, len);
+	memcpy(prev, raw + offsetof(struct bitcoin_block_hdr, prev_hash),
+	       sizeof(*prev));
+	return true;
+}
+
+/* Check that a raw block hashes to its id, and that its transactions are
+ * the ones its merkle root commits to. */
+static bool block_check(const u8 *block, size_t len,
+			const struct bitcoin_blkid *blkid)
+{
+	const u8 *merkle_root;
+	struct sha256_double shad, *txids;
+	struct bitcoin_txid txid;
+	struct bitcoin_tx *tx;
+	varint_t num;
+	size_t n;
+	u8 pair[2 * sizeof(shad)];
+
+	/* Elements headers are not 80 bytes. */
+	if (chainparams->is_elements)
+		return true;
+	if (len < 80)
+		return false;
+	sha256_double(&shad, block, 80);
+	if (memcmp(&shad, &blkid->shad, sizeof(shad)) != 0)
+		return false;
+	merkle_root = block + offsetof(struct bitcoin_block_hdr, merkle_hash);
+
+	n = varint_get(block + 80, len - 80, &num);
+	if (n == 0 || num == 0 || num > len)
+		return false;
+	block += 80 + n;
+	len -= 80 + n;
+	txids = tal_arr(tmpctx, struct sha256_double, num);
+	for (size_t i = 0; i < num; i++) {
+		tx = pull_bitcoin_tx(tmpctx, &block, &len);
+		if (!tx)
+			return false;
+		bitcoin_txid(tx, &txid);
+		txids[i] = txid.shad;
+		tal_free(tx);
+	}
+	if (len != 0)
+		return false;
+
+	/* Hash them by pairs up to the root, the odd one out with itself. */
+	for (; num > 1; num = (num + 1) / 2) {
+		for (size_t i = 0; i < num; i += 2) {
+			memcpy(pair, &txids[i], sizeof(shad));
+			memcpy(pair + sizeof(shad),
+			       &txids[i + 1 < num ? i + 1 : i], sizeof(shad));
+			sha256_double(&txids[i / 2], pair, sizeof(pair));
+		}
+	}
+	return memcmp(&txids[0], merkle_root, sizeof(shad)) == 0;
+}
+
+static bool headers_enqueue(struct header_waiter *w);
+
+static void headers_lower_ceiling(u32 height)
+{
+	if (height >= headers->ceiling)
+		return;
+	headers->ceiling = height;
+	headers->ceiling_set = time_mono();
+}
+
+static void destroy_header_waiter(struct header_waiter *w)
+{
+	list_del(&w->list);
+}
+
+/* Give `w` its answer. */
+static void header_waiter_done(struct header_waiter *w,
+			       const struct bitcoin_blkid *blkid)
+{
+	/* The callback may free our parent. */
+	tal_steal(tmpctx, w);
+	w->cb(blkid, w->arg);
+}
+
+/* Everyone waiting on `batch` has its answer, or there's none. */
+static void headers_batch_deliver(struct headers_batch *batch)
+{
+	struct header_waiter *w;
+
+	while ((w = list_pop(&batch->waiters, struct header_waiter, list))) {
+		tal_del_destructor(w, destroy_header_waiter);
+		header_waiter_done(w, headers_lookup(w->height));
+	}
+}
+
+static void headers_batch_failed(struct headers_batch *batch)
+{
+	struct header_waiter *w;
+
+	/* Maybe we were asking past the tip: ask again for what we are
+	 * interested in only. */
+	headers_lower_ceiling(batch->start);
+	while ((w = list_pop(&batch->waiters, struct header_waiter, list))) {
+		if (w->height < batch->start) {
+			headers_lower_ceiling(w->height + 1);
+			if (headers_enqueue(w))
+				continue;
+		}
+		tal_del_destructor(w, destroy_header_waiter);
+		header_waiter_done(w, NULL);
+	}
+}
+
+static void headers_batch_done(const u8 *res, struct headers_batch *batch)
+{
+	const char *buf = (const char *)res;
+	const jsmntok_t *toks, *t, *prevtok;
+	struct bitcoin_blkid *blkids, prev;
+	u32 *heights;
+	size_t i;
+
+	list_del(&batch->list);
+	tal_steal(tmpctx, batch);
+	if (!res) {
+		headers_batch_failed(batch);
+		return;
+	}
+
+	toks = json_parse_simple(tmpctx, buf, tal_count(res));
+	if (!toks || toks->type != JSMN_ARRAY)
+		goto invalid;
+
+	/* Check it all before trusting any of it: headers must hash to
+	 * their id, and link to each other. */
+	blkids = tal_arr(tmpctx, struct bitcoin_blkid, toks->size);
+	heights = tal_arr(tmpctx, u32, toks->size);
+	json_for_each_arr(i, t, toks)
+	{
+		if (json_scan(tmpctx, buf, t, "{id:%,height:%}",
+			      JSON_SCAN(json_to_blkid, &blkids[i]),
+			      JSON_SCAN(json_to_u32, &heights[i])) ||
+		    !header_check(buf, t, &blkids[i]))
+			goto invalid;
+		if (i == 0)
+			continue;
+		if (heights[i] + i != heights[0])
+			goto invalid;
+		if (chainparams->is_elements)
+			continue;
+		prevtok = json_get_member(buf, json_get_arr(toks, i - 1),
+					  "previousblockhash");
+		if (!prevtok || !json_to_blkid(buf, prevtok, &prev) ||
+		    !bitcoin_blkid_eq(&prev, &blkids[i]))
+			goto invalid;
+	}
+	for (i = 0; i < tal_count(blkids); i++)
+		headers_set(heights[i], &blkids[i]);
+	headers_batch_deliver(batch);
+	return;
+
+invalid:
+	plugin_log(http->plugin, LOG_UNUSUAL,
+		   "Invalid headers from /blocks/%u: %.*s", batch->start,
+		   (int)tal_count(res), buf);
+	headers_batch_failed(batch);
+}
+
+/* The lowest height of `batch`. */
+static u32 headers_batch_first(const struct headers_batch *batch)
+{
+	if (batch->start < HEADERS_BATCH - 1)
+		return 0;
+	return batch->start - (HEADERS_BATCH - 1);
+}
+
+/* Electrum gives us the raw headers, from the lowest one up. */
+static void headers_batch_electrum(const char *buf, const jsmntok_t *result,
+				   const jsmntok_t *error UNUSED,
+				   struct headers_batch *batch)
+{
+	u32 first = headers_batch_first(batch), count;
+	const jsmntok_t *hextok;
+	struct bitcoin_blkid *blkids, prev;
+	const u8 *raw;
+
+	list_del(&batch->list);
+	tal_steal(tmpctx, batch);
+	if (!result) {
+		headers_batch_failed(batch);
+		return;
+	}
+
+	hextok = json_get_member(buf, result, "hex");
+	if (!hextok ||
+	    json_scan(tmpctx, buf, result, "{count:%}",
+		      JSON_SCAN(json_to_u32, &count)) ||
+	    count > batch->start - first + 1)
+		goto invalid;
+	raw = json_tok_bin_from_hex(tmpctx, buf, hextok);
+	if (!raw || tal_count(raw) != count * 80)
+		goto invalid;
+
+	/* They must link to each other. */
+	blkids = tal_arr(tmpctx, struct bitcoin_blkid, count);
+	for (size_t i = 0; i < count; i++) {
+		header_from_raw(raw + i * 80, 80, &blkids[i], &prev);
+		if (i > 0 && !bitcoin_blkid_eq(&prev, &blkids[i - 1]))
+			goto invalid;
+	}
+	for (size_t i = 0; i < count; i++)
+		headers_set(first + i, &blkids[i]);
+	/* It knows of nothing past its tip. */
+	if (first + count <= batch->start)
+		headers_lower_ceiling(first + count);
+	headers_batch_deliver(batch);
+	return;
+
+invalid:
+	plugin_log(http->plugin, LOG_UNUSUAL,
+		   "Invalid headers from blockchain.block.headers %u: %.*s",
+		   first, json_tok_full_len(result),
+		   json_tok_full(buf, result));
+	headers_batch_failed(batch);
+}
+
+/* Attach `w` to a batch covering its height, asking esplora if there's
+ * none yet. */
+static bool headers_enqueue(struct header_waiter *w)
+{
+	struct headers_batch *batch;
+	u32 start;
+
+	list_for_each(&headers->batches, batch, list)
+	{
+		if (w->height <= batch->start &&
+		    w->height + HEADERS_BATCH > batch->start) {
+			list_add_tail(&batch->waiters, &w->list);
+			return true;
+		}
+	}
+
+	/* We sync upwards: ask for the batch that ends at `height`, unless
+	 * that's past what esplora knows about (or used to). */
+	if (time_greater(timemono_since(headers->ceiling_set),
+			 time_from_sec(HEADERS_CEILING_TTL)))
+		headers->ceiling = UINT32_MAX;
+	start = w->height + HEADERS_BATCH - 1;
+	if (start >= headers->ceiling)
+		start = headers->ceiling > w->height ? headers->ceiling - 1
+						      : w->height;
+
+	batch = tal(headers, struct headers_batch);
+	batch->start = start;
+	list_head_init(&batch->waiters);
+	if (electrum) {
+		electrum_call(batch, "blockchain.block.headers",
+			      tal_fmt(tmpctx, "[%u,%u]",
+				      headers_batch_first(batch),
+				      start - headers_batch_first(batch) + 1),
+			      headers_batch_electrum, batch);
+	} else if (!http_request(batch, HTTP_BLOCK,
+				 tal_fmt(tmpctx, "/blocks/%u", start), NULL,
+				 headers_batch_done, batch)) {
+		tal_free(batch);
+		return false;
+	}
+	list_add_tail(&headers->batches, &batch->list);
+	list_add_tail(&batch->waiters, &w->list);
+	return true;
+}
+
+/* Resolve the hash at `height` from esplora, calling `cb` with NULL if
+ * it doesn't know about it (yet). Freeing `ctx` cancels it. Returns
+ * false (and never calls `cb`) if we could not even ask. */
+static bool headers_resolve_(const tal_t *ctx, u32 height,
+			     void (*cb)(const struct bitcoin_blkid *blkid,
+					void *arg),
+			     void *arg)
+{
+	struct header_waiter *w = tal(ctx, struct header_waiter);
+
+	w->height = height;
+	w->cb = cb;
+	w->arg = arg;
+	if (!headers_enqueue(w)) {
+		tal_free(w);
+		return false;
+	}
+	tal_add_destructor(w, destroy_header_waiter);
+	return true;
+}
+
+#define headers_resolve(ctx, height, cb, arg)                                  \
+	headers_resolve_((ctx), (height),                                      \
+			 typesafe_cb_preargs(void, void *, (cb), (arg),       \
+					     const struct bitcoin_blkid *),    \
+			 (arg))
+
+static struct headers *new_headers(const tal_t *ctx)
+{
+	struct headers *headers = tal(ctx, struct headers);
+
+	headers->base = 0;
+	headers->entries = tal_arr(headers, struct header_entry, 0);
+	headers->best_height = 0;
+	headers->ceiling = UINT32_MAX;
+	headers->ceiling_set = time_mono();
+	list_head_init(&headers->batches);
+
+	return headers;
+}
+
+static char *get_network_from_genesis_block(const char *blockhash)
+{
+	if (strncmp(blockhash,
+		    "000000000019d6689c085ae165831e934ff763ae46a2a6c1"
+		    "72b3f1b60a8ce26f",
+		    64) == 0)
+		return "main";
+	else if (strncmp(blockhash,
+			 "000000000933ea01ad0ee984209779baaec3ced90fa3f4087"
+			 "19526f8d77f4943",
+			 64) == 0)
+		return "test";
+	else if (strncmp(blockhash,
+			 "1466275836220db2944ca059a3a10ef6fd2ea684b0688d2c3"
+			 "79296888a206003",
+			 64) == 0)
+		return "liquidv1";
+	else if (strncmp(blockhash,
+			 "0f9188f13cb7b2c71f2a335e3a4fc328bf5beb436012afca5"
+			 "90b1a11466e2206",
+			 64) == 0)
+		return "regtest";
+	else
+		return NULL;
+}
+
+static struct command_result *request_error(struct command *cmd,
+					    const char *path)
+{
+	char *err =
+	    tal_fmt(cmd, "%s: request error on %s", cmd->methodname, path);
+	return command_done_err(cmd, BCLI_ERROR, err, NULL);
+}
+
+static bool tip_get(u32 *height);
+
+static struct command_result *
+getchaininfo_reply(struct command *cmd, const char *block_genesis, u32 height)
+{
+	char *err;
+
+	// parsing blockgenesis to get the chain name information
+	const char *chain = get_network_from_genesis_block(block_genesis);
+	if (!chain) {
+		err = tal_fmt(cmd, "%s: no chain found for genesis block %s",
+			      cmd->methodname, block_genesis);
+		return command_done_err(cmd, BCLI_ERROR, err, NULL);
+	}
+
+	// send response with chain information
+	struct json_stream *response = jsonrpc_stream_success(cmd);
+	json_add_string(response, "chain", chain);
+	json_add_u32(response, "headercount", height);
+	json_add_u32(response, "blockcount", height);
+	json_add_bool(response, "ibd", false);
+
+	return command_finished(cmd, response);
+}
+
+static struct command_result *
+getchaininfo_done(struct command *cmd, const u8 *res, char *block_genesis)
+{
+	char *err;
+
+	if (!res)
+		return request_error(cmd, "/blocks/tip/height");
+
+	const char *blockcount = tal_strndup(cmd, (char *)res, tal_count(res));
+	plugin_log(cmd->plugin, LOG_INFORM, "blockcount: %s", blockcount);
+
+	const char *error;
+	u32 height;
+	if (!get_u32_from_string(NULL, &height, blockcount, &error)) {
+		err = tal_fmt(cmd,
+			      "%s: invalid height conversion on %s (error: %s)",
+			      cmd->methodname, blockcount, error);
+		return command_done_err(cmd, BCLI_ERROR, err, NULL);
+	}
+
+	return getchaininfo_reply(cmd, block_genesis, height);
+}
+
+static struct command_result *getchaininfo_genesis(struct command *cmd,
+						   const u8 *res, void *unused)
+{
+	if (!res)
+		return request_error(cmd, "/block-height/0");
+
+	char *block_genesis = tal_strndup(cmd, (char *)res, tal_count(res));
+	plugin_log(cmd->plugin, LOG_INFORM, "block_genesis: %s", block_genesis);
+
+	// the tip watcher usually knows the block count already
+	u32 height;
+	if (tip_get(&height))
+		return getchaininfo_reply(cmd, block_genesis, height);
+
+	// fetch block count
+	return request_cached(cmd, HTTP_CHAIN, "/blocks/tip/height",
+			      esplora->tip_ttl, getchaininfo_done,
+			      block_genesis);
+}
+
+static void getchaininfo_electrum_tip(const char *buf, const jsmntok_t *result,
+				      const jsmntok_t *error UNUSED,
+				      struct command *cmd)
+{
+	u32 height;
+
+	if (!result || json_scan(tmpctx, buf, result, "{height:%}",
+				 JSON_SCAN(json_to_u32, &height))) {
+		request_error(cmd, "blockchain.headers.subscribe");
+		return;
+	}
+	getchaininfo_reply(cmd, electrum->genesis, height);
+}
+
+static struct command_result *getchaininfo_electrum(struct command *cmd)
+{
+	u32 height;
+
+	// we're usually told about the tip already
+	if (tip_get(&height))
+		return getchaininfo_reply(cmd, electrum->genesis, height);
+
+	electrum_call(cmd, "blockchain.headers.subscribe", "[]",
+		      getchaininfo_electrum_tip, cmd);
+	return command_still_pending(cmd);
+}
+
+static void getchaininfo_electrum_genesis(const char *buf,
+					  const jsmntok_t *result,
+					  const jsmntok_t *error UNUSED,
+					  struct command *cmd)
+{
+	struct bitcoin_blkid blkid, prev;
+	const u8 *raw = NULL;
+
+	if (result)
+		raw = json_tok_bin_from_hex(tmpctx, buf, result);
+	if (!raw || !header_from_raw(raw, tal_count(raw), &blkid, &prev)) {
+		request_error(cmd, "blockchain.block.header");
+		return;
+	}
+	electrum->genesis =
+	    tal_arr(electrum, char, hex_str_size(sizeof(blkid)));
+	bitcoin_blkid_to_hex(&blkid, electrum->genesis,
+			     tal_count(electrum->genesis));
+	getchaininfo_electrum(cmd);
+}
+
+static struct command_result *getchaininfo_remote(struct command *cmd)
+{
+	if (electrum && electrum->genesis)
+		return getchaininfo_electrum(cmd);
+	if (electrum) {
+		electrum_call(cmd, "blockchain.block.header", "[0]",
+			      getchaininfo_electrum_genesis, cmd);
+		return command_still_pending(cmd);
+	}
+
+	// fetch block genesis hash, once and for all
+	return request_cached(cmd, HTTP_CHAIN, "/block-height/0",
+			      CACHE_FOREVER, getchaininfo_genesis, NULL);
+}
+
+/* Our bitcoind knows the chain by name, and whether it's still syncing:
+ * we ask esplora if it can't tell us. */
+static void getchaininfo_core_done(const u8 *res, long status,
+				   struct command *cmd)
+{
+	const char *buf = (const char *)res;
+	const jsmntok_t *toks = NULL, *chaintok = NULL;
+	struct json_stream *response;
+	u32 blocks, headers;
+	bool ibd;
+
+	if (res && status == 200)
+		toks = json_parse_simple(tmpctx, buf, tal_count(res));
+	if (toks)
+		chaintok = json_get_member(buf, toks, "chain");
+	if (!chaintok ||
+	    json_scan(tmpctx, buf, toks,
+		      "{blocks:%,headers:%,initialblockdownload:%}",
+		      JSON_SCAN(json_to_u32, &blocks),
+		      JSON_SCAN(json_to_u32, &headers),
+		      JSON_SCAN(json_to_bool, &ibd))) {
+		plugin_log(cmd->plugin, LOG_DBG,
+			   "bitcoind answered /rest/chaininfo.json with %ld, "
+			   "asking esplora",
+			   status);
+		getchaininfo_remote(cmd);
+		return;
+	}
+
+	response = jsonrpc_stream_success(cmd);
+	json_add_string(response, "chain", json_strdup(tmpctx, buf, chaintok));
+	json_add_u32(response, "headercount", headers);
+	json_add_u32(response, "blockcount", blocks);
+	json_add_bool(response, "ibd", ibd);
+	command_finished(cmd, response);
+}
+
+/* Get infos about the block chain.
+ * Calls `getblockchaininfo` and returns headers count, blocks count,
+ * the chain id, and whether this is initialblockdownload.
+ */
+static struct command_result *getchaininfo(struct command *cmd,
+					   const char *buf UNUSED,
+					   const jsmntok_t *toks UNUSED)
+{
+	if (!param(cmd, buf, toks, NULL))
+		return command_param_failed();
+
+	plugin_log(cmd->plugin, LOG_INFORM, "getchaininfo");
+	stats_command(cmd);
+
+	if (core_usable() &&
+	    http_request_to(cmd, HTTP_CHAIN, http->core, "/rest/chaininfo.json",
+			    NULL, getchaininfo_core_done, cmd))
+		return command_still_pending(cmd);
+	return getchaininfo_remote(cmd);
+}
+
+static struct command_result *getrawblockbyheight_notfound(struct command *cmd)
+{
+	struct json_stream *response;
+
+	response = jsonrpc_stream_success(cmd);
+	json_add_null(response, "blockhash");
+	json_add_null(response, "block");
+
+	return command_finished(cmd, response);
+}
+
+struct getrawblock_state {
+	struct command *cmd;
+	u32 height;
+	char *blockhash;
+	struct bitcoin_blkid blkid;
+
+	/* While we stream the block straight into the response: `hex`
+	 * points into it, and we write it to the block store as well. */
+	struct json_stream *response;
+	char *hex;
+	size_t len, received;
+	bool storing;
+	u64 store_offset;
+
+	/* The download, NULL until it starts, and is it from our bitcoind
+	 * (until it fails) ? */
+	struct http_request *req;
+	bool from_core;
+};
+
+static void destroy_getrawblock_state(struct getrawblock_state *st)
+{
+	if (st->storing)
+		blockstore_commit(blockstore, st->height, NULL,
+				  st->store_offset, st->len);
+}
+
+static struct command_result *
+getrawblockbyheight_reply(struct command *cmd,
+			  const struct getrawblock_state *st, const u8 *block,
+			  size_t len)
+{
+	struct json_stream *response;
+	struct timemono start = trace_now();
+
+	// send response with block and blockhash in hex format, the block
+	// being encoded straight into the response
+	response = jsonrpc_stream_success(cmd);
+	json_add_string(response, "blockhash", st->blockhash);
+	json_add_hexbin(response, "block", block, len);
+	if (tracer)
+		trace_span(trace_track(cmd), "json", "json", start, NULL);
+
+	return command_finished(cmd, response);
+}
+
+static struct command_result *
+getrawblockbyheight_done(struct command *cmd, const u8 *block_res,
+			 struct getrawblock_state *st)
+{
+	char *err;
+
+	if (!block_res) {
+		err = tal_fmt(cmd, "%s: request error on /block/%s/raw",
+			      cmd->methodname, st->blockhash);
+		plugin_log(cmd->plugin, LOG_INFORM, "%s", err);
+		// block not found as getrawblockbyheight_notfound
+		return getrawblockbyheight_notfound(cmd);
+	}
+
+	if (blockstore && !blockstore_put(blockstore, st->height, &st->blkid,
+					  block_res, tal_count(block_res)))
+		plugin_log(cmd->plugin, LOG_UNUSUAL,
+			   "Could not store block %u in %s: %s", st->height,
+			   blockstore->dir, strerror(errno));
+
+	return getrawblockbyheight_reply(cmd, st, block_res,
+					 tal_count(block_res));
+}
+
+static bool getrawblockbyheight_stream(const u8 *data, size_t len,
+				       size_t offset, s64 total,
+				       struct getrawblock_state *st)
+{
+	struct timemono start;
+
+	// we need to know how much room to make in the response
+	if (offset == 0 && !st->response) {
+		if (total <= 0)
+			return false;
+		st->len = total;
+		st->response = jsonrpc_stream_success(st->cmd);
+		json_add_string(st->response, "blockhash", st->blockhash);
+		st->hex = json_member_direct(st->response, "block",
+					     hex_str_size(st->len) + 1);
+		st->hex[0] = '"';
+		st->storing =
+		    blockstore &&
+		    blockstore_reserve(blockstore, st->len, &st->store_offset);
+	}
+
+	// a retry must give us the very same block
+	if (total != (s64)st->len || offset + len > st->len)
+		return false;
+
+	start = trace_now();
+	esplora_hex_encode(data, len, st->hex + 1 + offset * 2);
+	if (tracer)
+		trace_span(trace_track(st->cmd), "hex", "json", start,
+			   tal_fmt(tmpctx, "{\"bytes\":%zu}", len));
+	if (st->storing && !blockstore_write(blockstore,
+					     st->store_offset + offset, data,
+					     len)) {
+		blockstore_commit(blockstore, st->height, NULL,
+				  st->store_offset, st->len);
+		st->storing = false;
+	}
+	st->received = offset + len;
+	return true;
+}
+
+/* Don't hand out a block pieced together from several transfers without
+ * checking it: `block_res` if it's buffered, else what we streamed. */
+static bool getrawblockbyheight_check(const u8 *block_res, bool streamed,
+				      struct getrawblock_state *st)
+{
+	u8 *block;
+
+	if (!block_res || !http_request_resumed(st->req))
+		return true;
+	if (!streamed)
+		return block_check(block_res, tal_count(block_res), &st->blkid);
+
+	block = tal_arr(tmpctx, u8, st->len);
+	return hex_decode(st->hex + 1, st->len * 2, block, st->len) &&
+	       block_check(block, st->len, &st->blkid);
+}
+
+static struct command_result *
+getrawblockbyheight_download(struct getrawblock_state *st);
+
+static void getrawblockbyheight_streamed(const u8 *block_res,
+					 struct getrawblock_state *st)
+{
+	bool streamed = block_res && tal_count(block_res) == 0 &&
+			st->response && st->received == st->len;
+
+	if (!getrawblockbyheight_check(block_res, streamed, st)) {
+		plugin_log(st->cmd->plugin, LOG_UNUSUAL,
+			   "Resumed download of block %s is invalid",
+			   st->blockhash);
+		block_res = NULL;
+		streamed = false;
+	}
+
+	if (st->storing) {
+		if (!blockstore_commit(blockstore, st->height,
+				       streamed ? &st->blkid : NULL,
+				       st->store_offset, st->len))
+			plugin_log(st->cmd->plugin, LOG_UNUSUAL,
+				   "Could not store block %u in %s: %s",
+				   st->height, blockstore->dir,
+				   strerror(errno));
+		st->storing = false;
+	}
+
+	// we could not stream it, it got buffered
+	if (!streamed) {
+		st->response = tal_free(st->response);
+		// our bitcoind may well have pruned it
+		if (!block_res && st->from_core) {
+			st->from_core = false;
+			getrawblockbyheight_download(st);
+			return;
+		}
+		getrawblockbyheight_done(st->cmd, block_res, st);
+		return;
+	}
+
+	st->hex[hex_str_size(st->len)] = '"';
+	command_finished(st->cmd, st->response);
+}
+
+/* Esplora (or our bitcoind) serves raw block, which we encode in the
+ * response as it arrives */
+static struct command_result *
+getrawblockbyheight_download(struct getrawblock_state *st)
+{
+	const char *block_path = tal_fmt(st, "/block/%s/raw", st->blockhash);
+
+	if (st->from_core && core_usable()) {
+		st->req = http_request_stream_to(
+		    st, HTTP_BLOCK, http->core,
+		    tal_fmt(tmpctx, "/rest/block/%s.bin", st->blockhash),
+		    getrawblockbyheight_stream, getrawblockbyheight_streamed,
+		    st);
+		if (st->req)
+			return command_still_pending(st->cmd);
+	}
+	st->from_core = false;
+
+	stats_cache(block_path, false);
+	st->req = http_request_stream(st, HTTP_BLOCK, block_path,
+				      getrawblockbyheight_stream,
+				      getrawblockbyheight_streamed, st);
+	if (!st->req)
+		return getrawblockbyheight_done(st->cmd, NULL, st);
+	return command_still_pending(st->cmd);
+}
+
+static struct command_result *
+getrawblockbyheight_hash(struct getrawblock_state *st,
+			 const struct bitcoin_blkid *blkid)
+{
+	struct command *cmd = st->cmd;
+	const u8 *block;
+	size_t len;
+
+	if (!blkid) {
+		// block not found as getrawblockbyheight_notfound
+		return getrawblockbyheight_notfound(cmd);
+	}
+	st->blkid = *blkid;
+	st->blockhash = tal_arr(st, char, hex_str_size(sizeof(*blkid)));
+	bitcoin_blkid_to_hex(blkid, st->blockhash, tal_count(st->blockhash));
+	plugin_log(cmd->plugin, LOG_INFORM, "blockhash: %s from height %u",
+		   st->blockhash, st->height);
+
+	// We may already have it on disk
+	if (blockstore) {
+		block =
+		    blockstore_get(blockstore, st->height, &st->blkid, &len);
+		if (block) {
+			stats_cache("/block/:hash/raw", true);
+			return getrawblockbyheight_reply(cmd, st, block, len);
+		}
+	}
+
+	return getrawblockbyheight_download(st);
+}
+
+static void getrawblockbyheight_resolved(const struct bitcoin_blkid *blkid,
+					 struct getrawblock_state *st)
+{
+	getrawblockbyheight_hash(st, blkid);
+}
+
+static struct command_result *
+getrawblockbyheight_resolve(struct getrawblock_state *st)
+{
+	char *err;
+
+	// resolve blockhash from block height, batched with the next ones
+	if (!headers_resolve(st, st->height, getrawblockbyheight_resolved,
+			     st)) {
+		err = tal_fmt(st->cmd, "%s: request error on /blocks/%u",
+			      st->cmd->methodname, st->height);
+		return command_done_err(st->cmd, BCLI_ERROR, err, NULL);
+	}
+	return command_still_pending(st->cmd);
+}
+
+/* bitcoind gives us the hash as is, in internal byte order. */
+static void getrawblockbyheight_core_hash(const u8 *res, long status,
+					  struct getrawblock_state *st)
+{
+	struct bitcoin_blkid blkid;
+
+	// past its tip (404), or not there at all: esplora may know better
+	if (!res || status != 200 || tal_count(res) != sizeof(blkid)) {
+		getrawblockbyheight_resolve(st);
+		return;
+	}
+	memcpy(&blkid, res, sizeof(blkid));
+	headers_set(st->height, &blkid);
+	getrawblockbyheight_hash(st, &blkid);
+}
+
+static struct command_result *
+getrawblockbyheight_fetch(struct getrawblock_state *st)
+{
+	const struct bitcoin_blkid *blkid = headers_lookup(st->height);
+
+	if (blkid)
+		return getrawblockbyheight_hash(st, blkid);
+	if (core_usable() &&
+	    http_request_to(st, HTTP_BLOCK, http->core,
+			    tal_fmt(tmpctx, "/rest/blockhashbyheight/%u.bin",
+				    st->height),
+			    NULL, getrawblockbyheight_core_hash, st))
+		return command_still_pending(st->cmd);
+	return getrawblockbyheight_resolve(st);
+}
+
+/* How many blocks do we download ahead at once ? */
+#define PREFETCH_MAX_INFLIGHT 2
+
+/* Don't serve a prefetched block older than this, it may have been
+ * reorged out since (seconds). */
+#define PREFETCH_MAX_AGE 60
+
+/* A block we fetch before lightningd asks for it. */
+struct prefetched_block {
+	u32 height;
+	char *blockhash;
+	struct bitcoin_blkid blkid;
+
+	/* Did we get it ? `block` is NULL if it's in the block store. */
+	bool done;
+	u8 *block;
+	struct timemono fetched;
+
+	/* Commands which asked for it while it was in flight. */
+	struct getrawblock_state **waiters;
+
+	/* The download, NULL until it starts. */
+	struct http_request *req;
+};
+
+/* lightningd asks for blocks strictly one height at a time, and each
+ * one costs two round-trips: when it syncs sequentially we fetch the
+ * next ones in the background. */
+struct prefetcher {
+	/* The last height lightningd asked for. */
+	u32 last_height;
+
+	/* We don't fetch past the first height we failed to get. */
+	u32 ceiling;
+
+	/* Blocks being or already fetched, sorted by height. */
+	struct prefetched_block **blocks;
+	size_t num_inflight;
+
+	/* How many bytes of blocks we hold. */
+	size_t mem;
+};
+
+static struct prefetcher *prefetcher;
+
+static struct prefetched_block *prefetch_find(u32 height)
+{
+	for (size_t i = 0; i < tal_count(prefetcher->blocks); i++) {
+		if (prefetcher->blocks[i]->height == height)
+			return prefetcher->blocks[i];
+	}
+	return NULL;
+}
+
+static void prefetch_forget(struct prefetched_block *pb)
+{
+	for (size_t i = 0; i < tal_count(prefetcher->blocks); i++) {
+		if (prefetcher->blocks[i] != pb)
+			continue;
+		tal_arr_remove(&prefetcher->blocks, i);
+		break;
+	}
+	if (!pb->done)
+		prefetcher->num_inflight--;
+	else if (pb->block)
+		prefetcher->mem -= tal_count(pb->block);
+	tal_free(pb);
+}
+
+static void prefetch_got_hash(const struct bitcoin_blkid *blkid,
+			      struct prefetched_block *pb);
+
+static void prefetch_fill(void)
+{
+	const struct bitcoin_blkid *blkid;
+	struct prefetched_block *pb;
+	u32 height;
+
+	for (u32 i = 1; i <= esplora->prefetch_depth; i++) {
+		if (prefetcher->num_inflight >= PREFETCH_MAX_INFLIGHT ||
+		    prefetcher->mem >= (size_t)esplora->prefetch_mb << 20)
+			return;
+		height = prefetcher->last_height + i;
+		if (height >= prefetcher->ceiling)
+			return;
+		if (prefetch_find(height))
+			continue;
+
+		pb = tal(prefetcher, struct prefetched_block);
+		pb->height = height;
+		pb->blockhash = NULL;
+		pb->done = false;
+		pb->block = NULL;
+		pb->waiters = tal_arr(pb, struct getrawblock_state *, 0);
+		pb->req = NULL;
+		tal_arr_expand(&prefetcher->blocks, pb);
+		prefetcher->num_inflight++;
+		blkid = headers_lookup(height);
+		if (blkid) {
+			prefetch_got_hash(blkid, pb);
+			continue;
+		}
+		if (!headers_resolve(pb, height, prefetch_got_hash, pb)) {
+			prefetch_forget(pb);
+			return;
+		}
+	}
+}
+
+/* lightningd asks for `height`: forget about what it won't ask anymore,
+ * and look ahead if it's syncing. */
+static void prefetch_seen(u32 height)
+{
+	bool sequential = height == prefetcher->last_height + 1;
+
+	prefetcher->last_height = height;
+	if (height >= prefetcher->ceiling)
+		prefetcher->ceiling = UINT32_MAX;
+
+	for (size_t i = 0; i < tal_count(prefetcher->blocks);) {
+		struct prefetched_block *pb = prefetcher->blocks[i];
+		bool stale =
+		    pb->done && time_greater(timemono_since(pb->fetched),
+					     time_from_sec(PREFETCH_MAX_AGE));
+		if (tal_count(pb->waiters) == 0 &&
+		    (pb->height < height ||
+		     pb->height > height + esplora->prefetch_depth || stale))
+			prefetch_forget(pb);
+		else
+			i++;
+	}
+
+	if (sequential)
+		prefetch_fill();
+}
+
+/* Hand a prefetched block to a command. */
+static struct command_result *prefetch_serve(struct prefetched_block *pb,
+					     struct getrawblock_state *st)
+{
+	struct command *cmd = st->cmd;
+	const u8 *block = pb->block;
+	size_t len = tal_count(pb->block);
+	const struct bitcoin_blkid *known = headers_lookup(st->height);
+
+	// It may have been reorged out since we fetched it
+	if (known && !bitcoin_blkid_eq(known, &pb->blkid))
+		return getrawblockbyheight_fetch(st);
+
+	st->blockhash = tal_strdup(st, pb->blockhash);
+	st->blkid = pb->blkid;
+	if (!block && blockstore)
+		block = blockstore_get(blockstore, st->height, &st->blkid,
+				       &len);
+	if (!block)
+		return getrawblockbyheight_download(st);
+	stats_cache("/block/:hash/raw", true);
+	return getrawblockbyheight_reply(cmd, st, block, len);
+}
+
+static void prefetch_done(struct prefetched_block *pb, bool ok)
+{
+	prefetcher->num_inflight--;
+	pb->done = true;
+	pb->fetched = time_mono();
+	if (ok)
+		prefetcher->mem += tal_count(pb->block);
+	else
+		prefetcher->ceiling = pb->height;
+
+	/* Serve who asked, or let them fetch it themselves. */
+	for (size_t i = 0; i < tal_count(pb->waiters); i++) {
+		if (ok)
+			prefetch_serve(pb, pb->waiters[i]);
+		else
+			getrawblockbyheight_fetch(pb->waiters[i]);
+	}
+
+	/* It's of no use anymore, make room for the next ones. */
+	if (!ok || tal_count(pb->waiters) != 0)
+		prefetch_forget(pb);
+	prefetch_fill();
+}
+
+static void prefetch_got_block(const u8 *res, struct prefetched_block *pb)
+{
+	if (!res) {
+		prefetch_done(pb, false);
+		return;
+	}
+	if (http_request_resumed(pb->req) &&
+	    !block_check(res, tal_count(res), &pb->blkid)) {
+		plugin_log(http->plugin, LOG_UNUSUAL,
+			   "Resumed download of block %s is invalid",
+			   pb->blockhash);
+		prefetch_done(pb, false);
+		return;
+	}
+
+	pb->block = tal_steal(pb, cast_const(u8 *, res));
+	if (blockstore && !blockstore_put(blockstore, pb->height, &pb->blkid,
+					  pb->block, tal_count(pb->block)))
+		plugin_log(http->plugin, LOG_UNUSUAL,
+			   "Could not store block %u in %s: %s", pb->height,
+			   blockstore->dir, strerror(errno));
+	prefetch_done(pb, true);
+}
+
+static void prefetch_download(struct prefetched_block *pb)
+{
+	pb->req = http_request_resumable(
+	    pb, HTTP_PREFETCH, tal_fmt(tmpctx, "/block/%s/raw", pb->blockhash),
+	    prefetch_got_block, pb);
+	if (!pb->req)
+		prefetch_done(pb, false);
+}
+
+/* Our bitcoind may well have pruned it: esplora has it. */
+static void prefetch_got_core_block(const u8 *res, long status,
+				    struct prefetched_block *pb)
+{
+	if (!res || status != 200) {
+		prefetch_download(pb);
+		return;
+	}
+	prefetch_got_block(res, pb);
+}
+
+static void prefetch_got_hash(const struct bitcoin_blkid *blkid,
+			      struct prefetched_block *pb)
+{
+	size_t len;
+
+	if (!blkid) {
+		prefetch_done(pb, false);
+		return;
+	}
+
+	pb->blkid = *blkid;
+	pb->blockhash = tal_arr(pb, char, hex_str_size(sizeof(*blkid)));
+	bitcoin_blkid_to_hex(blkid, pb->blockhash, tal_count(pb->blockhash));
+	if (blockstore &&
+	    blockstore_get(blockstore, pb->height, &pb->blkid, &len)) {
+		prefetch_done(pb, true);
+		return;
+	}
+
+	if (core_usable()) {
+		pb->req = http_request_to(
+		    pb, HTTP_PREFETCH, http->core,
+		    tal_fmt(tmpctx, "/rest/block/%s.bin", pb->blockhash), NULL,
+		    prefetch_got_core_block, pb);
+		if (pb->req)
+			return;
+	}
+	prefetch_download(pb);
+}
+
+static struct prefetcher *new_prefetcher(const tal_t *ctx)
+{
+	struct prefetcher *prefetcher = tal(ctx, struct prefetcher);
+
+	prefetcher->last_height = 0;
+	prefetcher->ceiling = UINT32_MAX;
+	prefetcher->blocks = tal_arr(prefetcher, struct prefetched_block *, 0);
+	prefetcher->num_inflight = 0;
+	prefetcher->mem = 0;
+
+	return prefetcher;
+}
+
+/* We keep answering from what we know of the tip while we missed at most
+ * this many polls. */
+#define TIP_MAX_MISSED 3
+
+/* Polls the chain tip in the background (or is told about it by the
+ * Electrum server): getchaininfo is answered from memory, and this is
+ * where we notice new blocks and reorgs. */
+struct tip_watcher {
+	bool known;
+	u32 height;
+	struct bitcoin_blkid blkid;
+
+	/* When esplora (or Electrum) last told us about it. */
+	struct timemono updated;
+
+	struct plugin_timer *timer;
+};
+
+static struct tip_watcher *tip;
+
+static bool tip_get(u32 *height)
+{
+	if (!tip || !tip->known)
+		return false;
+	/* Electrum tells us as soon as it changes, as long as we're
+	 * subscribed. */
+	if (electrum) {
+		if (!electrum->subscribed)
+			return false;
+	} else if (time_greater(timemono_since(tip->updated),
+				time_from_sec(esplora->tip_poll *
+					      TIP_MAX_MISSED)))
+		return false;
+	*height = tip->height;
+	return true;
+}
+
+/* Blocks from `height` on got reorged out. */
+static void tip_reorg(u32 height)
+{
+	plugin_log(http->plugin, LOG_INFORM, "Reorg from block %u", height);
+	headers_forget_from(height);
+	if (blockstore && !blockstore_invalidate_from(blockstore, height))
+		plugin_log(http->plugin, LOG_UNUSUAL,
+			   "Could not invalidate blocks in %s: %s",
+			   blockstore->dir, strerror(errno));
+	for (size_t i = 0; i < tal_count(prefetcher->blocks);) {
+		struct prefetched_block *pb = prefetcher->blocks[i];
+		if (pb->done && pb->height >= height &&
+		    tal_count(pb->waiters) == 0)
+			prefetch_forget(pb);
+		else
+			i++;
+	}
+}
+
+static void tip_changed(u32 height, const struct bitcoin_blkid *blkid,
+			const struct bitcoin_blkid *prev)
+{
+	const struct header_entry *parent =
+	    height > 0 ? headers_entry(height - 1) : NULL;
+	const struct header_entry *known = headers_entry(height);
+
+	/* An endpoint a block or two behind the others doesn't make it a
+	 * reorg, a block we didn't know at that height does. */
+	if (tip->known && height <= tip->height) {
+		if (!known || !known->known ||
+		    bitcoin_blkid_eq(&known->blkid, blkid))
+			return;
+		tip_reorg(height);
+	} else if (parent && parent->known &&
+		 !bitcoin_blkid_eq(&parent->blkid, prev))
+		tip_reorg(height - 1);
+	else if (tip->known && height == tip->height + 1 &&
+		 !bitcoin_blkid_eq(&tip->blkid, prev))
+		tip_reorg(tip->height);
+
+	if (height > 0)
+		headers_set(height - 1, prev);
+	headers_set(height, blkid);
+	/* Esplora knows of nothing past it. */
+	headers_lower_ceiling(height + 1);
+	prefetcher->ceiling = height + 1;
+
+	tip->known = true;
+	tip->height = height;
+	tip->blkid = *blkid;
+
+	// fee estimates move with every block
+	cache_forget("/fee-estimates");
+	cache_forget("/blocks/tip/height");
+
+	// lightningd is following the tip: fetch the new block before it
+	// asks for it
+	if (prefetcher->last_height != 0 && prefetcher->last_height < height &&
+	    height - prefetcher->last_height <= esplora->prefetch_depth)
+		prefetch_fill();
+}
+
+static void tip_poll(struct tip_watcher *tip);
+
+static void tip_schedule(struct tip_watcher *tip)
+{
+	tip->timer = plugin_timer(http->plugin,
+				  time_from_sec(esplora->tip_poll), tip_poll,
+				  tip);
+}
+
+static void tip_got_block(const u8 *res, struct tip_watcher *tip)
+{
+	const char *buf = (const char *)res;
+	struct bitcoin_blkid blkid, prev;
+	const jsmntok_t *toks, *prevtok;
+	u32 height;
+
+	tip_schedule(tip);
+	if (!res)
+		return;
+
+	toks = json_parse_simple(tmpctx, buf, tal_count(res));
+	if (!toks ||
+	    json_scan(tmpctx, buf, toks, "{id:%,height:%}",
+		      JSON_SCAN(json_to_blkid, &blkid),
+		      JSON_SCAN(json_to_u32, &height)) ||
+	    !header_check(buf, toks, &blkid)) {
+		plugin_log(http->plugin, LOG_UNUSUAL, "Invalid tip block: %.*s",
+			   (int)tal_count(res), buf);
+		return;
+	}
+
+	/* The genesis block has a null previousblockhash. */
+	prevtok = json_get_member(buf, toks, "previousblockhash");
+	if (height > 0 && (!prevtok || !json_to_blkid(buf, prevtok, &prev))) {
+		plugin_log(http->plugin, LOG_UNUSUAL,
+			   "Invalid tip block: %.*s", (int)tal_count(res), buf);
+		return;
+	}
+
+	tip->updated = time_mono();
+	tip_changed(height, &blkid, &prev);
+}
+
+static void tip_got_hash(const u8 *res, struct tip_watcher *tip)
+{
+	struct bitcoin_blkid blkid;
+	char *hash;
+
+	if (!res || !bitcoin_blkid_from_hex((const char *)res,
+					    tal_count(res), &blkid)) {
+		tip_schedule(tip);
+		return;
+	}
+
+	if (tip->known && bitcoin_blkid_eq(&blkid, &tip->blkid)) {
+		tip->updated = time_mono();
+		tip_schedule(tip);
+		return;
+	}
+
+	/* A new tip: its header tells us its height, and what it builds
+	 * upon. */
+	hash = tal_strndup(tmpctx, (const char *)res, tal_count(res));
+	if (!http_request(tip, HTTP_CHAIN, tal_fmt(tmpctx, "/block/%s", hash),
+			  NULL, tip_got_block, tip))
+		tip_schedule(tip);
+}
+
+static void tip_poll(struct tip_watcher *tip)
+{
+	/* The timer is freed by libplugin once we return. */
+	tip->timer = NULL;
+	if (!http_request(tip, HTTP_CHAIN, "/blocks/tip/hash", NULL,
+			  tip_got_hash, tip))
+		tip_schedule(tip);
+	timer_complete(http->plugin);
+}
+
+/* A header Electrum sent us, e.g. a new tip: {"height":..., "hex":...} */
+static void tip_got_header(const char *buf, const jsmntok_t *tok)
+{
+	const jsmntok_t *hextok = json_get_member(buf, tok, "hex");
+	struct bitcoin_blkid blkid, prev;
+	const u8 *raw = NULL;
+	u32 height;
+
+	if (hextok)
+		raw = json_tok_bin_from_hex(tmpctx, buf, hextok);
+	if (!raw ||
+	    json_scan(tmpctx, buf, tok, "{height:%}",
+		      JSON_SCAN(json_to_u32, &height)) ||
+	    !header_from_raw(raw, tal_count(raw), &blkid, &prev)) {
+		plugin_log(http->plugin, LOG_UNUSUAL,
+			   "Invalid tip header: %.*s", json_tok_full_len(tok),
+			   json_tok_full(buf, tok));
+		return;
+	}
+
+	tip->updated = time_mono();
+	if (tip->known && bitcoin_blkid_eq(&blkid, &tip->blkid))
+		return;
+	tip_changed(height, &blkid, &prev);
+}
+
+/* Unless it `poll`s, it waits for tip_got_header(). */
+static struct tip_watcher *new_tip_watcher(const tal_t *ctx, bool poll)
+{
+	struct tip_watcher *tip = tal(ctx, struct tip_watcher);
+
+	tip->known = false;
+	tip->height = 0;
+	tip->updated = time_mono();
+	tip->timer = NULL;
+	/* Right away. */
+	if (poll)
+		tip->timer = plugin_timer(http->plugin, time_from_msec(0),
+					  tip_poll, tip);
+
+	return tip;
+}
+
+/* Get a raw block given its height.
+ * Calls `getblockhash` then `getblock` to retrieve it from bitcoin_cli.
+ * Will return early with null fields if block isn't known (yet).
+ */
+static struct command_result *
+getrawblockbyheight(struct command *cmd, const char *buf, const jsmntok_t *toks)
+{
+	struct getrawblock_state *st;
+	struct prefetched_block *pb;
+	u32 *height;
+
+	if (!param(cmd, buf, toks, p_req("height", param_number, &height),
+		   NULL))
+		return command_param_failed();
+
+	plugin_log(cmd->plugin, LOG_INFORM, "getrawblockbyheight %d", *height);
+	stats_command(cmd);
+
+	st = tal(cmd, struct getrawblock_state);
+	st->cmd = cmd;
+	st->height = *height;
+	st->response = NULL;
+	st->storing = false;
+	st->req = NULL;
+	st->from_core = true;
+	tal_add_destructor(st, destroy_getrawblock_state);
+
+	// lightningd syncs one block at a time, we may have it already
+	prefetch_seen(st->height);
+	pb = prefetch_find(st->height);
+	if (pb && pb->done) {
+		struct command_result *ret = prefetch_serve(pb, st);
+		/* It's of no use anymore, make room for the next ones. */
+		prefetch_forget(pb);
+		prefetch_fill();
+		return ret;
+	}
+	if (pb) {
+		tal_arr_expand(&pb->waiters, st);
+		return command_still_pending(cmd);
+	}
+
+	return getrawblockbyheight_fetch(st);
+}
+
+static struct command_result *estimatefees_null_response(struct command *cmd)
+{
+	struct json_stream *response = jsonrpc_stream_success(cmd);
+
+	json_add_null(response, "opening");
+	json_add_null(response, "mutual_close");
+	json_add_null(response, "unilateral_close");
+	json_add_null(response, "delayed_to_us");
+	json_add_null(response, "htlc_resolution");
+	json_add_null(response, "penalty");
+	json_add_null(response, "min_acceptable");
+	json_add_null(response, "max_acceptable");
+
+	return command_finished(cmd, response);
+}
+
+// slow, normal, urgent, very_urgent
+static const int estimatefees_targets[] = {144, 5, 3, 2};
+
+/* `feerates` are in sat/vB multiplied by 10**6, one per target. */
+static struct command_result *estimatefees_reply(struct command *cmd,
+						 u64 *feerates)
+{
+	// ... But lightningd wants a sat/kVB feerate, divide by 10**4 !
+	for (size_t i = 0; i < ARRAY_SIZE(estimatefees_targets); i++)
+		feerates[i] /= 10000;
+
+	struct json_stream *response = jsonrpc_stream_success(cmd);
+	json_add_u64(response, "opening", feerates[1]);
+	json_add_u64(response, "mutual_close", feerates[1]);
+	json_add_u64(response, "unilateral_close", feerates[3]);
+	json_add_u64(response, "delayed_to_us", feerates[1]);
+	json_add_u64(response, "htlc_resolution", feerates[2]);
+	json_add_u64(response, "penalty", feerates[2]);
+	/* We divide the slow feerate for the minimum acceptable, lightningd
+	 * will use floor if it's hit, though. */
+	json_add_u64(response, "min_acceptable", feerates[0] / 2);
+	/* BOLT #2:
+	 *
+	 * Given the variance in fees, and the fact that the transaction may be
+	 * spent in the future, it's a good idea for the fee payer to keep a
+	 * good margin (say 5x the expected fee requirement)
+	 *
+	 * 10 is lightningd's default for bitcoind-max-multiplier
+	 */
+	json_add_u64(response, "max_acceptable", feerates[3] * 10);
+
+	return command_finished(cmd, response);
+}
+
+static struct command_result *estimatefees_done(struct command *cmd,
+						const u8 *res, void *unused)
+{
+	char *err;
+	const int *targets = estimatefees_targets;
+	u64 *feerates = tal_arr(cmd, u64, ARRAY_SIZE(estimatefees_targets));
+
+	if (!res) {
+		err = tal_fmt(cmd, "%s: request error on /fee-estimates",
+			      cmd->methodname);
+		plugin_log(cmd->plugin, LOG_UNUSUAL, "err: %s", err);
+		return estimatefees_null_response(cmd);
+	}
+	const char *feerate_res = (const char *)res;
+	// parse feerates output
+	const jsmntok_t *tokens =
+	    json_parse_simple(cmd, feerate_res, tal_count(res));
+	if (!tokens) {
+		err = tal_fmt(cmd, "%s: json error (%.*s)?", cmd->methodname,
+			      (int)tal_count(res), feerate_res);
+		plugin_log(cmd->plugin, LOG_INFORM, "err: %s", err);
+		return estimatefees_null_response(cmd);
+	}
+	for (size_t i = 0; i < tal_count(feerates); i++) {
+		const jsmntok_t *feeratetok = json_get_member(
+		    feerate_res, tokens, tal_fmt(tmpctx, "%d", targets[i]));
+		// This puts a feerate in sat/vB multiplied by 10**7 in
+		// 'feerate'.
+		// Esplora can answer with a empty object like this {}, in this
+		// case we need to return a null response to say that is not
+		// possible to estimate the feerate.
+		if (!feeratetok || !json_to_millionths(feerate_res, feeratetok,
+						       &feerates[i])) {
+			err = tal_fmt(cmd,
+				      "%s: had no feerate for block %d (%.*s)?",
+				      cmd->methodname, targets[i],
+				      (int)tal_count(res), feerate_res);
+			plugin_log(cmd->plugin, LOG_INFORM, "err: %s", err);
+			return estimatefees_null_response(cmd);
+		}
+	}
+
+	return estimatefees_reply(cmd, feerates);
+}
+
+/* Electrum is asked for each target, in a single batch. */
+struct estimatefees_electrum {
+	struct command *cmd;
+	u64 feerates[ARRAY_SIZE(estimatefees_targets)];
+	size_t pending;
+	bool failed;
+};
+
+struct estimatefees_target {
+	struct estimatefees_electrum *st;
+	size_t i;
+};
+
+static void estimatefees_electrum_done(const char *buf,
+				       const jsmntok_t *result,
+				       const jsmntok_t *error UNUSED,
+				       struct estimatefees_target *t)
+{
+	struct estimatefees_electrum *st = t->st;
+	double btc_per_kvb;
+
+	// Electrum answers -1 when it can't estimate it, and in BTC/kvB:
+	// we want sat/vB multiplied by 10**6, as esplora's
+	if (!result || !json_to_double(buf, result, &btc_per_kvb) ||
+	    btc_per_kvb <= 0)
+		st->failed = true;
+	else
+		st->feerates[t->i] = btc_per_kvb * 100000000000.0;
+
+	if (--st->pending != 0)
+		return;
+	if (st->failed) {
+		plugin_log(st->cmd->plugin, LOG_INFORM,
+			   "%s: Electrum had no feerate for every target",
+			   st->cmd->methodname);
+		estimatefees_null_response(st->cmd);
+		return;
+	}
+	estimatefees_reply(st->cmd, st->feerates);
+}
+
+static struct command_result *estimatefees_electrum(struct command *cmd)
+{
+	struct estimatefees_electrum *st =
+	    tal(cmd, struct estimatefees_electrum);
+
+	st->cmd = cmd;
+	st->pending = ARRAY_SIZE(estimatefees_targets);
+	st->failed = false;
+	for (size_t i = 0; i < ARRAY_SIZE(estimatefees_targets); i++) {
+		struct estimatefees_target *t =
+		    tal(st, struct estimatefees_target);
+
+		t->st = st;
+		t->i = i;
+		electrum_call(t, "blockchain.estimatefee",
+			      tal_fmt(tmpctx, "[%d]", estimatefees_targets[i]),
+			      estimatefees_electrum_done, t);
+	}
+	return command_still_pending(cmd);
+}
+
+/* Get current feerate.
+ * Returns the feerate to lightningd as btc/k*VBYTE*.
+ */
+static struct command_result *estimatefees(struct command *cmd,
+					   const char *buf UNUSED,
+					   const jsmntok_t *toks UNUSED)
+{
+	if (!param(cmd, buf, toks, NULL))
+		return command_param_failed();
+
+	stats_command(cmd);
+	if (electrum)
+		return estimatefees_electrum(cmd);
+	// fetch feerates
+	return request_cached(cmd, HTTP_CHAIN, "/fee-estimates",
+			      esplora->fees_ttl, estimatefees_done, NULL);
+}
+
+/* How many transactions do we keep the outputs of. */
+#define TXOUT_CACHE_SIZE 512
+
+struct cached_txout {
+	/* False if we can't read the amount (e.g. it's confidential). */
+	bool has_amount;
+	struct amount_sat amount;
+	const u8 *script;
+};
+
+/* The outputs of a transaction we already fetched: they never change
+ * (not even on reorgs), only whether they are spent does. */
+struct txouts {
+	struct bitcoin_txid txid;
+	struct cached_txout *outs;
+
+	/* In the LRU, most recently used first. */
+	struct list_node list;
+};
+
+static const struct bitcoin_txid *txouts_keyof(const struct txouts *txouts)
+{
+	return &txouts->txid;
+}
+
+static size_t txid_hash(const struct bitcoin_txid *txid)
+{
+	return siphash24(siphash_seed(), txid->shad.sha.u.u8,
+			 sizeof(txid->shad.sha.u.u8));
+}
+
+static bool txouts_eq_txid(const struct txouts *txouts,
+			   const struct bitcoin_txid *txid)
+{
+	return bitcoin_txid_eq(&txouts->txid, txid);
+}
+
+HTABLE_DEFINE_TYPE(struct txouts, txouts_keyof, txid_hash, txouts_eq_txid,
+		   txouts_map);
+
+/* Gossip checks many outputs of the same (funding) transactions. */
+struct txout_cache {
+	struct txouts_map map;
+	struct list_head lru;
+	size_t count;
+};
+
+static struct txout_cache *txout_cache;
+
+static struct txouts *txout_cache_get(const struct bitcoin_txid *txid)
+{
+	struct txouts *txouts = txouts_map_get(&txout_cache->map, txid);
+
+	if (txouts) {
+		list_del(&txouts->list);
+		list_add(&txout_cache->lru, &txouts->list);
+	}
+	return txouts;
+}
+
+/* Keep `txouts`, unless we already have them: returns what we keep. */
+static struct txouts *txout_cache_add(struct txouts *txouts)
+{
+	struct txouts *known = txout_cache_get(&txouts->txid), *oldest;
+
+	if (known) {
+		tal_free(txouts);
+		return known;
+	}
+
+	if (txout_cache->count >= TXOUT_CACHE_SIZE) {
+		oldest = list_tail(&txout_cache->lru, struct txouts, list);
+		list_del(&oldest->list);
+		txouts_map_del(&txout_cache->map, oldest);
+		tal_free(oldest);
+		txout_cache->count--;
+	}
+	tal_steal(txout_cache, txouts);
+	txouts_map_add(&txout_cache->map, txouts);
+	list_add(&txout_cache->lru, &txouts->list);
+	txout_cache->count++;
+	return txouts;
+}
+
+static struct txout_cache *new_txout_cache(const tal_t *ctx)
+{
+	struct txout_cache *cache = tal(ctx, struct txout_cache);
+
+	txouts_map_init(&cache->map);
+	list_head_init(&cache->lru);
+	cache->count = 0;
+
+	return cache;
+}
+
+/* Parse the outputs of the raw transaction `txid`. */
+static struct txouts *txouts_from_raw(const tal_t *ctx,
+				      const struct bitcoin_txid *txid,
+				      const u8 *raw)
+{
+	size_t max = tal_count(raw);
+	struct bitcoin_tx *tx = pull_bitcoin_tx(tmpctx, &raw, &max);
+	struct bitcoin_txid computed;
+	struct txouts *txouts;
+
+	if (!tx || max != 0)
+		return NULL;
+	/* Don't take esplora's word for it. */
+	bitcoin_txid(tx, &computed);
+	if (!bitcoin_txid_eq(&computed, txid))
+		return NULL;
+
+	txouts = tal(ctx, struct txouts);
+	txouts->txid = *txid;
+	txouts->outs =
+	    tal_arr(txouts, struct cached_txout, tx->wtx->num_outputs);
+	for (size_t i = 0; i < tal_count(txouts->outs); i++) {
+		struct amount_asset asset = bitcoin_tx_output_get_amount(tx, i);
+
+		txouts->outs[i].has_amount = amount_asset_is_main(&asset);
+		if (txouts->outs[i].has_amount)
+			txouts->outs[i].amount = amount_asset_to_sat(&asset);
+		txouts->outs[i].script =
+		    bitcoin_tx_output_get_script(txouts->outs, tx, i);
+	}
+	return txouts;
+}
+
+/* Which outputs of a transaction are spent, and what they are (unless we
+ * know already): both are asked for at the same time. */
+struct txout_lookup {
+	struct bitcoin_txid txid;
+	char *txid_hex;
+
+	/* The outputs the caller wants to know about. */
+	u32 *vouts;
+
+	/* The outputs, if we had to fetch them. */
+	struct txouts *fetched;
+	bool *spent;
+
+	size_t pending;
+	bool failed;
+
+	void (*cb)(const struct txouts *txouts, const bool *spent, void *arg);
+	void *arg;
+};
+
+static void txout_lookup_got_raw(const u8 *res, struct txout_lookup *lookup);
+
+static void txout_lookup_got_electrum_raw(const char *buf,
+					  const jsmntok_t *result,
+					  const jsmntok_t *error UNUSED,
+					  struct txout_lookup *lookup)
+{
+	const u8 *raw = NULL;
+
+	if (result)
+		raw = json_tok_bin_from_hex(tmpctx, buf, result);
+	txout_lookup_got_raw(raw, lookup);
+}
+
+static bool txout_lookup_raw(struct txout_lookup *lookup)
+{
+	const char *path = tal_fmt(tmpctx, "/tx/%s/raw", lookup->txid_hex);
+
+	if (electrum) {
+		electrum_call(lookup, "blockchain.transaction.get",
+			      tal_fmt(tmpctx, "[\"%s\"]", lookup->txid_hex),
+			      txout_lookup_got_electrum_raw, lookup);
+	} else if (!http_request(lookup, HTTP_UTXO, path, NULL,
+				 txout_lookup_got_raw, lookup))
+		return false;
+	lookup->pending++;
+	return true;
+}
+
+/* Which of the outputs of a transaction Electrum asked about. */
+struct txout_unspent {
+	struct txout_lookup *lookup;
+	u32 vout;
+};
+
+static void txout_lookup_finish(struct txout_lookup *lookup);
+
+static void txout_lookup_got_unspent(const char *buf, const jsmntok_t *result,
+				     const jsmntok_t *error UNUSED,
+				     struct txout_unspent *u)
+{
+	struct txout_lookup *lookup = u->lookup;
+	const jsmntok_t *t;
+	struct bitcoin_txid txid;
+	u32 pos;
+	size_t i;
+
+	if (!result || result->type != JSMN_ARRAY) {
+		lookup->failed = true;
+		goto done;
+	}
+	json_for_each_arr(i, t, result)
+	{
+		if (json_scan(tmpctx, buf, t, "{tx_hash:%,tx_pos:%}",
+			      JSON_SCAN(json_to_txid, &txid),
+			      JSON_SCAN(json_to_u32, &pos))) {
+			plugin_log(http->plugin, LOG_UNUSUAL,
+				   "Invalid unspent outputs of %s: %.*s",
+				   lookup->txid_hex, json_tok_full_len(result),
+				   json_tok_full(buf, result));
+			lookup->failed = true;
+			goto done;
+		}
+		if (pos == u->vout && bitcoin_txid_eq(&txid, &lookup->txid))
+			lookup->spent[u->vout] = false;
+	}
+
+done:
+	tal_free(u);
+	txout_lookup_finish(lookup);
+}
+
+/* Ask Electrum whether output `vout` is unspent. */
+static void txout_lookup_ask_unspent(struct txout_lookup *lookup,
+				     const struct txouts *txouts, u32 vout)
+{
+	const u8 *script = txouts->outs[vout].script;
+	struct txout_unspent *u;
+	struct sha256 h;
+	char hex[hex_str_size(sizeof(h))];
+
+	/* The script hash, as bitcoin displays them: reversed. */
+	sha256(&h, script, tal_count(script));
+	for (size_t j = 0; j < sizeof(h) / 2; j++) {
+		u8 b = h.u.u8[j];
+		h.u.u8[j] = h.u.u8[sizeof(h) - 1 - j];
+		h.u.u8[sizeof(h) - 1 - j] = b;
+	}
+	hex_encode(&h, sizeof(h), hex, sizeof(hex));
+
+	u = tal(lookup, struct txout_unspent);
+	u->lookup = lookup;
+	u->vout = vout;
+	electrum_call(u, "blockchain.scripthash.listunspent",
+		      tal_fmt(tmpctx, "[\"%s\"]", hex),
+		      txout_lookup_got_unspent, u);
+	lookup->pending++;
+}
+
+/* Electrum has no outspends: it tells which outputs are unspent by their
+ * script, so we ask once we have them, for the outputs we were asked
+ * about only (the others look spent). */
+static void txout_lookup_unspent(struct txout_lookup *lookup,
+				 const struct txouts *txouts)
+{
+	size_t n = tal_count(txouts->outs);
+	bool asked = false;
+
+	lookup->spent = tal_arr(lookup, bool, n);
+	for (size_t i = 0; i < n; i++)
+		lookup->spent[i] = true;
+	for (size_t i = 0; i < tal_count(lookup->vouts); i++) {
+		u32 vout = lookup->vouts[i];
+		bool dup = false;
+
+		for (size_t j = 0; j < i; j++)
+			dup |= lookup->vouts[j] == vout;
+		if (vout >= n || dup)
+			continue;
+		txout_lookup_ask_unspent(lookup, txouts, vout);
+		asked = true;
+	}
+	/* None of them exists: we still answer once Electrum does. */
+	if (!asked && n != 0)
+		txout_lookup_ask_unspent(lookup, txouts, 0);
+}
+
+static void txout_lookup_finish(struct txout_lookup *lookup)
+{
+	const struct txouts *txouts = NULL;
+
+	if (--lookup->pending != 0)
+		return;
+
+	if (!lookup->failed) {
+		if (lookup->fetched) {
+			txouts = txout_cache_add(lookup->fetched);
+			lookup->fetched = NULL;
+		} else
+			txouts = txout_cache_get(&lookup->txid);
+		/* We had them, but they got evicted meanwhile. */
+		if (!txouts && txout_lookup_raw(lookup))
+			return;
+		if (txouts && !lookup->spent && electrum) {
+			txout_lookup_unspent(lookup, txouts);
+			if (lookup->pending != 0)
+				return;
+		}
+		if (!txouts ||
+		    tal_count(lookup->spent) != tal_count(txouts->outs))
+			lookup->failed = true;
+	}
+
+	/* The callback may free our parent. */
+	tal_steal(tmpctx, lookup);
+	lookup->cb(lookup->failed ? NULL : txouts, lookup->spent, lookup->arg);
+}
+
+static void txout_lookup_got_raw(const u8 *res, struct txout_lookup *lookup)
+{
+	if (res)
+		lookup->fetched = txouts_from_raw(lookup, &lookup->txid, res);
+	if (!lookup->fetched) {
+		if (res)
+			plugin_log(http->plugin, LOG_UNUSUAL,
+				   "Invalid transaction from /tx/%s/raw",
+				   lookup->txid_hex);
+		lookup->failed = true;
+	}
+	txout_lookup_finish(lookup);
+}
+
+static void txout_lookup_got_outspends(const u8 *res,
+				       struct txout_lookup *lookup)
+{
+	const char *buf = (const char *)res;
+	const jsmntok_t *toks, *t, *spenttok;
+	size_t i;
+
+	if (!res) {
+		lookup->failed = true;
+		goto done;
+	}
+
+	toks = json_parse_simple(tmpctx, buf, tal_count(res));
+	if (!toks || toks->type != JSMN_ARRAY)
+		goto invalid;
+	lookup->spent = tal_arr(lookup, bool, toks->size);
+	json_for_each_arr(i, t, toks)
+	{
+		spenttok = json_get_member(buf, t, "spent");
+		if (!spenttok ||
+		    !json_to_bool(buf, spenttok, &lookup->spent[i]))
+			goto invalid;
+	}
+	goto done;
+
+invalid:
+	plugin_log(http->plugin, LOG_UNUSUAL,
+		   "Invalid outspends from /tx/%s/outspends: %.*s",
+		   lookup->txid_hex, (int)tal_count(res),
+		   buf);
+	lookup->failed = true;
+done:
+	txout_lookup_finish(lookup);
+}
+
+/* Get the outputs of `txid` and whether they are spent: `cb` gets NULL
+ * outputs if we could not. Only the `num_vouts` outputs in `vouts` are
+ * sure to be right about being spent. Freeing `ctx` cancels it. Returns
+ * false (and never calls `cb`) if we could not even ask. */
+static bool txout_lookup_(const tal_t *ctx, const struct bitcoin_txid *txid,
+			  const u32 *vouts, size_t num_vouts,
+			  void (*cb)(const struct txouts *txouts,
+				     const bool *spent, void *arg),
+			  void *arg)
+{
+	struct txout_lookup *lookup = tal(ctx, struct txout_lookup);
+	bool cached;
+
+	lookup->txid = *txid;
+	lookup->txid_hex = tal_arr(lookup, char, hex_str_size(sizeof(*txid)));
+	bitcoin_txid_to_hex(txid, lookup->txid_hex,
+			    tal_count(lookup->txid_hex));
+	lookup->vouts = tal_dup_arr(lookup, u32, vouts, num_vouts, 0);
+	lookup->fetched = NULL;
+	lookup->spent = NULL;
+	lookup->pending = 0;
+	lookup->failed = false;
+	lookup->cb = cb;
+	lookup->arg = arg;
+
+	cached = txouts_map_get(&txout_cache->map, txid) != NULL;
+	stats_cache("/tx/:hash/raw", cached);
+	if (!cached && !txout_lookup_raw(lookup))
+		goto fail;
+	if (electrum) {
+		if (cached)
+			txout_lookup_unspent(lookup, txout_cache_get(txid));
+		/* No output, no transaction. */
+		if (lookup->pending == 0)
+			goto fail;
+		return true;
+	}
+	if (!http_request(lookup, HTTP_UTXO,
+			  tal_fmt(tmpctx, "/tx/%s/outspends", lookup->txid_hex),
+			  NULL, txout_lookup_got_outspends, lookup))
+		goto fail;
+	lookup->pending++;
+	return true;
+
+fail:
+	tal_free(lookup);
+	return false;
+}
+
+#define txout_lookup(ctx, txid, vouts, num_vouts, cb, arg)                     \
+	txout_lookup_((ctx), (txid), (vouts), (num_vouts),                     \
+		      typesafe_cb_preargs(void, void *, (cb), (arg),           \
+					  const struct txouts *,               \
+					  const bool *),                       \
+		      (arg))
+
+/* bitcoind answers at most this many outpoints per /rest/getutxos. */
+#define CORE_GETUTXOS_MAX 15
+
+/* Ask for `txid`:`vout` too in `path`, a /rest/getutxos one. */
+static void core_getutxos_add(char **path, const struct bitcoin_txid *txid,
+			      u32 vout)
+{
+	char hex[hex_str_size(sizeof(*txid))];
+
+	bitcoin_txid_to_hex(txid, hex, sizeof(hex));
+	tal_append_fmt(path, "/%s-%u", hex, vout);
+}
+
+/* What bitcoind answered about the `n` outputs we asked it for: its
+ * height and tip, a bitmap of those it has unspent (mempool included)
+ * and each of those as a coin (version, height and output). They are
+ * in order, NULL if spent, or we return NULL if it makes no sense. */
+static struct cached_txout **core_getutxos_parse(const tal_t *ctx,
+						 const u8 *res, size_t n)
+{
+	const u8 *cursor = res;
+	size_t max = tal_count(res), hits = 0;
+	struct cached_txout **outs = tal_arrz(ctx, struct cached_txout *, n);
+	u8 bitmap[(CORE_GETUTXOS_MAX + 7) / 8];
+	struct bitcoin_blkid tip;
+
+	pull_le32(&cursor, &max);
+	pull(&cursor, &max, &tip, sizeof(tip));
+	if (n > CORE_GETUTXOS_MAX || pull_varint(&cursor, &max) != (n + 7) / 8)
+		return tal_free(outs);
+	pull(&cursor, &max, bitmap, (n + 7) / 8);
+	for (size_t i = 0; i < n; i++) {
+		if (bitmap[i / 8] & (1 << (i % 8)))
+			hits++;
+	}
+	if (pull_varint(&cursor, &max) != hits)
+		return tal_free(outs);
+
+	for (size_t i = 0; i < n && cursor; i++) {
+		struct cached_txout *out;
+		u64 script_len;
+		u8 *script;
+
+		if (!(bitmap[i / 8] & (1 << (i % 8))))
+			continue;
+		out = tal(outs, struct cached_txout);
+		/* A dummy version, and the height it was mined at. */
+		pull_le32(&cursor, &max);
+		pull_le32(&cursor, &max);
+		out->has_amount = true;
+		out->amount = amount_sat(pull_le64(&cursor, &max));
+		script_len = pull_varint(&cursor, &max);
+		if (script_len > max)
+			return tal_free(outs);
+		script = tal_arr(out, u8, script_len);
+		pull(&cursor, &max, script, script_len);
+		out->script = script;
+		outs[i] = out;
+	}
+	if (!cursor)
+		return tal_free(outs);
+	return outs;
+}
+
+struct getutxout_state {
+	struct command *cmd;
+	const char *txid;
+	struct bitcoin_txid id;
+	u32 vout;
+};
+
+/* The amount and script of an unspent output, nulls if it's spent. */
+static void json_add_txout(struct json_stream *response,
+			   const struct cached_txout *out)
+{
+	if (!out) {
+		json_add_null(response, "amount");
+		json_add_null(response, "script");
+		return;
+	}
+	json_add_amount_sat_only(response, "amount", out->amount);
+	json_add_hexbin(response, "script", out->script,
+			tal_count(out->script));
+}
+
+static void getutxout_done(const struct txouts *txouts, const bool *spent,
+			   struct getutxout_state *st)
+{
+	struct command *cmd = st->cmd;
+	struct json_stream *response;
+	const struct cached_txout *out;
+
+	if (!txouts) {
+		request_error(cmd, tal_fmt(tmpctx, "/tx/%s", st->txid));
+		return;
+	}
+
+	/* As of at least v0.15.1.0, bitcoind returns "success" but an empty
+	   string on a spent txout. */
+	if (st->vout >= tal_count(txouts->outs) || spent[st->vout]) {
+		response = jsonrpc_stream_success(cmd);
+		json_add_txout(response, NULL);
+		command_finished(cmd, response);
+		return;
+	}
+
+	out = &txouts->outs[st->vout];
+	if (!out->has_amount) {
+		char *err = tal_fmt(cmd, "%s: no explicit amount for %s:%u",
+				    cmd->methodname, st->txid, st->vout);
+		command_done_err(cmd, BCLI_ERROR, err, NULL);
+		return;
+	}
+
+	// replay response
+	response = jsonrpc_stream_success(cmd);
+	json_add_txout(response, out);
+	command_finished(cmd, response);
+}
+
+static struct command_result *getutxout_lookup(struct getutxout_state *st)
+{
+	// fetch the outputs (unless we have them) and their spent status
+	if (!txout_lookup(st, &st->id, &st->vout, 1, getutxout_done, st))
+		return request_error(st->cmd,
+				     tal_fmt(tmpctx, "/tx/%s", st->txid));
+	return command_still_pending(st->cmd);
+}
+
+/* bitcoind tells us both at once, esplora if it can't. */
+static void getutxout_core_done(const u8 *res, long status,
+				struct getutxout_state *st)
+{
+	struct cached_txout **outs = NULL;
+	struct json_stream *response;
+
+	if (res && status == 200)
+		outs = core_getutxos_parse(tmpctx, res, 1);
+	if (!outs) {
+		getutxout_lookup(st);
+		return;
+	}
+
+	response = jsonrpc_stream_success(st->cmd);
+	json_add_txout(response, outs[0]);
+	command_finished(st->cmd, response);
+}
+
+static struct command_result *getutxout(struct command *cmd, const char *buf,
+					const jsmntok_t *toks)
+{
+	char *path;
+	const char *txid, *vout;
+	struct getutxout_state *st;
+
+	plugin_log(cmd->plugin, LOG_INFORM, "getutxout");
+
+	/* bitcoin-cli wants strings. */
+	if (!param(cmd, buf, toks, p_req("txid", param_string, &txid),
+		   p_req("vout", param_string, &vout), NULL))
+		return command_param_failed();
+
+	stats_command(cmd);
+	// convert vout to number
+	const char *error;
+	st = tal(cmd, struct getutxout_state);
+	st->cmd = cmd;
+	st->txid = txid;
+	if (!get_u32_from_string(cmd, &st->vout, vout, &error)) {
+		const char *err =
+		    tal_fmt(cmd, "Conversion error occurred on %s (error: %s)",
+			    vout, error);
+		return command_done_err(cmd, BCLI_ERROR, err, NULL);
+	}
+	if (!bitcoin_txid_from_hex(txid, strlen(txid), &st->id)) {
+		const char *err = tal_fmt(cmd, "Invalid txid %s", txid);
+		return command_done_err(cmd, BCLI_ERROR, err, NULL);
+	}
+
+	if (core_usable()) {
+		path = tal_strdup(tmpctx, "/rest/getutxos/checkmempool");
+		core_getutxos_add(&path, &st->id, st->vout);
+		tal_append_fmt(&path, ".bin");
+		if (http_request_to(st, HTTP_UTXO, http->core, path, NULL,
+				    getutxout_core_done, st))
+			return command_still_pending(cmd);
+	}
+	return getutxout_lookup(st);
+}
+
+/* How many transactions does getutxouts look up at the same time. */
+#define GETUTXOUTS_PARALLEL 4
+
+struct getutxouts_outpoint {
+	struct bitcoin_txid txid;
+	u32 vout;
+	/* Where it is in the request. */
+	size_t idx;
+};
+
+struct getutxouts_state {
+	struct command *cmd;
+
+	/* Sorted by txid, so that each transaction is looked up once. */
+	struct getutxouts_outpoint *outpoints;
+	size_t next, num_inflight;
+
+	/* In request order, NULL for spent (or non-existent) outputs. */
+	struct cached_txout **outputs;
+
+	/* Did our bitcoind fail to tell us about some of them ? */
+	bool core_failed;
+};
+
+/* The outpoints [start, end) all spend the same transaction. */
+struct getutxouts_group {
+	struct getutxouts_state *st;
+	size_t start, end;
+};
+
+static int getutxouts_outpoint_cmp(const void *a, const void *b)
+{
+	const struct getutxouts_outpoint *opa = a, *opb = b;
+
+	return memcmp(&opa->txid, &opb->txid, sizeof(opa->txid));
+}
+
+static struct command_result *getutxouts_reply(struct getutxouts_state *st)
+{
+	struct timemono start = trace_now();
+	struct json_stream *response = jsonrpc_stream_success(st->cmd);
+
+	json_array_start(response, "outputs");
+	for (size_t i = 0; i < tal_count(st->outputs); i++) {
+		json_object_start(response, NULL);
+		json_add_txout(response, st->outputs[i]);
+		json_object_end(response);
+	}
+	json_array_end(response);
+	if (tracer)
+		trace_span(trace_track(st->cmd), "json", "json", start, NULL);
+
+	return command_finished(st->cmd, response);
+}
+
+static void getutxouts_got(const struct txouts *txouts, const bool *spent,
+			   struct getutxouts_group *g);
+
+/* Look up the next transactions, as long as we don't have too many
+ * lookups in flight. */
+static struct command_result *getutxouts_next(struct getutxouts_state *st)
+{
+	size_t n = tal_count(st->outpoints);
+	struct getutxouts_group *g;
+	char txid[hex_str_size(sizeof(struct bitcoin_txid))];
+	u32 *vouts;
+
+	while (st->next < n && st->num_inflight < GETUTXOUTS_PARALLEL) {
+		g = tal(st, struct getutxouts_group);
+		g->st = st;
+		g->start = st->next;
+		g->end = g->start + 1;
+		while (g->end < n &&
+		       bitcoin_txid_eq(&st->outpoints[g->end].txid,
+				       &st->outpoints[g->start].txid))
+			g->end++;
+		st->next = g->end;
+
+		vouts = tal_arr(tmpctx, u32, g->end - g->start);
+		for (size_t i = g->start; i < g->end; i++)
+			vouts[i - g->start] = st->outpoints[i].vout;
+		if (!txout_lookup(g, &st->outpoints[g->start].txid, vouts,
+				  tal_count(vouts), getutxouts_got, g)) {
+			bitcoin_txid_to_hex(&st->outpoints[g->start].txid, txid,
+					    sizeof(txid));
+			return request_error(st->cmd,
+					     tal_fmt(tmpctx, "/tx/%s", txid));
+		}
+		st->num_inflight++;
+	}
+
+	if (st->num_inflight == 0)
+		return getutxouts_reply(st);
+	return command_still_pending(st->cmd);
+}
+
+static void getutxouts_got(const struct txouts *txouts, const bool *spent,
+			   struct getutxouts_group *g)
+{
+	struct getutxouts_state *st = g->st;
+	char txid[hex_str_size(sizeof(struct bitcoin_txid))];
+
+	st->num_inflight--;
+	if (!txouts) {
+		bitcoin_txid_to_hex(&st->outpoints[g->start].txid, txid,
+				    sizeof(txid));
+		request_error(st->cmd, tal_fmt(tmpctx, "/tx/%s", txid));
+		return;
+	}
+
+	for (size_t i = g->start; i < g->end; i++) {
+		const struct getutxouts_outpoint *op = &st->outpoints[i];
+		struct cached_txout *out;
+
+		if (op->vout >= tal_count(txouts->outs) || spent[op->vout])
+			continue;
+		if (!txouts->outs[op->vout].has_amount) {
+			bitcoin_txid_to_hex(&op->txid, txid, sizeof(txid));
+			char *err =
+			    tal_fmt(st->cmd, "%s: no explicit amount for %s:%u",
+				    st->cmd->methodname, txid, op->vout);
+			command_done_err(st->cmd, BCLI_ERROR, err, NULL);
+			return;
+		}
+		/* The cache may well evict them before we're done. */
+		out = tal_dup(st->outputs, struct cached_txout,
+			      &txouts->outs[op->vout]);
+		if (out->script)
+			out->script = tal_dup_talarr(out, u8, out->script);
+		st->outputs[op->idx] = out;
+	}
+	tal_free(g);
+
+	getutxouts_next(st);
+}
+
+/* Once bitcoind told us about all of them, unless it couldn't: esplora
+ * then does it all over again. */
+static void getutxouts_core_got(const u8 *res, long status,
+				struct getutxouts_group *g)
+{
+	struct getutxouts_state *st = g->st;
+	struct cached_txout **outs = NULL;
+
+	st->num_inflight--;
+	if (res && status == 200)
+		outs = core_getutxos_parse(tmpctx, res, g->end - g->start);
+	if (!outs)
+		st->core_failed = true;
+	for (size_t i = g->start; outs && i < g->end; i++)
+		st->outputs[st->outpoints[i].idx] =
+		    tal_steal(st->outputs, outs[i - g->start]);
+	tal_free(g);
+	if (st->num_inflight != 0)
+		return;
+
+	if (st->core_failed) {
+		for (size_t i = 0; i < tal_count(st->outputs); i++)
+			st->outputs[i] = tal_free(st->outputs[i]);
+		st->next = 0;
+	}
+	getutxouts_next(st);
+}
+
+/* Ask bitcoind about CORE_GETUTXOS_MAX outpoints at a time. */
+static struct command_result *getutxouts_core(struct getutxouts_state *st)
+{
+	size_t n = tal_count(st->outpoints);
+	struct getutxouts_group *g;
+	char *path;
+
+	st->next = n;
+	for (size_t start = 0; start < n; start += CORE_GETUTXOS_MAX) {
+		g = tal(st, struct getutxouts_group);
+		g->st = st;
+		g->start = start;
+		g->end = start + CORE_GETUTXOS_MAX;
+		if (g->end > n)
+			g->end = n;
+		path = tal_strdup(tmpctx, "/rest/getutxos/checkmempool");
+		for (size_t i = g->start; i < g->end; i++)
+			core_getutxos_add(&path, &st->outpoints[i].txid,
+					  st->outpoints[i].vout);
+		tal_append_fmt(&path, ".bin");
+		if (!http_request_to(g, HTTP_UTXO, http->core, path, NULL,
+				     getutxouts_core_got, g)) {
+			tal_free(g);
+			st->core_failed = true;
+			continue;
+		}
+		st->num_inflight++;
+	}
+
+	if (st->num_inflight == 0)
+		st->next = 0;
+	return getutxouts_next(st);
+}
+
+/* Same as getutxout, for a list of {txid, vout} `outpoints`: answered in
+ * the same order, each transaction being looked up once. */
+static struct command_result *getutxouts(struct command *cmd, const char *buf,
+					 const jsmntok_t *toks)
+{
+	const jsmntok_t *outpoints, *t;
+	struct getutxouts_state *st;
+	size_t i;
+
+	if (!param(cmd, buf, toks, p_req("outpoints", param_array, &outpoints),
+		   NULL))
+		return command_param_failed();
+
+	plugin_log(cmd->plugin, LOG_INFORM, "getutxouts (%d outpoints)",
+		   outpoints->size);
+	stats_command(cmd);
+
+	st = tal(cmd, struct getutxouts_state);
+	st->cmd = cmd;
+	st->outpoints =
+	    tal_arr(st, struct getutxouts_outpoint, outpoints->size);
+	st->outputs = tal_arrz(st, struct cached_txout *, outpoints->size);
+	st->next = 0;
+	st->num_inflight = 0;
+	st->core_failed = false;
+	json_for_each_arr(i, t, outpoints)
+	{
+		if (json_scan(tmpctx, buf, t, "{txid:%,vout:%}",
+			      JSON_SCAN(json_to_txid, &st->outpoints[i].txid),
+			      JSON_SCAN(json_to_u32, &st->outpoints[i].vout)))
+			return command_fail_badparam(
+			    cmd, "outpoints", buf, t,
+			    "should be an object with a txid and a vout");
+		st->outpoints[i].idx = i;
+	}
+	qsort(st->outpoints, tal_count(st->outpoints),
+	      sizeof(*st->outpoints), getutxouts_outpoint_cmp);
+
+	if (core_usable() && tal_count(st->outpoints) != 0)
+		return getutxouts_core(st);
+	return getutxouts_next(st);
+}
+
+/* How long we keep rebroadcasting a transaction that doesn't confirm. */
+#define REBROADCAST_MAX_AGE (14 * 24 * 3600)
+
+/* A transaction we keep broadcasting until it confirms. */
+struct queued_tx {
+	struct list_node list;
+	struct bitcoin_txid txid;
+	const char *hex;
+
+	/* When we first sent it (seconds since the epoch). */
+	u64 added;
+
+	/* Non-NULL while we check whether it confirmed. */
+	struct http_request *req;
+};
+
+/* The transactions we sent, saved to a file so that we keep
+ * rebroadcasting them across restarts. */
+struct rebroadcaster {
+	const char *path;
+	struct list_head txs;
+	struct plugin_timer *timer;
+};
+
+static struct rebroadcaster *rebroadcaster;
+
+/* A transaction we send to all our endpoints at once. */
+struct broadcast {
+	/* The command waiting for an endpoint to accept it, NULL once
+	 * answered (or for a rebroadcast). */
+	struct command *cmd;
+	const char *hex;
+
+	/* How many endpoints didn't answer yet, and did any accept it ? */
+	size_t pending;
+	bool accepted;
+
+	/* What the first endpoint refusing it said, if anything. */
+	const char *errmsg;
+};
+
+static void destroy_queued_tx(struct queued_tx *qtx)
+{
+	list_del(&qtx->list);
+}
+
+/* Add `hex` to the queue unless it's there already: false if it's not a
+ * transaction. */
+static bool rebroadcast_queue(struct rebroadcaster *rb, const char *hex,
+			      u64 added)
+{
+	struct bitcoin_tx *tx = bitcoin_tx_from_hex(tmpctx, hex, strlen(hex));
+	struct bitcoin_txid txid;
+	struct queued_tx *qtx;
+
+	if (!tx)
+		return false;
+	bitcoin_txid(tx, &txid);
+	list_for_each(&rb->txs, qtx, list)
+	{
+		if (bitcoin_txid_eq(&qtx->txid, &txid))
+			return true;
+	}
+
+	qtx = tal(rb, struct queued_tx);
+	qtx->txid = txid;
+	qtx->hex = tal_strdup(qtx, hex);
+	qtx->added = added;
+	qtx->req = NULL;
+	list_add_tail(&rb->txs, &qtx->list);
+	tal_add_destructor(qtx, destroy_queued_tx);
+	return true;
+}
+
+/* Replace `path` with the `len` bytes at `data`, all of them or none
+ * even if we crash meanwhile. Returns false (and logs why) if we could
+ * not. */
+static bool write_file_atomic(const char *path, const void *data, size_t len)
+{
+	const char *tmp = tal_fmt(tmpctx, "%s.new", path);
+	bool ok;
+	int fd, err;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	ok = fd >= 0 && write_all(fd, data, len) && fsync(fd) == 0;
+	err = errno;
+	if (fd >= 0)
+		close(fd);
+	if (ok && rename(tmp, path) != 0) {
+		ok = false;
+		err = errno;
+	}
+	if (!ok)
+		plugin_log(http->plugin, LOG_UNUSUAL, "Could not save %s: %s",
+			   path, strerror(err));
+	return ok;
+}
+
+/* One "<added> <hex>" line per transaction. */
+static void rebroadcast_save(struct rebroadcaster *rb)
+{
+	char *contents = tal_strdup(tmpctx, "");
+	struct queued_tx *qtx;
+
+	list_for_each(&rb->txs, qtx, list)
+		tal_append_fmt(&contents, "%" PRIu64 " %s\n", qtx->added,
+			       qtx->hex);
+	write_file_atomic(rb->path, contents, strlen(contents));
+}
+
+static void broadcast_done(const u8 *res, long status, struct broadcast *b);
+
+/* What Electrum answered, as an endpoint would have. */
+static void broadcast_electrum_done(const char *buf, const jsmntok_t *result,
+				    const jsmntok_t *error,
+				    struct broadcast *b)
+{
+	const jsmntok_t *msgtok;
+
+	if (result) {
+		broadcast_done(NULL, 200, b);
+		return;
+	}
+	if (!error) {
+		broadcast_done(NULL, 0, b);
+		return;
+	}
+	msgtok = json_get_member(buf, error, "message");
+	if (!msgtok)
+		msgtok = error;
+	broadcast_done(tal_dup_arr(tmpctx, u8, (const u8 *)buf + msgtok->start,
+				   msgtok->end - msgtok->start, 0),
+		       400, b);
+}
+
+/* Send `hex` to all our endpoints (and our Electrum server, if any), on
+ * behalf of `cmd` if not NULL.
+ * Returns NULL if we could not even try. */
+static struct broadcast *broadcast_start(struct command *cmd,
+					 enum http_prio prio, const char *hex)
+{
+	struct broadcast *b = tal(http, struct broadcast);
+
+	b->cmd = cmd;
+	b->hex = tal_strdup(b, hex);
+	b->pending = 0;
+	b->accepted = false;
+	b->errmsg = NULL;
+	for (size_t i = 0; i < tal_count(http->endpoints); i++) {
+		if (http_request_to(b, prio, &http->endpoints[i], "/tx", b->hex,
+				    broadcast_done, b))
+			b->pending++;
+	}
+	if (electrum) {
+		electrum_call(b, "blockchain.transaction.broadcast",
+			      tal_fmt(tmpctx, "[\"%s\"]", b->hex),
+			      broadcast_electrum_done, b);
+		b->pending++;
+	}
+
+	if (b->pending == 0)
+		return tal_free(b);
+	return b;
+}
+
+static struct command_result *sendrawtransaction_reply(struct command *cmd,
+						       bool success,
+						       const char *errmsg)
+{
+	struct json_stream *response = jsonrpc_stream_success(cmd);
+
+	json_add_bool(response, "success", success);
+	json_add_string(response, "errmsg", errmsg);
+	return command_finished(cmd, response);
+}
+
+static void broadcast_done(const u8 *res, long status, struct broadcast *b)
+{
+	b->pending--;
+	if (status == 200) {
+		// keep it around until it confirms, before telling anyone
+		if (!b->accepted && b->cmd && rebroadcaster &&
+		    rebroadcast_queue(rebroadcaster, b->hex,
+				      time_now().ts.tv_sec))
+			rebroadcast_save(rebroadcaster);
+		b->accepted = true;
+		if (b->cmd)
+			sendrawtransaction_reply(b->cmd, true, "");
+		b->cmd = NULL;
+	} else if (res && !b->errmsg)
+		b->errmsg = tal_strndup(b, (const char *)res, tal_count(res));
+
+	if (b->pending > 0)
+		return;
+	if (b->cmd) {
+		if (!b->errmsg)
+			b->errmsg = tal_fmt(b, "%s: request error on /tx",
+					    b->cmd->methodname);
+		sendrawtransaction_reply(b->cmd, false, b->errmsg);
+	}
+	tal_free(b);
+}
+
+static void rebroadcast_got_status(const u8 *res, struct queued_tx *qtx)
+{
+	char txid[hex_str_size(sizeof(struct bitcoin_txid))];
+	const jsmntok_t *toks;
+	bool confirmed = false;
+
+	qtx->req = NULL;
+	if (res) {
+		toks = json_parse_simple(tmpctx, (const char *)res,
+					 tal_count(res));
+		if (!toks ||
+		    json_scan(tmpctx, (const char *)res, toks, "{confirmed:%}",
+			      JSON_SCAN(json_to_bool, &confirmed)))
+			confirmed = false;
+	}
+
+	bitcoin_txid_to_hex(&qtx->txid, txid, sizeof(txid));
+	if (confirmed) {
+		plugin_log(http->plugin, LOG_INFORM,
+			   "%s confirmed, not rebroadcasting it anymore", txid);
+		tal_free(qtx);
+		rebroadcast_save(rebroadcaster);
+		return;
+	}
+	if (time_now().ts.tv_sec > qtx->added + REBROADCAST_MAX_AGE) {
+		plugin_log(http->plugin, LOG_UNUSUAL,
+			   "%s didn't confirm in %u days, giving up on it",
+			   txid, REBROADCAST_MAX_AGE / (24 * 3600));
+		tal_free(qtx);
+		rebroadcast_save(rebroadcaster);
+		return;
+	}
+
+	// unknown, or still in the mempool: make sure it stays there
+	plugin_log(http->plugin, LOG_DBG, "rebroadcasting %s", txid);
+	broadcast_start(NULL, HTTP_BACKGROUND, qtx->hex);
+}
+
+static void rebroadcast_schedule(struct rebroadcaster *rb);
+
+static void rebroadcast_round(struct rebroadcaster *rb)
+{
+	char txid[hex_str_size(sizeof(struct bitcoin_txid))];
+	struct queued_tx *qtx;
+
+	/* The timer is freed by libplugin once we return. */
+	rb->timer = NULL;
+	list_for_each(&rb->txs, qtx, list)
+	{
+		if (qtx->req)
+			continue;
+		bitcoin_txid_to_hex(&qtx->txid, txid, sizeof(txid));
+		qtx->req = http_request(qtx, HTTP_BACKGROUND,
+					tal_fmt(tmpctx, "/tx/%s/status", txid),
+					NULL, rebroadcast_got_status, qtx);
+	}
+	rebroadcast_schedule(rb);
+	timer_complete(http->plugin);
+}
+
+static void rebroadcast_schedule(struct rebroadcaster *rb)
+{
+	rb->timer = plugin_timer(http->plugin,
+				 time_from_sec(esplora->rebroadcast),
+				 rebroadcast_round, rb);
+}
+
+/* Pick up the transactions we were rebroadcasting before a restart. */
+static struct rebroadcaster *new_rebroadcaster(const tal_t *ctx,
+					       const char *path)
+{
+	struct rebroadcaster *rb = tal(ctx, struct rebroadcaster);
+	char *contents = grab_file(tmpctx, path);
+	char **lines;
+
+	rb->path = tal_strdup(rb, path);
+	list_head_init(&rb->txs);
+	if (contents) {
+		lines = tal_strsplit(tmpctx, contents, "\n", STR_NO_EMPTY);
+		for (size_t i = 0; lines[i]; i++) {
+			char *end;
+			u64 added = strtoull(lines[i], &end, 10);
+
+			if (*end != ' ' ||
+			    !rebroadcast_queue(rb, end + 1, added))
+				plugin_log(http->plugin, LOG_UNUSUAL,
+					   "Ignoring line %zu of %s", i + 1,
+					   path);
+		}
+	}
+	rebroadcast_schedule(rb);
+	return rb;
+}
+
+/* Send a transaction to the Bitcoin network.
+ * Calls `sendrawtransaction` using the first parameter as the raw tx.
+ */
+static struct command_result *
+sendrawtransaction(struct command *cmd, const char *buf, const jsmntok_t *toks)
+{
+	const char *tx;
+	// FIXME(vincenzopalazzo) This propriety is added in the version 0.9.1
+	// We can try to give a meaning to it. For the moment
+	// it is only a fix to work around the param method error
+	bool *allowhighfees;
+	/* bitcoin-cli wants strings. */
+	if (!param(
+		cmd, buf, toks, p_req("tx", param_string, &tx),
+		p_opt_def("allowhighfees", param_bool, &allowhighfees, false),
+		NULL))
+		return command_param_failed();
+
+	plugin_log(cmd->plugin, LOG_INFORM, "sendrawtransaction");
+	stats_command(cmd);
+
+	// send it everywhere, the first endpoint to accept it answers
+	if (!broadcast_start(cmd, HTTP_BROADCAST, tx)) {
+		const char *err = tal_fmt(cmd, "%s: no endpoint to send it to",
+					  cmd->methodname);
+		return sendrawtransaction_reply(cmd, false, err);
+	}
+	return command_still_pending(cmd);
 }
 
-/* Get infos about the block chain.
- * Calls `getblockchaininfo` and returns headers count, blocks count,
- * the chain id, and whether this is initialblockdownload.
- */
-static struct command_result *getchaininfo(struct command *cmd,
+static struct command_result *esplorastats(struct command *cmd,
 					   const char *buf UNUSED,
 					   const jsmntok_t *toks UNUSED)
 {
-	char *err;
+	struct json_stream *response;
 
 	if (!param(cmd, buf, toks, NULL))
 		return command_param_failed();
 
-	plugin_log(cmd->plugin, LOG_INFORM, "getchaininfo");
+	response = jsonrpc_stream_success(cmd);
+	json_add_stats_set(response);
+	return command_finished(cmd, response);
+}
 
-	// fetch block genesis hash
-	const char *block_genesis_url =
-	    tal_fmt(cmd->plugin, "%s/block-height/0", esplora->endpoint);
-	const char *block_genesis = request_get(cmd, block_genesis_url);
-	if (!block_genesis) {
-		err = tal_fmt(cmd, "%s: request error on %s", cmd->methodname,
-			      block_genesis_url);
-		return command_done_err(cmd, BCLI_ERROR, err, NULL);
-	}
-	plugin_log(cmd->plugin, LOG_INFORM, "block_genesis: %s", block_genesis);
+/* Write what `esplora-stats` would answer to `esplora->stats_file`. */
+static void stats_dump(struct stats_set *set)
+{
+	struct json_stream *js = new_json_stream(tmpctx, NULL, NULL);
+	const char *contents;
+	size_t len;
 
-	// fetch block count
-	const char *blockcount_url =
-	    tal_fmt(cmd->plugin, "%s/blocks/tip/height", esplora->endpoint);
-	const char *blockcount = request_get(cmd, blockcount_url);
-	if (!blockcount) {
-		err = tal_fmt(cmd, "%s: request error on %s", cmd->methodname,
-			      blockcount_url);
-		return command_done_err(cmd, BCLI_ERROR, err, NULL);
-	}
-	plugin_log(cmd->plugin, LOG_INFORM, "blockcount: %s", blockcount);
+	json_object_start(js, NULL);
+	json_add_stats_set(js);
+	json_object_end(js);
+	contents = json_stream_contents(js, &len);
+	write_file_atomic(esplora->stats_file, contents, len);
 
-	const char *error;
-	u32 height;
-	if (!get_u32_from_string(NULL, &height, blockcount, &error)) {
-		err = tal_fmt(cmd,
-			      "%s: invalid height conversion on %s (error: %s)",
-			      cmd->methodname, blockcount, error);
-		return command_done_err(cmd, BCLI_ERROR, err, NULL);
-	}
+	plugin_timer(http->plugin, time_from_sec(STATS_DUMP_SEC), stats_dump,
+		     set);
+	timer_complete(http->plugin);
+}
 
-	// parsing blockgenesis to get the chain name information
-	const char *chain = get_network_from_genesis_block(block_genesis);
-	if (!chain) {
-		err = tal_fmt(cmd, "%s: no chain found for genesis block %s",
-			      cmd->methodname, block_genesis);
-		return command_done_err(cmd, BCLI_ERROR, err, NULL);
-	}
+/* Magic at the start of the snapshot, bump on format change. */
+#define SNAPSHOT_MAGIC "ESPLSNP1"
 
-	// send response with chain information
-	struct json_stream *response = jsonrpc_stream_success(cmd);
-	json_add_string(response, "chain", chain);
-	json_add_u32(response, "headercount", height);
-	json_add_u32(response, "blockcount", height);
-	json_add_bool(response, "ibd", false);
+/* What we know that a restart would make us ask for again: the hashes of
+ * the header window, the responses we cache (the genesis hash, fee
+ * estimates...), the outputs of the transactions we looked up and how
+ * each endpoint has been doing. We save it every `esplora->snapshot`
+ * seconds and when lightningd shuts down: the magic, the sha256 of the
+ * rest, then all of it in wire format. */
+struct snapshot {
+	const char *path;
+};
 
-	return command_finished(cmd, response);
+static struct snapshot *snapshot;
+
+/* How long ago something we got at `when` is (seconds). */
+static u32 snapshot_age(struct timemono when)
+{
+	u64 sec = time_to_msec(timemono_since(when)) / 1000;
+
+	return sec > UINT32_MAX ? UINT32_MAX : sec;
 }
 
-static struct command_result *getrawblockbyheight_notfound(struct command *cmd)
+/* When, on our clock, we got what was `age` seconds old once saved at
+ * `saved` (seconds since the epoch). False if that's before our clock
+ * started (it counts from boot): we can't tell how old it is then, and
+ * the caller shouldn't take it as fresh. */
+static bool snapshot_when(u64 saved, u32 age, struct timemono *when)
 {
-	struct json_stream *response;
+	u64 now = time_now().ts.tv_sec, ago = age;
 
-	response = jsonrpc_stream_success(cmd);
-	json_add_null(response, "blockhash");
-	json_add_null(response, "block");
+	*when = time_mono();
+	if (now > saved)
+		ago += now - saved;
+	if (ago >= (u64)when->ts.tv_sec)
+		return false;
+	when->ts.tv_sec -= ago;
+	return true;
+}
 
-	return command_finished(cmd, response);
+static struct endpoint *snapshot_endpoint(const char *url)
+{
+	for (size_t i = 0; i < tal_count(http->endpoints); i++) {
+		if (streq(http->endpoints[i].url, url))
+			return &http->endpoints[i];
+	}
+	if (http->core && streq(http->core->url, url))
+		return http->core;
+	return NULL;
 }
 
-/* Get a raw block given its height.
- * Calls `getblockhash` then `getblock` to retrieve it from bitcoin_cli.
- * Will return early with null fields if block isn't known (yet).
- */
-static struct command_result *
-getrawblockbyheight(struct command *cmd, const char *buf, const jsmntok_t *toks)
+/* Latencies in usec, error rates in millionths. */
+static void towire_snapshot_endpoint(u8 **pptr, const struct endpoint *ep)
 {
-	struct json_stream *response;
-	u32 *height;
-	char *err;
+	towire_wirestring(pptr, ep->url);
+	towire_u64(pptr, ep->latency * 1000);
+	towire_u64(pptr, ep->deviation * 1000);
+	towire_u64(pptr, ep->samples);
+	towire_u32(pptr, ep->errors * 1000000);
+	towire_u32(pptr, ep->failures);
+}
 
-	if (!param(cmd, buf, toks, p_req("height", param_number, &height),
-		   NULL))
-		return command_param_failed();
+static u8 *towire_snapshot(const tal_t *ctx)
+{
+	u8 *p = tal_arr(ctx, u8, 0);
+	struct cached_response *c;
+	struct txouts *txouts;
+	u32 n = 0;
 
-	plugin_log(cmd->plugin, LOG_INFORM, "getrawblockbyheight %d", *height);
+	towire_wirestring(&p, chainparams->network_name);
+	towire_u64(&p, time_now().ts.tv_sec);
 
-	// fetch blockhash from block height
-	const char *blockhash_url = tal_fmt(cmd->plugin, "%s/block-height/%d",
-					    esplora->endpoint, *height);
-	const char *blockhash_ = request_get(cmd, blockhash_url);
-	if (!blockhash_) {
-		// block not found as getrawblockbyheight_notfound
-		return getrawblockbyheight_notfound(cmd);
+	towire_u32(&p, headers->base);
+	towire_u32(&p, headers->best_height);
+	for (size_t i = 0; i < tal_count(headers->entries); i++)
+		n += headers->entries[i].known;
+	towire_u32(&p, n);
+	for (size_t i = 0; i < tal_count(headers->entries); i++) {
+		const struct header_entry *e = &headers->entries[i];
+
+		if (!e->known)
+			continue;
+		towire_u32(&p, headers->base + i);
+		towire_bitcoin_blkid(&p, &e->blkid);
+		towire_u32(&p, snapshot_age(e->fetched));
 	}
-	char *blockhash = tal_dup_arr(cmd, char, (char *)blockhash_,
-				      tal_count(blockhash_), 1);
-	blockhash[tal_count(blockhash_)] = '\0';
-	tal_free(blockhash_);
-	plugin_log(cmd->plugin, LOG_INFORM, "blockhash: %s from %s", blockhash,
-		   blockhash_url);
-
-	// Esplora serves raw block
-	const char *block_url = tal_fmt(cmd->plugin, "%s/block/%s/raw",
-					esplora->endpoint, blockhash);
-	const u8 *block_res = request(cmd, block_url, false, NULL);
-	if (!block_res) {
-		err = tal_fmt(cmd, "%s: request error on %s", cmd->methodname,
-			      block_url);
-		plugin_log(cmd->plugin, LOG_INFORM, "%s", err);
-		// block not found as getrawblockbyheight_notfound
-		return getrawblockbyheight_notfound(cmd);
+
+	n = 0;
+	list_for_each(&cache->responses, c, list)
+		n += c->body != NULL;
+	towire_u32(&p, n);
+	list_for_each(&cache->responses, c, list)
+	{
+		if (!c->body)
+			continue;
+		towire_wirestring(&p, c->path);
+		towire_u32(&p, snapshot_age(c->fetched));
+		towire_u32(&p, tal_count(c->body));
+		towire_u8_array(&p, c->body, tal_count(c->body));
 	}
 
-	// parse rawblock output
-	const char *rawblock =
-	    tal_hexstr(cmd->plugin, block_res, tal_count(block_res));
-	if (!rawblock) {
-		err = tal_fmt(cmd, "%s: convert error on %s", cmd->methodname,
-			      block_url);
-		plugin_log(cmd->plugin, LOG_INFORM, "%s", err);
-		return command_done_err(cmd, BCLI_ERROR, err, NULL);
+	// the least recently used first, so that they're added back in order
+	towire_u32(&p, txout_cache->count);
+	list_for_each_rev(&txout_cache->lru, txouts, list)
+	{
+		towire_bitcoin_txid(&p, &txouts->txid);
+		towire_u32(&p, tal_count(txouts->outs));
+		for (size_t i = 0; i < tal_count(txouts->outs); i++) {
+			const struct cached_txout *out = &txouts->outs[i];
+			size_t len = tal_count(out->script);
+
+			towire_bool(&p, out->has_amount);
+			towire_amount_sat(&p, out->amount);
+			towire_u32(&p, len);
+			towire_u8_array(&p, out->script, len);
+		}
 	}
 
-	// send response with block and blockhash in hex format
-	response = jsonrpc_stream_success(cmd);
-	json_add_string(response, "blockhash", blockhash);
-	json_add_string(response, "block", rawblock);
+	towire_u32(&p, tal_count(http->endpoints) + (http->core != NULL));
+	for (size_t i = 0; i < tal_count(http->endpoints); i++)
+		towire_snapshot_endpoint(&p, &http->endpoints[i]);
+	if (http->core)
+		towire_snapshot_endpoint(&p, http->core);
 
-	return command_finished(cmd, response);
+	return p;
 }
 
-static struct command_result *estimatefees_null_response(struct command *cmd)
+/* A byte array of `len` bytes, NULL if there aren't that many left. */
+static u8 *fromwire_snapshot_bytes(const tal_t *ctx, const u8 **cursor,
+				   size_t *max, u32 len)
 {
-	struct json_stream *response = jsonrpc_stream_success(cmd);
-
-	json_add_null(response, "opening");
-	json_add_null(response, "mutual_close");
-	json_add_null(response, "unilateral_close");
-	json_add_null(response, "delayed_to_us");
-	json_add_null(response, "htlc_resolution");
-	json_add_null(response, "penalty");
-	json_add_null(response, "min_acceptable");
-	json_add_null(response, "max_acceptable");
+	u8 *arr;
 
-	return command_finished(cmd, response);
+	if (len > *max) {
+		fromwire_fail(cursor, max);
+		return NULL;
+	}
+	arr = tal_arr(ctx, u8, len);
+	fromwire_u8_array(cursor, max, arr, len);
+	return arr;
 }
 
-/* Get current feerate.
- * Returns the feerate to lightningd as btc/k*VBYTE*.
- */
-static struct command_result *estimatefees(struct command *cmd,
-					   const char *buf UNUSED,
-					   const jsmntok_t *toks UNUSED)
+static void fromwire_snapshot_txouts(const u8 **cursor, size_t *max)
 {
-	char *err;
-	// slow, normal, urgent, very_urgent
-	int targets[4] = {144, 5, 3, 2};
-	u64 *feerates = tal_arr(NULL, u64, 4);
+	struct txouts *txouts = tal(tmpctx, struct txouts);
+	u32 n;
 
-	if (!param(cmd, buf, toks, NULL))
-		return command_param_failed();
-
-	const char *feerate_url =
-	    // fetch feerates
-	    tal_fmt(cmd->plugin, "%s/fee-estimates", esplora->endpoint);
-	const char *feerate_res = request_get(cmd, feerate_url);
-	if (!feerate_res) {
-		err = tal_fmt(cmd, "%s: request error on %s", cmd->methodname,
-			      feerate_url);
-		plugin_log(cmd->plugin, LOG_UNUSUAL, "err: %s", err);
-		return estimatefees_null_response(cmd);
-	}
-	// parse feerates output
-	const jsmntok_t *tokens =
-	    json_parse_simple(cmd, feerate_res, strlen(feerate_res));
-	if (!tokens) {
-		err = tal_fmt(cmd, "%s: json error (%.*s)?", cmd->methodname,
-			      (int)sizeof(feerate_res), feerate_res);
-		plugin_log(cmd->plugin, LOG_INFORM, "err: %s", err);
-		return estimatefees_null_response(cmd);
+	fromwire_bitcoin_txid(cursor, max, &txouts->txid);
+	n = fromwire_u32(cursor, max);
+	if (n > *max) {
+		fromwire_fail(cursor, max);
+		return;
 	}
-	for (size_t i = 0; i < tal_count(feerates); i++) {
-		const jsmntok_t *feeratetok =
-		    json_get_member(feerate_res, tokens,
-				    tal_fmt(cmd->plugin, "%d", targets[i]));
-		// This puts a feerate in sat/vB multiplied by 10**7 in
-		// 'feerate'.
-		// Esplora can answer with a empty object like this {}, in this
-		// case we need to return a null response to say that is not
-		// possible to estimate the feerate.
-		if (!feeratetok || !json_to_millionths(feerate_res, feeratetok,
-						       &feerates[i])) {
-			err = tal_fmt(cmd,
-				      "%s: had no feerate for block %d (%.*s)?",
-				      cmd->methodname, targets[i],
-				      (int)sizeof(feerate_res), feerate_res);
-			plugin_log(cmd->plugin, LOG_INFORM, "err: %s", err);
-			return estimatefees_null_response(cmd);
-		}
+	txouts->outs = tal_arr(txouts, struct cached_txout, n);
+	for (size_t i = 0; i < n && *cursor; i++) {
+		struct cached_txout *out = &txouts->outs[i];
 
-		// ... But lightningd wants a sat/kVB feerate, divide by 10**4 !
-		feerates[i] /= 10000;
+		out->has_amount = fromwire_bool(cursor, max);
+		out->amount = fromwire_amount_sat(cursor, max);
+		out->script = fromwire_snapshot_bytes(
+		    txouts->outs, cursor, max, fromwire_u32(cursor, max));
 	}
-	// sanity check
-	if (!feerates)
-		return estimatefees_null_response(cmd);
+	if (*cursor)
+		txout_cache_add(txouts);
+}
 
-	struct json_stream *response = jsonrpc_stream_success(cmd);
-	json_add_u64(response, "opening", feerates[1]);
-	json_add_u64(response, "mutual_close", feerates[1]);
-	json_add_u64(response, "unilateral_close", feerates[3]);
-	json_add_u64(response, "delayed_to_us", feerates[1]);
-	json_add_u64(response, "htlc_resolution", feerates[2]);
-	json_add_u64(response, "penalty", feerates[2]);
-	/* We divide the slow feerate for the minimum acceptable, lightningd
-	 * will use floor if it's hit, though. */
-	json_add_u64(response, "min_acceptable", feerates[0] / 2);
-	/* BOLT #2:
-	 *
-	 * Given the variance in fees, and the fact that the transaction may be
-	 * spent in the future, it's a good idea for the fee payer to keep a
-	 * good margin (say 5x the expected fee requirement)
-	 *
-	 * 10 is lightningd's default for bitcoind-max-multiplier
-	 */
-	json_add_u64(response, "max_acceptable", feerates[3] * 10);
+static void fromwire_snapshot_endpoint(const u8 **cursor, size_t *max)
+{
+	char *url = fromwire_wirestring(tmpctx, cursor, max);
+	u64 latency = fromwire_u64(cursor, max);
+	u64 deviation = fromwire_u64(cursor, max);
+	u64 samples = fromwire_u64(cursor, max);
+	u32 errors = fromwire_u32(cursor, max);
+	u32 failures = fromwire_u32(cursor, max);
+	struct endpoint *ep;
 
-	return command_finished(cmd, response);
+	if (!*cursor)
+		return;
+	// it may well not be one of ours anymore
+	ep = snapshot_endpoint(url);
+	if (!ep)
+		return;
+	ep->latency = latency / 1000.0;
+	ep->deviation = deviation / 1000.0;
+	ep->samples = samples;
+	ep->errors = errors / 1000000.0;
+	ep->failures = failures;
 }
 
-static struct command_result *getutxout(struct command *cmd, const char *buf,
-					const jsmntok_t *toks)
+/* Take what we can of a snapshot: false if it's not of our network, or
+ * truncated. */
+static bool fromwire_snapshot(const u8 *cursor, size_t max)
 {
-	struct json_stream *response;
-	const char *txid, *vout;
-	char *err;
-	bool spent = false;
-	jsmntok_t *tokens;
-	struct bitcoin_tx_output output;
-
-	plugin_log(cmd->plugin, LOG_INFORM, "getutxout");
+	char *network = fromwire_wirestring(tmpctx, &cursor, &max);
+	u64 saved = fromwire_u64(&cursor, &max);
+	u32 base, best, n;
 
-	/* bitcoin-cli wants strings. */
-	if (!param(cmd, buf, toks, p_req("txid", param_string, &txid),
-		   p_req("vout", param_string, &vout), NULL))
-		return command_param_failed();
+	if (!network || !streq(network, chainparams->network_name))
+		return false;
 
-	// convert vout to number
-	const char *error;
-	u32 vout_index;
-	if (!get_u32_from_string(cmd, &vout_index, vout, &error)) {
-		const char *err =
-		    tal_fmt(cmd, "Conversion error occurred on %s (error: %s)",
-			    vout, error);
-		return command_done_err(cmd, BCLI_ERROR, err, NULL);
+	base = fromwire_u32(&cursor, &max);
+	best = fromwire_u32(&cursor, &max);
+	n = fromwire_u32(&cursor, &max);
+	if (n != 0) {
+		tal_free(headers->entries);
+		headers->base = base;
+		headers->entries =
+		    tal_arrz(headers, struct header_entry, HEADERS_WINDOW);
+		headers->best_height = best;
 	}
+	for (size_t i = 0; i < n && cursor; i++) {
+		u32 height = fromwire_u32(&cursor, &max);
+		struct header_entry *e = headers_entry(height);
+		struct bitcoin_blkid blkid;
+		struct timemono fetched;
+		u32 age;
 
-	// check transaction output is spent
-	const char *status_url = tal_fmt(cmd->plugin, "%s/tx/%s/outspend/%s",
-					 esplora->endpoint, txid, vout);
-	const char *status_res = request_get(cmd, status_url);
-	if (!status_res) {
-		err = tal_fmt(cmd, "%s: request error on %s", cmd->methodname,
-			      status_url);
-		return command_done_err(cmd, BCLI_ERROR, err, NULL);
-	}
-	tokens = json_parse_simple(cmd, status_res, strlen(status_res));
-	if (!tokens) {
-		err = tal_fmt(cmd, "%s: json error (%.*s)?", cmd->methodname,
-			      (int)sizeof(status_res), status_res);
-		return command_done_err(cmd, BCLI_ERROR, err, NULL);
+		fromwire_bitcoin_blkid(&cursor, &max, &blkid);
+		age = fromwire_u32(&cursor, &max);
+		if (!cursor || !e || !snapshot_when(saved, age, &fetched))
+			continue;
+		e->known = true;
+		e->blkid = blkid;
+		e->fetched = fetched;
 	}
 
-	// parsing spent field
-	const jsmntok_t *spenttok =
-	    json_get_member(status_res, tokens, "spent");
-	if (!spenttok || !json_to_bool(status_res, spenttok, &spent)) {
-		err = tal_fmt(cmd, "%s: had no spent (%.*s)?", cmd->methodname,
-			      (int)sizeof(status_res), status_res);
-		return command_done_err(cmd, BCLI_ERROR, err, NULL);
-	}
-	/* As of at least v0.15.1.0, bitcoind returns "success" but an empty
-	   string on a spent txout. */
-	if (spent) {
-		response = jsonrpc_stream_success(cmd);
-		json_add_null(response, "amount");
-		json_add_null(response, "script");
-		return command_finished(cmd, response);
-	}
+	n = fromwire_u32(&cursor, &max);
+	for (size_t i = 0; i < n && cursor; i++) {
+		char *path = fromwire_wirestring(tmpctx, &cursor, &max);
+		u32 age = fromwire_u32(&cursor, &max);
+		u8 *body = fromwire_snapshot_bytes(tmpctx, &cursor, &max,
+						   fromwire_u32(&cursor, &max));
+		struct cached_response *c;
+		struct timemono fetched;
 
-	// get transaction information
-	const char *gettx_url =
-	    tal_fmt(cmd->plugin, "%s/tx/%s", esplora->endpoint, txid);
-	const char *gettx_res = request_get(cmd, gettx_url);
-	if (!gettx_res) {
-		err = tal_fmt(cmd, "%s: request error on %s", cmd->methodname,
-			      gettx_url);
-		return command_done_err(cmd, BCLI_ERROR, err, NULL);
-	}
-	tokens = json_parse_simple(cmd, gettx_res, strlen(gettx_res));
-	if (!tokens) {
-		err = tal_fmt(cmd, "%s: json error (%.*s)?", cmd->methodname,
-			      (int)sizeof(gettx_res), gettx_res);
-		return command_done_err(cmd, BCLI_ERROR, err, NULL);
+		if (!cursor)
+			break;
+		/* e.g. fee estimates from before a reboot. */
+		if (!snapshot_when(saved, age, &fetched))
+			continue;
+		c = cache_find(path);
+		if (!c)
+			c = cache_add(path);
+		tal_free(c->body);
+		c->body = tal_steal(c, body);
+		c->fetched = fetched;
 	}
 
-	const char *guide =
-	    tal_fmt(cmd->plugin, "{vout:[%d:{value:%%,scriptpubkey:%%}]}",
-		    (int)vout_index);
-	error = json_scan(
-	    cmd, gettx_res, tokens, guide,
-	    JSON_SCAN(json_to_sat, &output.amount),
-	    JSON_SCAN_TAL(cmd, json_tok_bin_from_hex, &output.script));
-	if (error)
-		return command_done_err(cmd, BCLI_ERROR, error, NULL);
+	n = fromwire_u32(&cursor, &max);
+	for (size_t i = 0; i < n && cursor; i++)
+		fromwire_snapshot_txouts(&cursor, &max);
 
-	// replay response
-	response = jsonrpc_stream_success(cmd);
-	json_add_amount_sat_only(response, "amount", output.amount);
-	json_add_string(response, "script", tal_hex(response, output.script));
+	n = fromwire_u32(&cursor, &max);
+	for (size_t i = 0; i < n && cursor; i++)
+		fromwire_snapshot_endpoint(&cursor, &max);
 
-	return command_finished(cmd, response);
+	return cursor != NULL;
 }
 
-/* Send a transaction to the Bitcoin network.
- * Calls `sendrawtransaction` using the first parameter as the raw tx.
- */
-static struct command_result *
-sendrawtransaction(struct command *cmd, const char *buf, const jsmntok_t *toks)
+/* Why the snapshot mapped at `map` is of no use, NULL if we took it. */
+static const char *snapshot_apply(const u8 *map, size_t len)
 {
-	const char *tx;
-	// FIXME(vincenzopalazzo) This propriety is added in the version 0.9.1
-	// We can try to give a meaning to it. For the moment
-	// it is only a fix to work around the param method error
-	bool *allowhighfees;
-	/* bitcoin-cli wants strings. */
-	if (!param(
-		cmd, buf, toks, p_req("tx", param_string, &tx),
-		p_opt_def("allowhighfees", param_bool, &allowhighfees, false),
-		NULL))
-		return command_param_failed();
+	size_t magic_len = strlen(SNAPSHOT_MAGIC);
+	struct sha256 sum;
 
-	plugin_log(cmd->plugin, LOG_INFORM, "sendrawtransaction");
+	if (len < magic_len + sizeof(sum) ||
+	    memcmp(map, SNAPSHOT_MAGIC, magic_len) != 0)
+		return "not a snapshot of ours";
+	map += magic_len;
+	len -= magic_len;
+	sha256(&sum, map + sizeof(sum), len - sizeof(sum));
+	if (memcmp(map, &sum, sizeof(sum)) != 0)
+		return "bad checksum";
+	if (!fromwire_snapshot(map + sizeof(sum), len - sizeof(sum)))
+		return "of another network, or truncated";
+	return NULL;
+}
 
-	// request post passing rawtransaction
-	const char *sendrawtx_url =
-	    tal_fmt(cmd->plugin, "%s/tx", esplora->endpoint);
-	const char *res = request_post(cmd, sendrawtx_url, tx);
-	struct json_stream *response = jsonrpc_stream_success(cmd);
-	if (!res) {
-		// send response with failure
-		const char *err =
-		    tal_fmt(cmd, "%s: invalid tx (%.*s)? on (%.*s)?",
-			    cmd->methodname, (int)sizeof(tx), tx,
-			    (int)sizeof(sendrawtx_url), sendrawtx_url);
-		json_add_bool(response, "success", false);
-		json_add_string(response, "errmsg", err);
-		return command_finished(cmd, response);
+/* Why we could not load the snapshot at `path`, NULL if we did (or if
+ * there is none). */
+static const char *snapshot_load(const char *path)
+{
+	const char *why;
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return errno == ENOENT ? NULL : strerror(errno);
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		close(fd);
+		return "empty";
 	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return strerror(errno);
 
-	// send response with success
-	json_add_bool(response, "success", true);
-	json_add_string(response, "errmsg", "");
-	return command_finished(cmd, response);
+	why = snapshot_apply(map, st.st_size);
+	munmap(map, st.st_size);
+	return why;
+}
+
+static void snapshot_save(struct snapshot *snap)
+{
+	u8 *contents = towire_snapshot(tmpctx);
+	u8 *file = tal_arr(tmpctx, u8, 0);
+	struct sha256 sum;
+
+	sha256(&sum, contents, tal_count(contents));
+	towire(&file, SNAPSHOT_MAGIC, strlen(SNAPSHOT_MAGIC));
+	towire(&file, &sum, sizeof(sum));
+	towire(&file, contents, tal_count(contents));
+	write_file_atomic(snap->path, file, tal_count(file));
+}
+
+static void snapshot_round(struct snapshot *snap)
+{
+	snapshot_save(snap);
+	plugin_timer(http->plugin, time_from_sec(esplora->snapshot),
+		     snapshot_round, snap);
+	timer_complete(http->plugin);
+}
+
+/* Warm up from the snapshot at `path`, if any, and keep it up to date. */
+static struct snapshot *new_snapshot(const tal_t *ctx, const char *path)
+{
+	struct snapshot *snap = tal(ctx, struct snapshot);
+	const char *why = snapshot_load(path);
+
+	snap->path = tal_strdup(snap, path);
+	if (why)
+		plugin_log(http->plugin, LOG_UNUSUAL, "Ignoring %s: %s", path,
+			   why);
+	plugin_timer(http->plugin, time_from_sec(esplora->snapshot),
+		     snapshot_round, snap);
+	return snap;
+}
+
+/* lightningd is going away (or stopping us), and gives us a little
+ * while to exit by ourselves. */
+static struct command_result *shutdown_notified(struct command *cmd UNUSED,
+						const char *buf UNUSED,
+						const jsmntok_t *params UNUSED)
+{
+	if (snapshot)
+		snapshot_save(snapshot);
+	exit(0);
 }
 
 static void configure_url(const char *network, bool proxy_enabled,
@@ -661,6 +6483,13 @@ static const char *init(struct plugin *p, const char *buffer,
 		}
 	}
 
+	curl_global_init(CURL_GLOBAL_ALL);
+	http = new_http_engine(p, p);
+	cache = new_response_cache(p);
+	txout_cache = new_txout_cache(p);
+	prefetcher = new_prefetcher(p);
+	headers = new_headers(p);
+
 	const jsmntok_t *network_tok =
 	    json_get_member(buffer, config, "network");
 
@@ -668,6 +6497,78 @@ static const char *init(struct plugin *p, const char *buffer,
 	if (!configure_esplora_with_network(network, proxy_conf->proxy_enabled,
 					    proxy_conf->torv3_enabled))
 		plugin_log(p, LOG_UNUSUAL, "Network %s unsupported", network);
+	chainparams = chainparams_for_network(network);
+	if (!chainparams)
+		return tal_fmt(p, "Unknown network %s", network);
+	if (esplora->endpoint)
+		http_add_endpoints(http, esplora->endpoint);
+	if (proxy_conf->proxy_enabled && !esplora->proxy_disabled)
+		http_use_proxy(http, proxy_conf->address, proxy_conf->port,
+			       esplora->tor_circuits);
+
+	// Electrum pushes us the tip, no need to poll it
+	if (esplora->electrum) {
+		if (chainparams->is_elements)
+			return tal_fmt(p, "--esplora-electrum doesn't do %s",
+				       network);
+		if (proxy_conf->always_used && !esplora->proxy_disabled)
+			return tal_fmt(p, "--esplora-electrum doesn't go "
+					  "through the proxy");
+		tip = new_tip_watcher(p, false);
+		if (!new_electrum(p, p, esplora->electrum))
+			return tal_fmt(p, "--esplora-electrum: '%s' is not "
+					  "a host:port we can resolve",
+				       esplora->electrum);
+	} else if (esplora->tip_poll != 0)
+		tip = new_tip_watcher(p, true);
+
+	// bitcoind's outputs are not Elements' ones
+	if (esplora->core_rest) {
+		if (chainparams->is_elements)
+			return tal_fmt(p, "--esplora-core-rest doesn't do %s",
+				       network);
+		http_use_core(http, esplora->core_rest);
+	}
+
+	if (mkdir(esplora->datadir, 0700) != 0 && errno != EEXIST)
+		plugin_log(p, LOG_UNUSUAL, "Could not create %s: %s",
+			   esplora->datadir, strerror(errno));
+
+	if (esplora->rebroadcast != 0)
+		rebroadcaster = new_rebroadcaster(
+		    p, path_join(tmpctx, esplora->datadir, "rebroadcast"));
+
+	// pick up where we left off: the genesis hash, the fees...
+	if (esplora->snapshot != 0)
+		snapshot = new_snapshot(
+		    p, path_join(tmpctx, esplora->datadir, "snapshot"));
+
+	if (esplora->trace_file) {
+		tracer = new_tracer(p, esplora->trace_file);
+		if (tracer)
+			trace_track_name(0, "background");
+		else
+			plugin_log(p, LOG_UNUSUAL, "Could not trace to %s: %s",
+				   esplora->trace_file, strerror(errno));
+	}
+
+	if (esplora->stats_file)
+		plugin_timer(p, time_from_sec(STATS_DUMP_SEC), stats_dump,
+			     stats);
+
+	// we can't tell an Elements block we read back from another one
+	if (esplora->blockstore_mb != 0 && chainparams->is_elements)
+		plugin_log(p, LOG_INFORM, "Block store disabled on %s",
+			   network);
+	else if (esplora->blockstore_mb != 0) {
+		const char *err;
+		blockstore = blockstore_open(
+		    p, path_join(tmpctx, esplora->datadir, "blocks"),
+		    (u64)esplora->blockstore_mb << 20, &err);
+		if (!blockstore)
+			plugin_log(p, LOG_UNUSUAL,
+				   "Block store disabled, error %s", err);
+	}
 
 	// Is good manners for the moment maintains this check only a warning
 	// and not abort if the config is uncorrect, we are inside the
@@ -681,10 +6582,21 @@ static const char *init(struct plugin *p, const char *buffer,
 
 	plugin_log(p, LOG_INFORM,
 		   "------------ esplora initialized ------------");
-	plugin_log(p, LOG_INFORM, "esplora endpoint %s", esplora->endpoint);
+	for (size_t i = 0; i < tal_count(http->endpoints); i++)
+		plugin_log(p, LOG_INFORM, "esplora endpoint %s",
+			   http->endpoints[i].url);
 	if (proxy_conf->proxy_enabled && !esplora->proxy_disabled)
 		plugin_log(p, LOG_INFORM, "proxy configuration %s:%d",
 			   proxy_conf->address, proxy_conf->port);
+	if (tal_count(http->circuits))
+		plugin_log(p, LOG_INFORM, "over %zu isolated circuits",
+			   tal_count(http->circuits));
+	if (electrum)
+		plugin_log(p, LOG_INFORM, "Electrum server %s:%s",
+			   electrum->host, electrum->port);
+	if (http->core)
+		plugin_log(p, LOG_INFORM, "bitcoind REST interface %s",
+			   http->core->url);
 	return NULL;
 }
 
@@ -697,7 +6609,29 @@ static struct esplora *new_esplora(const tal_t *ctx)
 	esplora->cainfo_path = NULL;
 	esplora->verbose = false;
 	esplora->proxy_disabled = false;
+	esplora->tor_circuits = 4;
 	esplora->n_retries = 4;
+	esplora->deadline = 45;
+	esplora->timeout = 30;
+	esplora->connect_timeout = 15;
+	esplora->rate = 10;
+	esplora->burst = 20;
+	esplora->max_connections = 8;
+	esplora->http2 = true;
+	esplora->max_streams = 32;
+	esplora->datadir = tal_strdup(esplora, "esplora");
+	esplora->blockstore_mb = 256;
+	esplora->prefetch_depth = 8;
+	esplora->prefetch_mb = 32;
+	esplora->fees_ttl = 30;
+	esplora->tip_ttl = 5;
+	esplora->tip_poll = 10;
+	esplora->rebroadcast = 600;
+	esplora->stats_file = NULL;
+	esplora->trace_file = NULL;
+	esplora->electrum = NULL;
+	esplora->core_rest = NULL;
+	esplora->snapshot = 300;
 
 	return esplora;
 }
@@ -729,6 +6663,18 @@ static const struct plugin_command commands[] = {
     {"getutxout", "bitcoin",
      "Get information about an output, identified by a {txid} an a {vout}", "",
      getutxout},
+    {"getutxouts", "bitcoin",
+     "Get information about a list of {outpoints}, each identified by a "
+     "{txid} and a {vout}",
+     "", getutxouts},
+    {"esplora-stats", "esplora",
+     "Get the latency percentiles, status codes, bytes and cache hits of "
+     "our commands, of each kind of request and of each endpoint",
+     "", esplorastats},
+};
+
+static const struct plugin_notification notifs[] = {
+    {"shutdown", shutdown_notified},
 };
 
 int main(int argc, char *argv[])
@@ -738,13 +6684,15 @@ int main(int argc, char *argv[])
 	/* Our global state. */
 	esplora = new_esplora(NULL);
 	proxy_conf = new_proxy_conf(NULL);
+	stats = new_stats_set(NULL);
 
 	plugin_main(
 	    argv, init, PLUGIN_STATIC, false, NULL, commands,
-	    ARRAY_SIZE(commands), NULL, 0, NULL, 0, NULL, 0,
+	    ARRAY_SIZE(commands), notifs, ARRAY_SIZE(notifs), NULL, 0, NULL, 0,
 	    plugin_option("esplora-api-endpoint", "string",
 			  "The URL of the esplora instance to hit "
-			  "(including '/api').",
+			  "(including '/api'), or a comma-separated list of "
+			  "them.",
 			  charp_option, &esplora->endpoint),
 	    plugin_option("esplora-cainfo", "string",
 			  "Set path to Certificate Authority (CA) bundle.",
@@ -759,6 +6707,100 @@ int main(int argc, char *argv[])
 			  "How many times should we retry a request to the"
 			  "endpoint before dying ?",
 			  u32_option, &esplora->n_retries),
+	    plugin_option("esplora-deadline", "int",
+			  "How many seconds can a request take, retries "
+			  "included (0 for no limit) ?",
+			  u32_option, &esplora->deadline),
+	    plugin_option("esplora-timeout", "int",
+			  "How many seconds can a single transfer take "
+			  "(0 for no limit) ?",
+			  u32_option, &esplora->timeout),
+	    plugin_option("esplora-connect-timeout", "int",
+			  "How many seconds can connecting to the endpoint "
+			  "take ?",
+			  u32_option, &esplora->connect_timeout),
+	    plugin_option("esplora-rate", "int",
+			  "How many requests per second can we send each "
+			  "endpoint (0 for no limit) ?",
+			  u32_option, &esplora->rate),
+	    plugin_option("esplora-burst", "int",
+			  "How many requests can we send each endpoint at once "
+			  "after a quiet period ?",
+			  u32_option, &esplora->burst),
+	    plugin_option("esplora-max-connections", "int",
+			  "How many connections to the endpoint do we keep "
+			  "open (default: 8).",
+			  u32_option, &esplora->max_connections),
+	    plugin_option("esplora-http2", "bool",
+			  "Multiplex requests to an endpoint over one HTTP/2 "
+			  "connection when it can (default: true).",
+			  bool_option, &esplora->http2),
+	    plugin_option("esplora-max-streams", "int",
+			  "How many requests can share an HTTP/2 connection "
+			  "(default: 32).",
+			  u32_option, &esplora->max_streams),
+	    plugin_option("esplora-datadir", "string",
+			  "Where to keep our files, relative to the lightning "
+			  "directory (default: esplora).",
+			  charp_option, &esplora->datadir),
+	    plugin_option("esplora-blockstore-size", "int",
+			  "How many MiB of raw blocks to keep on disk, 0 to "
+			  "disable (default: 256).",
+			  u32_option, &esplora->blockstore_mb),
+	    plugin_option("esplora-prefetch", "int",
+			  "How many blocks to fetch ahead while lightningd "
+			  "syncs, 0 to disable (default: 8).",
+			  u32_option, &esplora->prefetch_depth),
+	    plugin_option("esplora-prefetch-max-mb", "int",
+			  "How many MiB of prefetched blocks to hold in memory "
+			  "(default: 32).",
+			  u32_option, &esplora->prefetch_mb),
+	    plugin_option("esplora-fees-ttl", "int",
+			  "For how many seconds do we reuse fee estimates "
+			  "(default: 30).",
+			  u32_option, &esplora->fees_ttl),
+	    plugin_option("esplora-tip-ttl", "int",
+			  "For how many seconds do we reuse the chain tip "
+			  "height (default: 5).",
+			  u32_option, &esplora->tip_ttl),
+	    plugin_option("esplora-tip-poll", "int",
+			  "How often do we poll the chain tip, in seconds, 0 "
+			  "to disable (default: 10).",
+			  u32_option, &esplora->tip_poll),
+	    plugin_option("esplora-snapshot", "int",
+			  "How often do we snapshot our caches so that a "
+			  "restart doesn't start cold, in seconds, 0 to "
+			  "disable (default: 300).",
+			  u32_option, &esplora->snapshot),
+	    plugin_option("esplora-rebroadcast", "int",
+			  "How often do we rebroadcast the transactions we "
+			  "sent until they confirm, in seconds, 0 to disable "
+			  "(default: 600).",
+			  u32_option, &esplora->rebroadcast),
+	    plugin_option("esplora-stats-file", "string",
+			  "Where to write the esplora-stats output every "
+			  "minute, relative to the lightning directory "
+			  "(default: nowhere).",
+			  charp_option, &esplora->stats_file),
+	    plugin_option("esplora-trace-file", "string",
+			  "Where to write a trace of the commands and their "
+			  "requests, relative to the lightning directory, in "
+			  "Chrome's trace format (default: nowhere).",
+			  charp_option, &esplora->trace_file),
+	    plugin_option("esplora-electrum", "string",
+			  "The Electrum server (host:port, plain TCP) to ask "
+			  "for everything but raw blocks, which still come "
+			  "from esplora (default: none).",
+			  charp_option, &esplora->electrum),
+	    plugin_option("esplora-core-rest", "string",
+			  "The REST interface of our own bitcoind (e.g. "
+			  "http://127.0.0.1:8332) to ask first for blocks, "
+			  "outputs and the chain info (default: none).",
+			  charp_option, &esplora->core_rest),
+	    plugin_option("esplora-tor-circuits", "int",
+			  "Over how many isolated Tor circuits to spread "
+			  "requests when going through the proxy (default: 4).",
+			  u32_option, &esplora->tor_circuits),
 	    plugin_option("esplora-disable-proxy", "flag",
 			  "Ignore the proxy setting inside lightningd conf.",
 			  flag_option, &esplora->proxy_disabled),
@@ -0,0 +1,566 @@
+/* Runs the esplora plugin the way lightningd does and times it: block
+ * sync, bursts of gossip output checks and fee polling, against the
+ * endpoint we give it (usually esplora_mock.c replaying fixtures).
+ * `make esplora-bench` from the lightning tree, start the mock, then
+ * run plugins/esplora-bench. */
+#include <ccan/array_size/array_size.h>
+#include <ccan/err/err.h>
+#include <ccan/opt/opt.h>
+#include <ccan/read_write_all/read_write_all.h>
+#include <ccan/short_types/short_types.h>
+#include <ccan/str/str.h>
+#include <ccan/tal/path/path.h>
+#include <ccan/tal/str/str.h>
+#include <ccan/time/time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <external/jsmn/jsmn.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* What we were told to do. */
+static const char *plugin_path = "plugins/esplora";
+static const char *endpoint = "http://127.0.0.1:3000";
+static const char *fixtures = "fixtures";
+static const char *network = "bitcoin";
+static const char *scenarios = "sync,gossip,fees";
+static unsigned int burst = 16, rounds = 20;
+static bool verbose;
+/* name=value options we pass the plugin. */
+static char **plugin_opts;
+
+/* Freed after each scenario. */
+static tal_t *scratch;
+
+/* How a scenario went. */
+struct results {
+	const char *name;
+	size_t calls, errors, bytes;
+	/* Latency of each call (usec). */
+	u64 *usec;
+	struct timemono started;
+};
+
+/* A call we wait for the answer to. */
+struct call {
+	u64 id;
+	struct timemono sent;
+	struct results *res;
+};
+
+/* The plugin we run, and the lightningd side of it. */
+struct plugin_proc {
+	pid_t pid;
+	int to_plugin, from_plugin;
+
+	/* What it wrote we didn't look at yet. */
+	char *buf;
+	size_t len;
+
+	/* Where it connects to for RPC, and its connection. */
+	int rpc_listener, rpc_fd;
+	char *rpc_buf;
+	size_t rpc_len;
+
+	u64 next_id;
+	struct call **pending;
+};
+
+static jsmntok_t *json_parse(const tal_t *ctx, const char *buf, size_t len)
+{
+	jsmn_parser parser;
+	jsmntok_t *toks;
+	int n;
+
+	jsmn_init(&parser);
+	n = jsmn_parse(&parser, buf, len, NULL, 0);
+	if (n <= 0)
+		return NULL;
+	toks = tal_arr(ctx, jsmntok_t, n);
+	jsmn_init(&parser);
+	if (jsmn_parse(&parser, buf, len, toks, n) != n)
+		return tal_free(toks);
+	return toks;
+}
+
+/* The token after `t` and whatever it holds. */
+static const jsmntok_t *json_skip(const jsmntok_t *t)
+{
+	const jsmntok_t *next = t + 1;
+
+	for (int i = 0; i < t->size; i++)
+		next = json_skip(next);
+	return next;
+}
+
+static bool json_streq(const char *buf, const jsmntok_t *t, const char *s)
+{
+	return t->end - t->start == (int)strlen(s) &&
+	       memcmp(buf + t->start, s, t->end - t->start) == 0;
+}
+
+static const jsmntok_t *json_member(const char *buf, const jsmntok_t *obj,
+				    const char *name)
+{
+	const jsmntok_t *t = obj + 1;
+
+	if (obj->type != JSMN_OBJECT)
+		return NULL;
+	for (int i = 0; i < obj->size; i++, t = json_skip(t)) {
+		if (json_streq(buf, t, name))
+			return t + 1;
+	}
+	return NULL;
+}
+
+/* The raw JSON of a token, quotes included for a string. */
+static char *json_raw(const tal_t *ctx, const char *buf, const jsmntok_t *t)
+{
+	int quoted = t->type == JSMN_STRING;
+
+	return tal_strndup(ctx, buf + t->start - quoted,
+			   t->end - t->start + 2 * quoted);
+}
+
+/* Be lightningd for libplugin's own RPC calls at init. */
+static void rpc_answer(struct plugin_proc *pp, const char *msg, size_t len)
+{
+	jsmntok_t *toks = json_parse(scratch, msg, len);
+	const jsmntok_t *id, *method;
+	char *reply;
+
+	if (!toks)
+		errx(1, "Bad RPC request: %.*s", (int)len, msg);
+	id = json_member(msg, toks, "id");
+	method = json_member(msg, toks, "method");
+	if (!id || !method)
+		errx(1, "Bad RPC request: %.*s", (int)len, msg);
+
+	if (json_streq(msg, method, "listconfigs"))
+		reply = tal_fmt(scratch,
+				"{\"jsonrpc\":\"2.0\",\"id\":%s,\"result\":"
+				"{\"allow-deprecated-apis\":false}}\n\n",
+				json_raw(scratch, msg, id));
+	else
+		reply = tal_fmt(scratch,
+				"{\"jsonrpc\":\"2.0\",\"id\":%s,\"error\":"
+				"{\"code\":-32601,\"message\":\"Unknown "
+				"command\"}}\n\n",
+				json_raw(scratch, msg, id));
+	if (!write_all(pp->rpc_fd, reply, strlen(reply)))
+		err(1, "Writing to the plugin RPC");
+}
+
+/* Split what came in on the "\n\n" ending each message. */
+static void read_messages(int fd, char **buf, size_t *len,
+			  void (*handle)(struct plugin_proc *, const char *,
+					 size_t),
+			  struct plugin_proc *pp)
+{
+	ssize_t r;
+	char *end;
+
+	if (tal_count(*buf) < *len + 65536 + 1)
+		tal_resize(buf, (*len + 65536) * 2 + 1);
+	r = read(fd, *buf + *len, tal_count(*buf) - *len - 1);
+	if (r <= 0)
+		errx(1, "The plugin went away");
+	*len += r;
+	(*buf)[*len] = '\0';
+
+	while ((end = strstr(*buf, "\n\n")) != NULL) {
+		size_t used = end + 2 - *buf;
+		handle(pp, *buf, end - *buf);
+		memmove(*buf, *buf + used, *len - used + 1);
+		*len -= used;
+	}
+}
+
+static void handle_message(struct plugin_proc *pp, const char *msg,
+			   size_t len)
+{
+	jsmntok_t *toks = json_parse(scratch, msg, len);
+	const jsmntok_t *id;
+	u64 n;
+
+	if (!toks)
+		errx(1, "Bad message from the plugin: %.*s", (int)len, msg);
+	id = json_member(msg, toks, "id");
+	// a notification, e.g. a log line
+	if (!id) {
+		if (verbose)
+			printf("%.*s\n", (int)len, msg);
+		return;
+	}
+
+	n = strtoull(msg + id->start, NULL, 10);
+	for (size_t i = 0; i < tal_count(pp->pending); i++) {
+		struct call *c = pp->pending[i];
+		bool failed;
+		if (c->id != n)
+			continue;
+		failed = json_member(msg, toks, "error") != NULL;
+		if (failed && verbose)
+			printf("%.*s\n", (int)len, msg);
+		if (c->res) {
+			c->res->calls++;
+			c->res->errors += failed;
+			c->res->bytes += len;
+			tal_arr_expand(&c->res->usec,
+				       time_to_usec(timemono_since(c->sent)));
+		}
+		tal_arr_remove(&pp->pending, i);
+		tal_free(c);
+		return;
+	}
+	errx(1, "Answer to a call we didn't make: %.*s", (int)len, msg);
+}
+
+/* Wait until the plugin answered all our calls. */
+static void plugin_wait(struct plugin_proc *pp)
+{
+	while (tal_count(pp->pending) > 0) {
+		struct pollfd fds[3];
+
+		fds[0].fd = pp->from_plugin;
+		fds[1].fd = pp->rpc_listener;
+		fds[2].fd = pp->rpc_fd;
+		for (size_t i = 0; i < ARRAY_SIZE(fds); i++)
+			fds[i].events = POLLIN;
+		if (poll(fds, ARRAY_SIZE(fds), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "poll");
+		}
+
+		if (fds[0].revents)
+			read_messages(pp->from_plugin, &pp->buf, &pp->len,
+				      handle_message, pp);
+		if (fds[1].revents & POLLIN) {
+			pp->rpc_fd = accept(pp->rpc_listener, NULL, NULL);
+			if (pp->rpc_fd < 0)
+				err(1, "Accepting the plugin RPC connection");
+		}
+		if (pp->rpc_fd >= 0 && fds[2].revents)
+			read_messages(pp->rpc_fd, &pp->rpc_buf, &pp->rpc_len,
+				      rpc_answer, pp);
+	}
+}
+
+/* Send a request, counted in `res` (if not NULL) once answered. */
+static void plugin_call(struct plugin_proc *pp, struct results *res,
+			const char *method, const char *params)
+{
+	struct call *c = tal(pp, struct call);
+	char *req;
+
+	c->id = pp->next_id++;
+	c->res = res;
+	req = tal_fmt(scratch,
+		      "{\"jsonrpc\":\"2.0\",\"id\":%" PRIu64 ",\"method\":"
+		      "\"%s\",\"params\":%s}\n\n",
+		      c->id, method, params);
+	tal_arr_expand(&pp->pending, c);
+	c->sent = time_mono();
+	if (!write_all(pp->to_plugin, req, strlen(req)))
+		err(1, "Writing to the plugin");
+}
+
+static int rpc_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	if (fd < 0)
+		err(1, "socket");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		errx(1, "%s is too long for a socket path", path);
+	strcpy(addr.sun_path, path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+	    listen(fd, 1) != 0)
+		err(1, "Listening on %s", path);
+	return fd;
+}
+
+/* Start the plugin in `dir`, and get it through getmanifest and init. */
+static struct plugin_proc *plugin_start(const tal_t *ctx, const char *dir)
+{
+	struct plugin_proc *pp = tal(ctx, struct plugin_proc);
+	int in[2], out[2];
+	char *opts, *params;
+
+	if (pipe(in) != 0 || pipe(out) != 0)
+		err(1, "pipe");
+	pp->pid = fork();
+	if (pp->pid < 0)
+		err(1, "fork");
+	if (pp->pid == 0) {
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		close(in[1]);
+		close(out[0]);
+		execl(plugin_path, plugin_path, NULL);
+		err(1, "Running %s", plugin_path);
+	}
+	close(in[0]);
+	close(out[1]);
+	pp->to_plugin = in[1];
+	pp->from_plugin = out[0];
+	pp->buf = tal_arrz(pp, char, 1);
+	pp->len = 0;
+	pp->rpc_listener = rpc_listen(path_join(scratch, dir, "lightning-rpc"));
+	pp->rpc_fd = -1;
+	pp->rpc_buf = tal_arrz(pp, char, 1);
+	pp->rpc_len = 0;
+	pp->next_id = 1;
+	pp->pending = tal_arr(pp, struct call *, 0);
+
+	plugin_call(pp, NULL, "getmanifest", "{}");
+	plugin_wait(pp);
+
+	opts = tal_fmt(scratch, "\"esplora-api-endpoint\":\"%s\"", endpoint);
+	for (size_t i = 0; i < tal_count(plugin_opts); i++) {
+		char *eq = strchr(plugin_opts[i], '=');
+		tal_append_fmt(&opts, ",\"%.*s\":\"%s\"",
+			       (int)(eq - plugin_opts[i]), plugin_opts[i],
+			       eq + 1);
+	}
+	params = tal_fmt(scratch,
+			 "{\"options\":{%s},\"configuration\":{"
+			 "\"lightning-dir\":\"%s\",\"rpc-file\":"
+			 "\"lightning-rpc\",\"startup\":true,\"network\":"
+			 "\"%s\",\"feature_set\":{\"init\":\"\",\"node\":"
+			 "\"\",\"channel\":\"\",\"invoice\":\"\"}}}",
+			 opts, dir, network);
+	plugin_call(pp, NULL, "init", params);
+	plugin_wait(pp);
+	return pp;
+}
+
+/* Close its stdin, like lightningd going away. */
+static void plugin_stop(struct plugin_proc *pp)
+{
+	close(pp->to_plugin);
+	if (waitpid(pp->pid, NULL, 0) < 0)
+		err(1, "Waiting for the plugin");
+}
+
+static struct results *results_start(const tal_t *ctx, const char *name)
+{
+	struct results *res = talz(ctx, struct results);
+
+	res->name = name;
+	res->usec = tal_arr(res, u64, 0);
+	res->started = time_mono();
+	return res;
+}
+
+static int u64_cmp(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_msec(const u64 *sorted, size_t per_mille)
+{
+	size_t n = tal_count(sorted);
+
+	if (n == 0)
+		return 0;
+	return sorted[(n - 1) * per_mille / 1000] / 1000.0;
+}
+
+static void results_print(struct results *res)
+{
+	double sec = time_to_usec(timemono_since(res->started)) / 1e6;
+
+	qsort(res->usec, tal_count(res->usec), sizeof(u64), u64_cmp);
+	printf("%-8s %7zu %6zu %9.1f %8.2f %8.1f %8.1f %8.1f %8.1f\n",
+	       res->name, res->calls, res->errors, res->calls / sec,
+	       res->bytes / 1e6 / sec, percentile_msec(res->usec, 500),
+	       percentile_msec(res->usec, 900),
+	       percentile_msec(res->usec, 990),
+	       percentile_msec(res->usec, 1000));
+}
+
+/* The heights and txids we have fixtures for. */
+static void scan_fixtures(const tal_t *ctx, u32 **heights, char ***txids)
+{
+	DIR *d = opendir(fixtures);
+	struct dirent *e;
+
+	if (!d)
+		err(1, "Opening %s", fixtures);
+	*heights = tal_arr(ctx, u32, 0);
+	*txids = tal_arr(ctx, char *, 0);
+	while ((e = readdir(d)) != NULL) {
+		if (strstarts(e->d_name, "block-height_")) {
+			u32 h = strtoul(e->d_name + strlen("block-height_"),
+					NULL, 10);
+			// genesis is only there for getchaininfo
+			if (h != 0)
+				tal_arr_expand(heights, h);
+		} else if (strstarts(e->d_name, "tx_") &&
+			   strends(e->d_name, "_raw")) {
+			tal_arr_expand(txids,
+				       tal_strndup(ctx, e->d_name + 3, 64));
+		}
+	}
+	closedir(d);
+}
+
+static int u32_cmp(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* lightningd catching up: one block at a time, then one past the tip. */
+static void bench_sync(struct plugin_proc *pp, u32 *heights)
+{
+	struct results *res = results_start(scratch, "sync");
+	size_t n = tal_count(heights);
+
+	if (n == 0) {
+		printf("%-8s no block-height_* fixtures\n", res->name);
+		return;
+	}
+	qsort(heights, n, sizeof(u32), u32_cmp);
+	plugin_call(pp, res, "getchaininfo", "{}");
+	plugin_wait(pp);
+	for (size_t i = 0; i <= n; i++) {
+		u32 h = i < n ? heights[i] : heights[n - 1] + 1;
+		plugin_call(pp, res, "getrawblockbyheight",
+			    tal_fmt(scratch, "{\"height\":%u}", h));
+		plugin_wait(pp);
+	}
+	results_print(res);
+}
+
+/* bitcoin-cli wants strings. */
+static const char *getutxout_params(const char *txid)
+{
+	return tal_fmt(scratch, "{\"txid\":\"%s\",\"vout\":\"0\"}", txid);
+}
+
+/* Gossip coming in: many channel outputs checked at once. */
+static void bench_gossip(struct plugin_proc *pp, char **txids)
+{
+	struct results *res = results_start(scratch, "gossip");
+	size_t n = tal_count(txids);
+
+	if (n == 0) {
+		printf("%-8s no tx_*_raw fixtures\n", res->name);
+		return;
+	}
+	for (size_t i = 0; i < n; i += burst) {
+		for (size_t j = i; j < i + burst && j < n; j++)
+			plugin_call(pp, res, "getutxout",
+				    getutxout_params(txids[j]));
+		plugin_wait(pp);
+	}
+	results_print(res);
+}
+
+/* What lightningd polls. */
+static void bench_fees(struct plugin_proc *pp)
+{
+	struct results *res = results_start(scratch, "fees");
+
+	for (size_t i = 0; i < rounds; i++) {
+		plugin_call(pp, res, "estimatefees", "{}");
+		plugin_call(pp, res, "getchaininfo", "{}");
+		plugin_wait(pp);
+	}
+	results_print(res);
+}
+
+static char *opt_add_plugin_opt(const char *arg, void *unused)
+{
+	if (!strchr(arg, '='))
+		return "expected name=value";
+	tal_arr_expand(&plugin_opts, tal_strdup(plugin_opts, arg));
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	char dir[] = "/tmp/esplora-bench-XXXXXX";
+	struct plugin_proc *pp;
+	char **names;
+	u32 *heights;
+	char **txids;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	plugin_opts = tal_arr(NULL, char *, 0);
+	opt_register_arg("--plugin", opt_set_charp, opt_show_charp,
+			 &plugin_path, "The esplora plugin to run");
+	opt_register_arg("--endpoint", opt_set_charp, opt_show_charp,
+			 &endpoint, "The esplora endpoint it talks to");
+	opt_register_arg("--fixtures", opt_set_charp, opt_show_charp,
+			 &fixtures, "Directory of the recorded responses");
+	opt_register_arg("--network", opt_set_charp, opt_show_charp,
+			 &network, "What lightningd would run on");
+	opt_register_arg("--scenarios", opt_set_charp, opt_show_charp,
+			 &scenarios, "Which of sync, gossip and fees to run");
+	opt_register_arg("--burst", opt_set_uintval, opt_show_uintval, &burst,
+			 "How many outputs gossip checks at once");
+	opt_register_arg("--rounds", opt_set_uintval, opt_show_uintval,
+			 &rounds, "How many times fees polls");
+	opt_register_arg("--plugin-opt", opt_add_plugin_opt, NULL, NULL,
+			 "name=value option to give the plugin, e.g. "
+			 "esplora-prefetch=0");
+	opt_register_noarg("--verbose", opt_set_bool, &verbose,
+			   "Print what the plugin logs, and its errors");
+	opt_register_noarg("--help|-h", opt_usage_and_exit,
+			   "\nRuns the esplora plugin as lightningd would",
+			   "Print this message.");
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+	if (argc != 1)
+		opt_usage_exit_fail("no arguments expected");
+	if (burst == 0)
+		opt_usage_exit_fail("--burst must be at least 1");
+
+	signal(SIGPIPE, SIG_IGN);
+	if (!mkdtemp(dir))
+		err(1, "Creating %s", dir);
+	scratch = tal(NULL, char);
+	pp = plugin_start(NULL, dir);
+	scan_fixtures(pp, &heights, &txids);
+	printf("Plugin files are in %s\n", dir);
+
+	printf("%-8s %7s %6s %9s %8s %8s %8s %8s %8s\n", "scenario", "calls",
+	       "errors", "calls/s", "MB/s", "p50 ms", "p90 ms", "p99 ms",
+	       "max ms");
+	names = tal_strsplit(pp, scenarios, ",", STR_NO_EMPTY);
+	for (size_t i = 0; names[i]; i++) {
+		scratch = tal_free(scratch);
+		scratch = tal(NULL, char);
+		if (streq(names[i], "sync"))
+			bench_sync(pp, heights);
+		else if (streq(names[i], "gossip"))
+			bench_gossip(pp, txids);
+		else if (streq(names[i], "fees"))
+			bench_fees(pp);
+		else
+			errx(1, "Unknown scenario %s", names[i]);
+	}
+
+	plugin_stop(pp);
+	tal_free(pp);
+	tal_free(scratch);
+	tal_free(plugin_opts);
+	return 0;
+}
@@ -0,0 +1,250 @@
+/* Hex encoding and decoding of blocks and scripts, vectorized on x86-64
+ * (SSE2 is always there, AVX2 is picked at runtime) with a scalar
+ * fallback everywhere else. */
+#include <plugins/esplora_hex.h>
+#include <ccan/array_size/array_size.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HEX_X86_64 1
+#include <immintrin.h>
+#endif
+
+static const char hexchars[] = "0123456789abcdef";
+
+static void hex_encode_scalar(const u8 *src, size_t len, char *dst)
+{
+	for (size_t i = 0; i < len; i++) {
+		dst[2 * i] = hexchars[src[i] >> 4];
+		dst[2 * i + 1] = hexchars[src[i] & 0xf];
+	}
+}
+
+static int hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static bool hex_decode_scalar(const char *src, size_t len, u8 *dst)
+{
+	for (size_t i = 0; i < len; i++) {
+		int hi = hex_value(src[2 * i]), lo = hex_value(src[2 * i + 1]);
+
+		if (hi < 0 || lo < 0)
+			return false;
+		dst[i] = (hi << 4) | lo;
+	}
+	return true;
+}
+
+#ifdef HEX_X86_64
+/* Turns nibbles (one per byte) into their lowercase hex char. */
+static inline __m128i nibbles_to_hex_sse2(__m128i n)
+{
+	__m128i alpha = _mm_cmpgt_epi8(n, _mm_set1_epi8(9));
+
+	n = _mm_add_epi8(n, _mm_set1_epi8('0'));
+	return _mm_add_epi8(
+	    n, _mm_and_si128(alpha, _mm_set1_epi8('a' - '0' - 10)));
+}
+
+static void hex_encode_sse2(const u8 *src, size_t len, char *dst)
+{
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(in, 4), mask);
+		__m128i lo = _mm_and_si128(in, mask);
+
+		hi = nibbles_to_hex_sse2(hi);
+		lo = nibbles_to_hex_sse2(lo);
+		_mm_storeu_si128((__m128i *)(dst + 2 * i),
+				 _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i *)(dst + 2 * i + 16),
+				 _mm_unpackhi_epi8(hi, lo));
+	}
+	hex_encode_scalar(src + i, len - i, dst + 2 * i);
+}
+
+/* Turns 16 hex chars into their values, or sets *bad. */
+static inline __m128i hex_to_nibbles_sse2(__m128i c, __m128i *bad)
+{
+	__m128i lower = _mm_or_si128(c, _mm_set1_epi8(0x20));
+	/* Bytes >= 0x80 are negative, so they fail both ranges. */
+	__m128i digit =
+	    _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+			  _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+	__m128i alpha =
+	    _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+			  _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+
+	*bad = _mm_or_si128(*bad, _mm_cmpeq_epi8(_mm_or_si128(digit, alpha),
+						 _mm_setzero_si128()));
+	return _mm_or_si128(
+	    _mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+	    _mm_and_si128(alpha,
+			  _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10))));
+}
+
+/* Packs pairs of nibbles (high one first) into a byte per 16-bit lane. */
+static inline __m128i nibble_pairs_sse2(__m128i n)
+{
+	return _mm_or_si128(
+	    _mm_slli_epi16(_mm_and_si128(n, _mm_set1_epi16(0x00ff)), 4),
+	    _mm_srli_epi16(n, 8));
+}
+
+static bool hex_decode_sse2(const char *src, size_t len, u8 *dst)
+{
+	__m128i bad = _mm_setzero_si128();
+	size_t i = 0;
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+		__m128i b =
+		    _mm_loadu_si128((const __m128i *)(src + 2 * i + 16));
+
+		a = nibble_pairs_sse2(hex_to_nibbles_sse2(a, &bad));
+		b = nibble_pairs_sse2(hex_to_nibbles_sse2(b, &bad));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+	}
+	if (_mm_movemask_epi8(bad))
+		return false;
+	return hex_decode_scalar(src + 2 * i, len - i, dst + i);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+nibbles_to_hex_avx2(__m256i n)
+{
+	__m256i alpha = _mm256_cmpgt_epi8(n, _mm256_set1_epi8(9));
+
+	n = _mm256_add_epi8(n, _mm256_set1_epi8('0'));
+	return _mm256_add_epi8(
+	    n, _mm256_and_si256(alpha, _mm256_set1_epi8('a' - '0' - 10)));
+}
+
+__attribute__((target("avx2"))) static void
+hex_encode_avx2(const u8 *src, size_t len, char *dst)
+{
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i in = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i hi, lo;
+
+		/* Unpacking works within 128-bit lanes: put the quadwords
+		 * in order 0, 2, 1, 3 so the output comes out in order. */
+		in = _mm256_permute4x64_epi64(in, 0xd8);
+		hi = nibbles_to_hex_avx2(
+		    _mm256_and_si256(_mm256_srli_epi16(in, 4), mask));
+		lo = nibbles_to_hex_avx2(_mm256_and_si256(in, mask));
+		_mm256_storeu_si256((__m256i *)(dst + 2 * i),
+				    _mm256_unpacklo_epi8(hi, lo));
+		_mm256_storeu_si256((__m256i *)(dst + 2 * i + 32),
+				    _mm256_unpackhi_epi8(hi, lo));
+	}
+	hex_encode_sse2(src + i, len - i, dst + 2 * i);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+hex_to_nibbles_avx2(__m256i c, __m256i *bad)
+{
+	__m256i lower = _mm256_or_si256(c, _mm256_set1_epi8(0x20));
+	__m256i digit = _mm256_andnot_si256(
+	    _mm256_cmpgt_epi8(c, _mm256_set1_epi8('9')),
+	    _mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)));
+	__m256i alpha = _mm256_andnot_si256(
+	    _mm256_cmpgt_epi8(lower, _mm256_set1_epi8('f')),
+	    _mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)));
+
+	*bad = _mm256_or_si256(
+	    *bad, _mm256_cmpeq_epi8(_mm256_or_si256(digit, alpha),
+				    _mm256_setzero_si256()));
+	return _mm256_or_si256(
+	    _mm256_and_si256(digit,
+			     _mm256_sub_epi8(c, _mm256_set1_epi8('0'))),
+	    _mm256_and_si256(
+		alpha, _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10))));
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+nibble_pairs_avx2(__m256i n)
+{
+	return _mm256_or_si256(
+	    _mm256_slli_epi16(_mm256_and_si256(n, _mm256_set1_epi16(0x00ff)),
+			      4),
+	    _mm256_srli_epi16(n, 8));
+}
+
+__attribute__((target("avx2"))) static bool
+hex_decode_avx2(const char *src, size_t len, u8 *dst)
+{
+	__m256i bad = _mm256_setzero_si256();
+	size_t i = 0;
+
+	for (; i + 32 <= len; i += 32) {
+		__m256i a =
+		    _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+		__m256i b =
+		    _mm256_loadu_si256((const __m256i *)(src + 2 * i + 32));
+
+		a = nibble_pairs_avx2(hex_to_nibbles_avx2(a, &bad));
+		b = nibble_pairs_avx2(hex_to_nibbles_avx2(b, &bad));
+		/* Packing works within 128-bit lanes too. */
+		_mm256_storeu_si256(
+		    (__m256i *)(dst + i),
+		    _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8));
+	}
+	if (!_mm256_testz_si256(bad, bad))
+		return false;
+	return hex_decode_sse2(src + 2 * i, len - i, dst + i);
+}
+#endif /* HEX_X86_64 */
+
+static const struct esplora_hex_impl hex_impls[] = {
+    {"scalar", hex_encode_scalar, hex_decode_scalar},
+#ifdef HEX_X86_64
+    {"sse2", hex_encode_sse2, hex_decode_sse2},
+    {"avx2", hex_encode_avx2, hex_decode_avx2},
+#endif
+};
+
+const struct esplora_hex_impl *esplora_hex_impls(size_t *num)
+{
+	*num = ARRAY_SIZE(hex_impls);
+#ifdef HEX_X86_64
+	if (!__builtin_cpu_supports("avx2"))
+		*num -= 1;
+#endif
+	return hex_impls;
+}
+
+static const struct esplora_hex_impl *hex_best(void)
+{
+	static const struct esplora_hex_impl *best;
+
+	if (!best) {
+		size_t num;
+		const struct esplora_hex_impl *impls = esplora_hex_impls(&num);
+		best = &impls[num - 1];
+	}
+	return best;
+}
+
+void esplora_hex_encode(const u8 *src, size_t len, char *dst)
+{
+	hex_best()->encode(src, len, dst);
+}
+
+bool esplora_hex_decode(const char *src, size_t len, u8 *dst)
+{
+	return hex_best()->decode(src, len, dst);
+}
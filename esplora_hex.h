@@ -0,0 +1,28 @@
+#ifndef LIGHTNING_PLUGINS_ESPLORA_HEX_H
+#define LIGHTNING_PLUGINS_ESPLORA_HEX_H
+#include <ccan/short_types/short_types.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/* One implementation of the hex kernels. */
+struct esplora_hex_impl {
+	const char *name;
+	/* Writes 2 * len lowercase hex chars to dst, without NUL. */
+	void (*encode)(const u8 *src, size_t len, char *dst);
+	/* Reads 2 * len hex chars from src, false on a non-hex char. */
+	bool (*decode)(const char *src, size_t len, u8 *dst);
+};
+
+/* The implementations this CPU can run, the scalar one first and the
+ * fastest one last. */
+const struct esplora_hex_impl *esplora_hex_impls(size_t *num);
+
+/* Encode len bytes of src as lowercase hex into dst, which must have
+ * room for 2 * len chars; no NUL terminator is written. */
+void esplora_hex_encode(const u8 *src, size_t len, char *dst);
+
+/* Decode 2 * len hex chars (either case) from src into len bytes at
+ * dst. Returns false if there is any non-hex char. */
+bool esplora_hex_decode(const char *src, size_t len, u8 *dst);
+
+#endif /* LIGHTNING_PLUGINS_ESPLORA_HEX_H */
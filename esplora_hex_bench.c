@@ -0,0 +1,117 @@
+/* Compares the esplora hex kernels against ccan's hex_encode/hex_decode
+ * over block-sized buffers: `make plugins/esplora-hex-bench` from the
+ * lightning tree, then run it. */
+#include <plugins/esplora_hex.h>
+#include <ccan/array_size/array_size.h>
+#include <ccan/err/err.h>
+#include <ccan/str/hex/hex.h>
+#include <ccan/time/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* From an empty block to a full segwit one. */
+static const size_t block_sizes[] = {
+    285, 64 * 1024, 512 * 1024, 1300 * 1024, 2 * 1024 * 1024,
+    4 * 1000 * 1000,
+};
+
+/* How many bytes each measurement goes through. */
+#define BENCH_BYTES (256 * 1024 * 1024)
+
+static volatile u8 sink;
+
+static double mb_per_sec(size_t len, size_t runs, struct timemono start)
+{
+	u64 nsec = time_to_nsec(timemono_between(time_mono(), start));
+
+	return (double)len * runs / 1e6 / (nsec ? nsec / 1e9 : 1e-9);
+}
+
+static void bench_ccan(const u8 *block, size_t len, char *hex, u8 *out,
+		       size_t runs)
+{
+	struct timemono start;
+	double enc, dec;
+
+	start = time_mono();
+	for (size_t i = 0; i < runs; i++) {
+		hex_encode(block, len, hex, hex_str_size(len));
+		sink ^= hex[i % (2 * len)];
+	}
+	enc = mb_per_sec(len, runs, start);
+
+	start = time_mono();
+	for (size_t i = 0; i < runs; i++) {
+		if (!hex_decode(hex, 2 * len, out, len))
+			errx(1, "ccan hex_decode failed");
+		sink ^= out[i % len];
+	}
+	dec = mb_per_sec(len, runs, start);
+
+	printf("%10zu %-8s %10.1f %10.1f\n", len, "ccan", enc, dec);
+}
+
+static void bench_impl(const struct esplora_hex_impl *impl, const u8 *block,
+		       size_t len, char *hex, u8 *out, size_t runs)
+{
+	struct timemono start;
+	double enc, dec;
+	char *ref = malloc(hex_str_size(len));
+
+	// check it against ccan before timing it
+	hex_encode(block, len, ref, hex_str_size(len));
+	impl->encode(block, len, hex);
+	if (memcmp(hex, ref, 2 * len) != 0)
+		errx(1, "%s: encoding of %zu bytes differs", impl->name, len);
+	if (!impl->decode(hex, len, out) || memcmp(out, block, len) != 0)
+		errx(1, "%s: decoding of %zu bytes differs", impl->name, len);
+	free(ref);
+
+	start = time_mono();
+	for (size_t i = 0; i < runs; i++) {
+		impl->encode(block, len, hex);
+		sink ^= hex[i % (2 * len)];
+	}
+	enc = mb_per_sec(len, runs, start);
+
+	start = time_mono();
+	for (size_t i = 0; i < runs; i++) {
+		if (!impl->decode(hex, len, out))
+			errx(1, "%s: decoding failed", impl->name);
+		sink ^= out[i % len];
+	}
+	dec = mb_per_sec(len, runs, start);
+
+	printf("%10zu %-8s %10.1f %10.1f\n", len, impl->name, enc, dec);
+}
+
+int main(void)
+{
+	const struct esplora_hex_impl *impls;
+	size_t num_impls;
+
+	impls = esplora_hex_impls(&num_impls);
+	srandom(42);
+
+	printf("%10s %-8s %10s %10s\n", "bytes", "impl", "enc MB/s",
+	       "dec MB/s");
+	for (size_t i = 0; i < ARRAY_SIZE(block_sizes); i++) {
+		size_t len = block_sizes[i];
+		size_t runs = BENCH_BYTES / len + 1;
+		u8 *block = malloc(len), *out = malloc(len);
+		char *hex = malloc(hex_str_size(len));
+
+		for (size_t j = 0; j < len; j++)
+			block[j] = random();
+
+		bench_ccan(block, len, hex, out, runs);
+		for (size_t j = 0; j < num_impls; j++)
+			bench_impl(&impls[j], block, len, hex, out, runs);
+
+		free(block);
+		free(out);
+		free(hex);
+	}
+	return 0;
+}
@@ -0,0 +1,724 @@
+/* A local esplora that replays recorded responses, for benchmarking the
+ * plugin offline: `make plugins/esplora-mock` from the lightning tree,
+ * record fixtures with esplora_record.sh, then run it. Each GET of
+ * /a/b/c is answered with the fixture file a_b_c, after the configured
+ * latency, and some answers can be made to fail. Ranges of fixtures are
+ * served too, to resume transfers we cut off. With --electrum-port, it
+ * stands in for an Electrum server as well, answering from the same
+ * fixtures. */
+#include <arpa/inet.h>
+#include <ccan/crypto/sha256/sha256.h>
+#include <ccan/err/err.h>
+#include <ccan/opt/opt.h>
+#include <ccan/short_types/short_types.h>
+#include <ccan/str/hex/hex.h>
+#include <ccan/str/str.h>
+#include <ccan/strmap/strmap.h>
+#include <ccan/tal/grab_file/grab_file.h>
+#include <ccan/tal/path/path.h>
+#include <ccan/tal/str/str.h>
+#include <ccan/time/time.h>
+#include <ctype.h>
+#include <errno.h>
+#include <external/jsmn/jsmn.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/* What we were told to do. */
+static const char *fixtures = "fixtures";
+static unsigned int port = 3000, electrum_port;
+static unsigned int latency_msec, jitter_msec;
+/* In percent of the requests. */
+static unsigned int error_rate, throttle_rate, drop_rate, cut_rate;
+static bool verbose;
+
+/* Fixtures we already read, by file name. */
+static STRMAP(char *) bodies;
+
+/* Freed after each round of the loop. */
+static tal_t *scratch;
+
+enum conn_state {
+	/* Waiting for (the rest of) a request. */
+	CONN_READING,
+	/* Holding the answer until `ready`. */
+	CONN_WAITING,
+	CONN_WRITING,
+};
+
+struct conn {
+	int fd;
+	enum conn_state state;
+
+	/* Does it speak Electrum's line-based JSON-RPC rather than HTTP ? */
+	bool electrum;
+
+	/* What we received so far (NUL-terminated), and what we answer. */
+	char *in;
+	size_t in_len;
+	bool continued;
+	char *out;
+	size_t out_len, written;
+
+	struct timemono ready;
+	bool close_after;
+};
+
+static struct conn **conns;
+
+static bool chance(unsigned int percent)
+{
+	return percent && (unsigned int)(random() % 100) < percent;
+}
+
+/* The body of the fixture for `path`, NULL if there's none. */
+static const char *fixture(const char *path)
+{
+	char *name, *body;
+
+	if (strstr(path, ".."))
+		return NULL;
+	name = tal_strdup(scratch, path + (path[0] == '/'));
+	for (char *p = name; *p; p++) {
+		if (*p == '/')
+			*p = '_';
+	}
+
+	body = strmap_get(&bodies, name);
+	if (body)
+		return body;
+	body = grab_file(NULL, path_join(scratch, fixtures, name));
+	if (!body)
+		return NULL;
+	tal_resize(&body, tal_count(body) - 1);
+	strmap_add(&bodies, tal_steal(body, name), body);
+	return body;
+}
+
+/* What esplora answers to a POST /tx: its txid. We don't strip the
+ * witness, the plugin doesn't look at it anyway. */
+static char *broadcast_answer(const tal_t *ctx, const char *hex, size_t len)
+{
+	struct sha256 once, h;
+	u8 *tx = tal_arr(scratch, u8, hex_data_size(len));
+	char *txid;
+
+	if (!hex_decode(hex, len, tx, tal_count(tx)))
+		return NULL;
+	sha256(&once, tx, tal_count(tx));
+	sha256(&h, &once, sizeof(once));
+	for (size_t i = 0; i < sizeof(h) / 2; i++) {
+		u8 b = h.u.u8[i];
+		h.u.u8[i] = h.u.u8[sizeof(h) - 1 - i];
+		h.u.u8[sizeof(h) - 1 - i] = b;
+	}
+	txid = tal_arr(ctx, char, hex_str_size(sizeof(h)));
+	hex_encode(&h, sizeof(h), txid, tal_count(txid));
+	return txid;
+}
+
+/* Send `c->out` once the configured latency is over. */
+static void answer_later(struct conn *c)
+{
+	c->written = 0;
+	c->ready = timemono_add(time_mono(), time_from_msec(latency_msec));
+	if (jitter_msec)
+		c->ready = timemono_add(
+		    c->ready, time_from_msec(random() % (jitter_msec + 1)));
+	c->state = CONN_WAITING;
+}
+
+/* `extra` are more headers, each ending with \r\n. */
+static void answer(struct conn *c, int status, const char *reason,
+		   const char *extra, const char *body, size_t len)
+{
+	c->out = tal_fmt(c,
+			 "HTTP/1.1 %d %s\r\n"
+			 "Content-Length: %zu\r\n"
+			 "Content-Type: text/plain\r\n"
+			 "%s%s\r\n",
+			 status, reason, len, extra,
+			 c->close_after ? "Connection: close\r\n" : "");
+	c->out_len = strlen(c->out);
+	tal_resize(&c->out, c->out_len + len);
+	memcpy(c->out + c->out_len, body, len);
+	c->out_len += len;
+	answer_later(c);
+}
+
+/* What follows `line` (e.g. "content-length:") in the (lowercased)
+ * headers from `head` to `end`, NULL if it's not there. */
+static const char *header(const char *head, const char *end,
+			  const char *line)
+{
+	const char *p = strstr(head, tal_fmt(scratch, "\r\n%s", line));
+
+	return p && p < end ? p + 2 + strlen(line) : NULL;
+}
+
+/* Answer with a fixture, or the part of it the request asks for. */
+static void answer_fixture(struct conn *c, const char *end, const char *body)
+{
+	const char *range = header(c->in, end, "range: bytes=");
+	size_t len = tal_count(body), from = 0;
+	char *extra;
+
+	if (!range) {
+		answer(c, 200, "OK", "", body, len);
+	} else if ((from = strtoul(range, NULL, 10)) >= len) {
+		extra = tal_fmt(scratch, "Content-Range: bytes */%zu\r\n", len);
+		answer(c, 416, "Range Not Satisfiable", extra, "", 0);
+		return;
+	} else {
+		extra = tal_fmt(scratch, "Content-Range: bytes %zu-%zu/%zu\r\n",
+				from, len - 1, len);
+		answer(c, 206, "Partial Content", extra, body + from,
+		       len - from);
+	}
+
+	// hang up halfway through the body
+	if (len - from > 1 && chance(cut_rate)) {
+		c->out_len -= (len - from) / 2;
+		c->close_after = true;
+	}
+}
+
+/* Answer the request at the start of `c->in`, if we have all of it,
+ * and return how much of the buffer it took. */
+static size_t handle_request(struct conn *c)
+{
+	char *end = strstr(c->in, "\r\n\r\n");
+	char method[8], path[1024];
+	const char *cl, *body;
+	size_t head_len, body_len = 0;
+
+	if (!end)
+		return 0;
+	head_len = end + 4 - c->in;
+	// header names are case-insensitive, the request line isn't
+	for (char *p = strstr(c->in, "\r\n"); p < end; p++)
+		*p = tolower(*p);
+	cl = header(c->in, end, "content-length:");
+	if (cl)
+		body_len = strtoul(cl, NULL, 10);
+	if (c->in_len < head_len + body_len) {
+		// curl waits a second for this before sending a large body
+		if (!c->continued && header(c->in, end, "expect:")) {
+			const char *cont = "HTTP/1.1 100 Continue\r\n\r\n";
+			c->continued = write(c->fd, cont, strlen(cont)) > 0;
+		}
+		return 0;
+	}
+	c->continued = false;
+	if (sscanf(c->in, "%7s %1023s", method, path) != 2)
+		errx(1, "Could not parse request: %.*s", (int)head_len, c->in);
+	c->close_after = header(c->in, end, "connection: close") != NULL;
+	if (verbose)
+		printf("%s %s\n", method, path);
+
+	if (chance(drop_rate)) {
+		c->close_after = true;
+		c->out = NULL;
+		c->out_len = c->written = 0;
+		c->state = CONN_WRITING;
+	} else if (chance(throttle_rate)) {
+		answer(c, 429, "Too Many Requests", "", "", 0);
+	} else if (chance(error_rate)) {
+		answer(c, 500, "Internal Server Error", "", "oops", 4);
+	} else if (streq(method, "POST") && streq(path, "/tx")) {
+		char *txid = broadcast_answer(c, c->in + head_len, body_len);
+		if (txid)
+			answer(c, 200, "OK", "", txid, strlen(txid));
+		else
+			answer(c, 400, "Bad Request", "", "invalid hex", 11);
+	} else if ((body = fixture(path)) != NULL) {
+		answer_fixture(c, end, body);
+	} else if (strends(path, "/status")) {
+		// nothing we broadcast ever confirms
+		body = "{\"confirmed\":false}";
+		answer(c, 200, "OK", "", body, strlen(body));
+	} else {
+		answer(c, 404, "Not Found", "", "Not found", 9);
+	}
+	return head_len + body_len;
+}
+
+static jsmntok_t *json_parse(const tal_t *ctx, const char *buf, size_t len)
+{
+	jsmn_parser parser;
+	jsmntok_t *toks;
+	int n;
+
+	jsmn_init(&parser);
+	n = jsmn_parse(&parser, buf, len, NULL, 0);
+	if (n <= 0)
+		return NULL;
+	toks = tal_arr(ctx, jsmntok_t, n);
+	jsmn_init(&parser);
+	if (jsmn_parse(&parser, buf, len, toks, n) != n)
+		return tal_free(toks);
+	return toks;
+}
+
+/* The token after `t` and whatever it holds. */
+static const jsmntok_t *json_skip(const jsmntok_t *t)
+{
+	const jsmntok_t *next = t + 1;
+
+	for (int i = 0; i < t->size; i++)
+		next = json_skip(next);
+	return next;
+}
+
+static bool json_streq(const char *buf, const jsmntok_t *t, const char *s)
+{
+	return t->end - t->start == (int)strlen(s) &&
+	       memcmp(buf + t->start, s, t->end - t->start) == 0;
+}
+
+static const jsmntok_t *json_member(const char *buf, const jsmntok_t *obj,
+				    const char *name)
+{
+	const jsmntok_t *t = obj + 1;
+
+	if (obj->type != JSMN_OBJECT)
+		return NULL;
+	for (int i = 0; i < obj->size; i++, t = json_skip(t)) {
+		if (json_streq(buf, t, name))
+			return t + 1;
+	}
+	return NULL;
+}
+
+/* The `i`th parameter, "" if there's none. */
+static const char *electrum_param(const char *buf, const jsmntok_t *params,
+				  int i)
+{
+	const jsmntok_t *t;
+
+	if (!params || params->type != JSMN_ARRAY || i >= params->size)
+		return "";
+	t = params + 1;
+	while (i-- > 0)
+		t = json_skip(t);
+	return tal_strndup(scratch, buf + t->start, t->end - t->start);
+}
+
+/* The raw header at `height`, in hex: NULL unless we have its block. */
+static char *electrum_header(u32 height)
+{
+	const char *hash, *block;
+	char *hex;
+
+	hash = fixture(tal_fmt(scratch, "/block-height/%u", height));
+	if (!hash)
+		return NULL;
+	block = fixture(tal_fmt(scratch, "/block/%.*s/raw",
+				(int)tal_count(hash), hash));
+	if (!block || tal_count(block) < 80)
+		return NULL;
+	hex = tal_arr(scratch, char, hex_str_size(80));
+	hex_encode(block, 80, hex, tal_count(hex));
+	return hex;
+}
+
+/* What an Electrum server would answer `method` with, as JSON, or NULL
+ * with the error `*code` and `*msg`. */
+static const char *electrum_result(const char *buf, const jsmntok_t *method,
+				   const jsmntok_t *params, int *code,
+				   const char **msg)
+{
+	const char *arg = electrum_param(buf, params, 0), *body;
+	const jsmntok_t *toks, *fee;
+	char *hex, *hexes;
+	u32 height, count, n;
+	double sat_per_vb;
+
+	*code = 1;
+	if (json_streq(buf, method, "server.version"))
+		return "[\"esplora-mock\",\"1.4\"]";
+
+	if (json_streq(buf, method, "blockchain.headers.subscribe")) {
+		body = fixture("/blocks/tip/height");
+		if (!body)
+			goto missing;
+		height = strtoul(tal_strndup(scratch, body, tal_count(body)),
+				 NULL, 10);
+		hex = electrum_header(height);
+		if (!hex)
+			goto missing;
+		return tal_fmt(scratch, "{\"height\":%u,\"hex\":\"%s\"}",
+			       height, hex);
+	}
+
+	if (json_streq(buf, method, "blockchain.block.header")) {
+		hex = electrum_header(strtoul(arg, NULL, 10));
+		if (!hex)
+			goto missing;
+		return tal_fmt(scratch, "\"%s\"", hex);
+	}
+
+	// as many as we have from there, up to `count`
+	if (json_streq(buf, method, "blockchain.block.headers")) {
+		height = strtoul(arg, NULL, 10);
+		count = strtoul(electrum_param(buf, params, 1), NULL, 10);
+		hexes = tal_strdup(scratch, "");
+		for (n = 0; n < count && (hex = electrum_header(height + n));
+		     n++)
+			tal_append_fmt(&hexes, "%s", hex);
+		return tal_fmt(scratch,
+			       "{\"count\":%u,\"hex\":\"%s\",\"max\":2016}", n,
+			       hexes);
+	}
+
+	// esplora's are in sat/vB, Electrum's in BTC/kvB
+	if (json_streq(buf, method, "blockchain.estimatefee")) {
+		body = fixture("/fee-estimates");
+		toks = body ? json_parse(scratch, body, tal_count(body)) : NULL;
+		fee = toks ? json_member(body, toks, arg) : NULL;
+		if (!fee)
+			return "-1";
+		sat_per_vb = strtod(tal_strndup(scratch, body + fee->start,
+						fee->end - fee->start),
+				    NULL);
+		return tal_fmt(scratch, "%.8f", sat_per_vb / 100000);
+	}
+
+	if (json_streq(buf, method, "blockchain.transaction.get")) {
+		body = fixture(tal_fmt(scratch, "/tx/%s/raw", arg));
+		if (!body)
+			goto missing;
+		hex = tal_arr(scratch, char, hex_str_size(tal_count(body)));
+		hex_encode(body, tal_count(body), hex, tal_count(hex));
+		return tal_fmt(scratch, "\"%s\"", hex);
+	}
+
+	if (json_streq(buf, method, "blockchain.transaction.broadcast")) {
+		hex = broadcast_answer(scratch, arg, strlen(arg));
+		if (!hex) {
+			*msg = "invalid hex";
+			return NULL;
+		}
+		return tal_fmt(scratch, "\"%s\"", hex);
+	}
+
+	// we record no script hashes: unless told otherwise, it's all spent
+	if (json_streq(buf, method, "blockchain.scripthash.listunspent")) {
+		body = fixture(tal_fmt(scratch, "/scripthash/%s/listunspent",
+				       arg));
+		if (!body)
+			return "[]";
+		return tal_strndup(scratch, body, tal_count(body));
+	}
+
+	*code = -32601;
+	*msg = "unknown method";
+	return NULL;
+
+missing:
+	*msg = "not found";
+	return NULL;
+}
+
+/* The answer to the call `t`. */
+static char *electrum_answer(const char *buf, const jsmntok_t *t)
+{
+	const jsmntok_t *id = json_member(buf, t, "id");
+	const jsmntok_t *method = json_member(buf, t, "method");
+	const char *msg, *result = NULL;
+	int code;
+
+	if (!id || !method)
+		errx(1, "Could not parse Electrum call: %.*s",
+		     t->end - t->start, buf + t->start);
+	if (verbose)
+		printf("%.*s\n", method->end - method->start,
+		       buf + method->start);
+
+	if (chance(error_rate)) {
+		code = 1;
+		msg = "oops";
+	} else
+		result = electrum_result(buf, method,
+					 json_member(buf, t, "params"), &code,
+					 &msg);
+	if (result)
+		return tal_fmt(scratch,
+			       "{\"jsonrpc\":\"2.0\",\"id\":%.*s,"
+			       "\"result\":%s}",
+			       id->end - id->start, buf + id->start, result);
+	return tal_fmt(scratch,
+		       "{\"jsonrpc\":\"2.0\",\"id\":%.*s,"
+		       "\"error\":{\"code\":%d,\"message\":\"%s\"}}",
+		       id->end - id->start, buf + id->start, code, msg);
+}
+
+/* Answer the line at the start of `c->in` (a call, or a batch of them),
+ * if we have all of it, and return how much of the buffer it took. */
+static size_t handle_electrum(struct conn *c)
+{
+	char *nl = memchr(c->in, '\n', c->in_len);
+	const jsmntok_t *toks, *t;
+
+	if (!nl)
+		return 0;
+	toks = json_parse(scratch, c->in, nl - c->in);
+	if (!toks)
+		errx(1, "Could not parse Electrum request: %.*s",
+		     (int)(nl - c->in), c->in);
+
+	if (chance(drop_rate)) {
+		c->close_after = true;
+		c->out = NULL;
+		c->out_len = c->written = 0;
+		c->state = CONN_WRITING;
+		return nl + 1 - c->in;
+	}
+	if (toks->type == JSMN_ARRAY) {
+		c->out = tal_strdup(c, "[");
+		t = toks + 1;
+		for (int i = 0; i < toks->size; i++, t = json_skip(t))
+			tal_append_fmt(&c->out, "%s%s", i ? "," : "",
+				       electrum_answer(c->in, t));
+		tal_append_fmt(&c->out, "]\n");
+	} else
+		c->out = tal_fmt(c, "%s\n", electrum_answer(c->in, toks));
+	c->out_len = strlen(c->out);
+	answer_later(c);
+	return nl + 1 - c->in;
+}
+
+static size_t handle(struct conn *c)
+{
+	return c->electrum ? handle_electrum(c) : handle_request(c);
+}
+
+static void destroy_conn(struct conn *c)
+{
+	close(c->fd);
+	for (size_t i = 0; i < tal_count(conns); i++) {
+		if (conns[i] == c) {
+			tal_arr_remove(&conns, i);
+			break;
+		}
+	}
+}
+
+static void conn_consume(struct conn *c, size_t used)
+{
+	memmove(c->in, c->in + used, c->in_len - used + 1);
+	c->in_len -= used;
+}
+
+static void conn_read(struct conn *c)
+{
+	ssize_t r;
+	size_t used;
+
+	if (tal_count(c->in) < c->in_len + 65536 + 1)
+		tal_resize(&c->in, c->in_len + 65536 + 1);
+	r = read(c->fd, c->in + c->in_len, tal_count(c->in) - c->in_len - 1);
+	if (r <= 0) {
+		if (r < 0 && errno == EAGAIN)
+			return;
+		tal_free(c);
+		return;
+	}
+	c->in_len += r;
+	c->in[c->in_len] = '\0';
+	if (c->state != CONN_READING)
+		return;
+
+	used = handle(c);
+	conn_consume(c, used);
+}
+
+static void conn_write(struct conn *c)
+{
+	ssize_t r;
+
+	if (c->written < c->out_len) {
+		r = write(c->fd, c->out + c->written, c->out_len - c->written);
+		if (r < 0) {
+			if (errno != EAGAIN)
+				tal_free(c);
+			return;
+		}
+		c->written += r;
+	}
+	if (c->written < c->out_len)
+		return;
+
+	c->out = tal_free(c->out);
+	if (c->close_after) {
+		tal_free(c);
+		return;
+	}
+	c->state = CONN_READING;
+	// curl doesn't pipeline (the plugin does with Electrum), but the
+	// next one may already be there
+	if (c->in_len)
+		conn_consume(c, handle(c));
+}
+
+/* How long until we answer (msec), rounded up. */
+static int conn_wait_msec(const struct conn *c, struct timemono now)
+{
+	if (!timemono_after(c->ready, now))
+		return 0;
+	return time_to_msec(timemono_between(c->ready, now)) + 1;
+}
+
+static void accept_conn(int listen_fd, bool electrum)
+{
+	struct conn *c;
+	int fd = accept(listen_fd, NULL, NULL);
+
+	if (fd < 0)
+		return;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	c = tal(conns, struct conn);
+	c->fd = fd;
+	c->state = CONN_READING;
+	c->electrum = electrum;
+	c->in = tal_arrz(c, char, 1);
+	c->in_len = 0;
+	c->continued = false;
+	c->out = NULL;
+	c->out_len = c->written = 0;
+	c->close_after = false;
+	tal_add_destructor(c, destroy_conn);
+	tal_arr_expand(&conns, c);
+}
+
+static int open_listener(unsigned int listen_port)
+{
+	struct sockaddr_in addr;
+	int fd = socket(AF_INET, SOCK_STREAM, 0), one = 1;
+
+	if (fd < 0)
+		err(1, "socket");
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(listen_port);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+		err(1, "Binding to port %u", listen_port);
+	if (listen(fd, 64) != 0)
+		err(1, "listen");
+	return fd;
+}
+
+int main(int argc, char *argv[])
+{
+	int listen_fd, electrum_fd = -1;
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	opt_register_arg("--fixtures", opt_set_charp, opt_show_charp,
+			 &fixtures, "Directory of the recorded responses");
+	opt_register_arg("--port", opt_set_uintval, opt_show_uintval, &port,
+			 "Port to listen on, on localhost");
+	opt_register_arg("--electrum-port", opt_set_uintval, opt_show_uintval,
+			 &electrum_port,
+			 "Port to answer Electrum calls on, if any");
+	opt_register_arg("--latency", opt_set_uintval, opt_show_uintval,
+			 &latency_msec, "Milliseconds before answering");
+	opt_register_arg("--jitter", opt_set_uintval, opt_show_uintval,
+			 &jitter_msec,
+			 "Up to how many more milliseconds, at random");
+	opt_register_arg("--error-rate", opt_set_uintval, opt_show_uintval,
+			 &error_rate, "Percentage of 500 answers");
+	opt_register_arg("--throttle-rate", opt_set_uintval,
+			 opt_show_uintval, &throttle_rate,
+			 "Percentage of 429 answers");
+	opt_register_arg("--drop-rate", opt_set_uintval, opt_show_uintval,
+			 &drop_rate,
+			 "Percentage of connections closed without answer");
+	opt_register_arg("--cut-rate", opt_set_uintval, opt_show_uintval,
+			 &cut_rate,
+			 "Percentage of answers cut off halfway through");
+	opt_register_noarg("--verbose", opt_set_bool, &verbose,
+			   "Print each request");
+	opt_register_noarg("--help|-h", opt_usage_and_exit,
+			   "\nA local esplora replaying recorded responses",
+			   "Print this message.");
+	opt_parse(&argc, argv, opt_log_stderr_exit);
+	if (argc != 1)
+		opt_usage_exit_fail("no arguments expected");
+
+	signal(SIGPIPE, SIG_IGN);
+	srandom(time_mono().ts.tv_nsec);
+	strmap_init(&bodies);
+	conns = tal_arr(NULL, struct conn *, 0);
+	listen_fd = open_listener(port);
+	printf("Serving %s on http://127.0.0.1:%u\n", fixtures, port);
+	if (electrum_port) {
+		electrum_fd = open_listener(electrum_port);
+		printf("And to Electrum clients on 127.0.0.1:%u\n",
+		       electrum_port);
+	}
+
+	for (;;) {
+		size_t n = tal_count(conns);
+		struct pollfd *fds;
+		struct conn **polled;
+		struct timemono now = time_mono();
+		int timeout = -1;
+
+		scratch = tal(NULL, char);
+		fds = tal_arr(scratch, struct pollfd, n + 2);
+		// they may go away as we handle them
+		polled = tal_dup_talarr(scratch, struct conn *, conns);
+
+		// poll() ignores a negative fd
+		fds[0].fd = listen_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = electrum_fd;
+		fds[1].events = POLLIN;
+		for (size_t i = 0; i < n; i++) {
+			struct conn *c = polled[i];
+			fds[i + 2].fd = c->fd;
+			fds[i + 2].events = 0;
+			if (c->state == CONN_READING)
+				fds[i + 2].events = POLLIN;
+			else if (c->state == CONN_WRITING)
+				fds[i + 2].events = POLLOUT;
+			else {
+				int msec = conn_wait_msec(c, now);
+				if (timeout < 0 || msec < timeout)
+					timeout = msec;
+			}
+		}
+
+		if (poll(fds, n + 2, timeout) < 0 && errno != EINTR)
+			err(1, "poll");
+
+		now = time_mono();
+		for (size_t i = 0; i < n; i++) {
+			struct conn *c = polled[i];
+			if (c->state == CONN_WAITING &&
+			    !timemono_after(c->ready, now))
+				c->state = CONN_WRITING;
+			if (fds[i + 2].revents & (POLLERR | POLLHUP) &&
+			    !(fds[i + 2].revents & POLLIN))
+				tal_free(c);
+			else if (fds[i + 2].revents & POLLIN)
+				conn_read(c);
+			else if (c->state == CONN_WRITING)
+				conn_write(c);
+		}
+		if (fds[0].revents & POLLIN)
+			accept_conn(listen_fd, false);
+		if (fds[1].revents & POLLIN)
+			accept_conn(electrum_fd, true);
+		scratch = tal_free(scratch);
+	}
+}
@@ -0,0 +1,54 @@
+#!/bin/sh
+#
+# Record what the plugin asks esplora for while lightningd syncs a range
+# of blocks and checks some of their outputs, as fixtures esplora_mock.c
+# can replay: the answer to /a/b/c is saved as <dir>/a_b_c.
+#
+# usage: esplora_record.sh <endpoint> <first height> <count> [dir]
+# e.g. esplora_record.sh https://blockstream.info/api 700000 50
+
+set -e
+
+URL=${1:?usage: $0 <endpoint> <first height> <count> [dir]}
+FROM=${2:?first height missing}
+COUNT=${3:?count missing}
+DIR=${4:-fixtures}
+# how many transactions of each block getutxout is benchmarked on
+TXS=${TXS:-4}
+
+LAST=$((FROM + COUNT - 1))
+
+get() {
+	curl -sSf --retry 3 -o "$DIR/$(echo "${1#/}" | tr / _)" "$URL$1"
+}
+
+mkdir -p "$DIR"
+get /block-height/0
+# Electrum stand-ins serve the genesis header from it
+get /block/$(cat "$DIR/block-height_0")/raw
+get /fee-estimates
+
+h=$FROM
+while [ $h -le $LAST ]; do
+	get /block-height/$h
+	hash=$(cat "$DIR/block-height_$h")
+	get /block/$hash/raw
+	# hashes are resolved by batches of 10 blocks down from a height
+	get /blocks/$h
+	for txid in $(curl -sSf "$URL/block/$hash/txids" | tr -d '[]"' |
+		tr , '\n' | head -n $TXS); do
+		get /tx/$txid/raw
+		get /tx/$txid/outspends
+	done
+	echo "$h ($hash)"
+	h=$((h + 1))
+done
+
+# Our last block is the tip, which is what esplora answers for the
+# batches past it.
+printf %s $LAST > "$DIR/blocks_tip_height"
+cp "$DIR/block-height_$LAST" "$DIR/blocks_tip_hash"
+get /block/$(cat "$DIR/blocks_tip_hash")
+for h in $(seq $((LAST + 1)) $((LAST + 9))); do
+	cp "$DIR/blocks_$LAST" "$DIR/blocks_$h"
+done